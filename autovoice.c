@@ -53,6 +53,7 @@ static void autovoice_enable_channel(const char *channel)
 
 	strncpy(newent->name, channel, sizeof newent->name);
 	newent->name[sizeof newent->name-1]=0;
+	newent->naughty_head=0;
 	newent->next=enabled_channels;
 	enabled_channels=newent;
 
@@ -130,46 +131,43 @@ static void remove_naughty(struct channel_list *ch, const char *nick)
 	/* remove the entry from the list */
 	*prev=curr->next;
 	free(curr);
-
-	/* TODO: remove entry from voice queue */
 }
 
-static void av_onjoin(void *p, struct message *msg)
+static int av_onjoin(void *p, struct message *msg)
 {
-	char ray[MAXDATASIZE];
 	struct channel_list *ch;
 
 	if (!is_autovoice_enabled)
 	{
-		return;
+		return NOTIFY_CONTINUE;
 	}
 
 	assert(msg!=NULL);
-	if(!msg) return;
-	if(!msg->msgto[0]) return; /* ignore msgto */
-	if(!msg->nick[0]) return; /* ignore nick - seems weird */
+	if(!msg) return NOTIFY_CONTINUE;
+	if(!msg_to(msg)[0]) return NOTIFY_CONTINUE; /* ignore msgto */
+	if(!msg_nick(msg)[0]) return NOTIFY_CONTINUE; /* ignore nick - seems weird */
 	/* TODO: check nick!user@host for bans with fnmatch() */
 
 	if(verbose>2) {
-		INFO("autovoice: Saw a join - msgto:'%s' nick:'%s'\n", msg->msgto, msg->nick);
+		INFO("autovoice: Saw a join - msgto:'%s' nick:'%s'\n", msg_to(msg), msg_nick(msg));
 	}
 
-	ch=autovoice_channel_lookup(msg->msgto);
+	ch=autovoice_channel_lookup(msg_to(msg));
 	if(ch) {
-		if(is_naughty(ch, msg->nick)) {
+		if(is_naughty(ch, msg_nick(msg))) {
 			if(verbose>0) {
-				INFO("autovoice: nick %s won't be voiced in %s.\n", msg->nick, msg->msgto);
+				INFO("autovoice: nick %s won't be voiced in %s.\n", msg_nick(msg), msg_to(msg));
 			}
 
-			return; /* do no voice people who were -v'd */
+			return NOTIFY_CONTINUE; /* do no voice people who were -v'd */
 		}
-		/* TODO: delay and forget voicing if someone voices first */
-		snprintf( ray, MAXDATASIZE, "mode %s +v %s", msg->msgto, msg->nick );
-		send_irc_message( ray );
+		/* batched with other joins, and forgotten if someone voices first */
+		mode_queue(msg_to(msg), "+v", msg_nick(msg));
 	}
+	return NOTIFY_CONTINUE;
 }
 
-static void av_onmode(void *p, struct message *msg)
+static int av_onmode(void *p, struct message *msg)
 {
 	char buf[MAXNICKSIZE];
 	char flag[2];
@@ -178,23 +176,23 @@ static void av_onmode(void *p, struct message *msg)
 
 	/* TODO: find autovoice channel entry */
 	assert(msg!=NULL);
-	if(!msg) return;
-	if(!msg->msgto[0]) return; /* ignore msgto */
-	if(!msg->nick[0]) return; /* ignore nick - seems weird */
+	if(!msg) return NOTIFY_CONTINUE;
+	if(!msg_to(msg)[0]) return NOTIFY_CONTINUE; /* ignore msgto */
+	if(!msg_nick(msg)[0]) return NOTIFY_CONTINUE; /* ignore nick - seems weird */
 
-	ch=autovoice_channel_lookup(msg->msgto);
+	ch=autovoice_channel_lookup(msg_to(msg));
 	if(!ch) {
 		if(verbose>0) {
-			INFO("autovoice: ignored %s - not a channel we are monitoring\n", msg->msgto);
+			INFO("autovoice: ignored %s - not a channel we are monitoring\n", msg_to(msg));
 		}
-		return; /* ignore - not a channel we are monitoring */
+		return NOTIFY_CONTINUE; /* ignore - not a channel we are monitoring */
 	}
 
-	parse_mode_begin(&mp, msg->fulltext);
+	parse_mode_begin(&mp, msg_text(msg));
 	while(parse_mode_next(&mp, flag, buf, sizeof buf)){
 		if(verbose>1) {
 			INFO("autovoice: MODE %s %c%c %s\n",
-				msg->msgto,
+				msg_to(msg),
 				flag[0],
 				flag[1],
 				buf
@@ -210,6 +208,7 @@ static void av_onmode(void *p, struct message *msg)
 			}
 		}
 	}
+	return NOTIFY_CONTINUE;
 }
 
 int autovoice_init(struct config_node *config_root)
@@ -247,10 +246,10 @@ int autovoice_init(struct config_node *config_root)
 	}
 
 
-	notify_register("JOIN", av_onjoin, 0);
-	notify_register("MODE", av_onmode, 0);
+	notify_register("JOIN", "av_onjoin", av_onjoin, 0, NOTIFY_PRIO_DEFAULT, 0);
+	notify_register("MODE", "av_onmode", av_onmode, 0, NOTIFY_PRIO_DEFAULT, 0);
 	/* get the CHANMODES */
-	/* notify_register("005", av_on005, 0); */
+	/* notify_register("005", "av_on005", av_on005, 0, NOTIFY_PRIO_DEFAULT, 0); */
 	return 1; /* succcess */
 }
 
@@ -0,0 +1,91 @@
+/* bloom.c : bloom filter for negative lookups */
+/*
+ * a bloom filter answers "definitely not present" without touching the
+ * real table. keys are added as a hash value computed by the caller, so the
+ * filter has to be probed with the same hash function that filled it.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bloom.h"
+
+#define BLOOM_MIN_BITS 64
+
+/** size a filter for nr_keys at bits_per_key.
+ * returns 0 on failure */
+int bloom_init(struct bloom *b, unsigned nr_keys, unsigned bits_per_key) {
+	assert(b!=NULL);
+
+	memset(b, 0, sizeof *b);
+	if(!bits_per_key) return 0; /* disabled */
+
+	b->nbits=nr_keys*bits_per_key;
+	if(b->nbits<BLOOM_MIN_BITS) b->nbits=BLOOM_MIN_BITS;
+	/* k=ln(2)*m/n gives the lowest false positive rate */
+	b->k=bits_per_key*69/100;
+	if(b->k<1) b->k=1;
+	if(b->k>30) b->k=30;
+
+	b->bits=calloc((b->nbits+7)/8, 1);
+	if(!b->bits) {
+		perror("calloc()");
+		b->nbits=0;
+		return 0;
+	}
+	return 1; /* success */
+}
+
+void bloom_free(struct bloom *b) {
+	assert(b!=NULL);
+	free(b->bits);
+	memset(b, 0, sizeof *b);
+}
+
+/* probes are generated from one hash using double hashing. the second hash
+ * is a rotation of the first. */
+void bloom_add(struct bloom *b, unsigned hash) {
+	unsigned delta, i, bit;
+
+	assert(b!=NULL);
+	if(!b->bits) return;
+
+	delta=(hash>>17)|(hash<<15);
+	for(i=0;i<b->k;i++) {
+		bit=hash%b->nbits;
+		b->bits[bit/8]|=1<<(bit%8);
+		hash+=delta;
+	}
+	b->nr_keys++;
+}
+
+/** return 0 if hash was definitely never added.
+ * an empty (disabled) filter says yes to everything */
+int bloom_check(const struct bloom *b, unsigned hash) {
+	unsigned delta, i, bit;
+
+	assert(b!=NULL);
+	if(!b->bits) return 1;
+
+	delta=(hash>>17)|(hash<<15);
+	for(i=0;i<b->k;i++) {
+		bit=hash%b->nbits;
+		if(!(b->bits[bit/8]&(1<<(bit%8)))) {
+			return 0; /* not present */
+		}
+		hash+=delta;
+	}
+	return 1; /* maybe present */
+}
+
+/** expected false positive rate for the keys added so far */
+double bloom_fp_rate(const struct bloom *b) {
+	assert(b!=NULL);
+	if(!b->bits || !b->nr_keys) return 0.;
+	return pow(1.-exp(-(double)b->k*b->nr_keys/b->nbits), b->k);
+}
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
@@ -0,0 +1,18 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+struct bloom {
+	unsigned char *bits;
+	unsigned nbits;
+	unsigned k; /* number of probes per key */
+	unsigned nr_keys; /* keys added so far */
+};
+
+int bloom_init(struct bloom *b, unsigned nr_keys, unsigned bits_per_key);
+void bloom_free(struct bloom *b);
+void bloom_add(struct bloom *b, unsigned hash);
+int bloom_check(const struct bloom *b, unsigned hash);
+double bloom_fp_rate(const struct bloom *b);
+#endif
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
@@ -55,15 +55,24 @@
 
 #include "autovoice.h"
 #include "bot.h"
+#include "cache.h"
 #include "calcdb.h"
 #include "command.h"
 #include "dcalc.h"
+#include "message.h"
+#include "mode.h"
 #include "notify.h"
 #include "proto.h"
+#include "ratelimit.h"
 #include "rc.h"
+#include "recvq.h"
 #include "rpn.h"
+#include "sendq.h"
+#include "spell.h"
+#include "strhash.h"
 #include "users.h"
 #include "wcalc.h"
+#include "work.h"
 #include "pQueue.h"
 
 
@@ -83,6 +92,9 @@
 	static	char CALCDB[MAXDATASIZE];	/* name of, and possibly path to, the calc database file */
 	static	char DEF_CHAN[MAXDATASIZE]; /* name of default channel to talk on */
 	static	char ON_CONNECT_SCRIPT[MAXDATASIZE]; /* execute this on connect */
+	static	int  NOTIFY_SUMMARY = 60;	/* minutes between handler timing dumps to stderr, 0 for never */
+	static	int  WORKERS = 2;			/* threads for the slow commands, 0 runs them in the main loop */
+	static	int  RESULT_CACHE = 256;	/* calculator and proto answers to remember, 0 for none */
 
     /* By default, the bot supports every available feature. */
     /* This behavior can be customized in bot.cfg.   */
@@ -108,6 +120,10 @@
     int is_dcalc_enabled      = 1;
     int is_searchcalc_enabled = 1;
     int is_autovoice_enabled  = 1;
+    int is_stats_enabled      = 1;
+    int is_spell_enabled      = 1;
+    int is_mkproto_enabled    = 1;
+    int is_rmproto_enabled    = 1;
 
 /* other misc local globals that are needed. i fail to see any non-hacked way
  * way to get rid of these.
@@ -130,6 +146,18 @@
 
 struct pQueue *action_queue = NULL;
 
+/* print how long the notify handlers have been taking, then do it again in
+ * NOTIFY_SUMMARY minutes
+ */
+
+static void notify_summary( void *unused )
+{
+	(void)unused;
+	fprintf( stderr, "--- notify handlers ---\n" );
+	notify_dump_stats( stderr );
+	pQueueAdd( &action_queue, pQueueRealtime() + NOTIFY_SUMMARY PQUE_MINUTES, notify_summary, NULL );
+}
+
 /* return if there are network difficulties, otherwise, this is where the main purpose
  * of this program really begins. an endless loop around select().
  * select on stdin and the socket.
@@ -137,8 +165,9 @@ struct pQueue *action_queue = NULL;
 
 void main_loop( void )
 {
-	int whatever;
-	fd_set fdgroup;
+	int whatever, maxfd, wakefd;
+	long sendms;
+	fd_set fdgroup, wrgroup;
 	struct timeval tv;
 	pQueueTime_t curtime, nextime, lastime;
 
@@ -160,11 +189,29 @@ void main_loop( void )
 			tv.tv_usec = ((nextime - curtime) % PQUE_REALTIME_RESOLUTION) * (10000000 / PQUE_REALTIME_RESOLUTION);
 		}
 
+		/* the send queue may need to wake up sooner, for the pacer */
+		sendms = sendq_wait_ms();
+		if( sendms > 0 && tv.tv_sec * 1000L + tv.tv_usec / 1000 > sendms ) {
+			tv.tv_sec = sendms / 1000;
+			tv.tv_usec = sendms % 1000 * 1000;
+		}
+
+		FD_ZERO(&wrgroup);
+		if( sendms == 0 ) FD_SET(sockfd, &wrgroup);
+
 		FD_ZERO(&fdgroup);
 		FD_SET(STDIN_FILENO, &fdgroup);
 		FD_SET(sockfd, &fdgroup);
+		maxfd = sockfd;
+
+		/* the worker pool writes to this when it has replies */
+		wakefd = work_fd();
+		if( wakefd >= 0 ) {
+			FD_SET(wakefd, &fdgroup);
+			if( wakefd > maxfd ) maxfd = wakefd;
+		}
 
-		whatever = select( (sockfd + 1) , &fdgroup, NULL, NULL, &tv);
+		whatever = select( (maxfd + 1) , &fdgroup, &wrgroup, NULL, &tv);
 
 		if( !whatever ) {
 			if (curtime > lastime + PQUE_REALTIME_RESOLUTION * 360)
@@ -175,6 +222,12 @@ void main_loop( void )
 
 		if( FD_ISSET( sockfd, &fdgroup ) ) if( process_in( ) ) break;
 		if( FD_ISSET( STDIN_FILENO, &fdgroup ) ) if( process_out( ) ) break;
+		if( wakefd >= 0 && FD_ISSET( wakefd, &fdgroup ) ) work_collect();
+		if( FD_ISSET( sockfd, &wrgroup ) ) if( !sendq_flush( ) ) break;
+
+		/* every line read so far is parsed and PINGs are answered, now
+		 * the slow handlers can have their turn */
+		notify_run_deferred();
 
 	 }
 
@@ -234,69 +287,25 @@ int process_out( void )
 
 
 
-/* ugh. this one is impossible to comment on. what it does is make sure that
- * only complete lines are processed. It uses a static buffer to hold the
- * incomplete information until the next packet comes in. X is the placeholder
- * index. marked High Priority for recoding. this code sucks badly... even
- * though it works
- * this hurts my eyes every time i see it.
+/* recvq.c splits what comes from the server into complete lines and hands
+ * each one to parse_incoming() where it lies, over-long lines are dropped.
  */
 
 int process_in( void )
 {
-	char buf[MAXDATASIZE], *ptr;
-	int numbytes = 0;
-	int z = 0;
-	int y = 0;
-	static int x = 0;
-	static char tmpbuf[MAXDATASIZE];
-
-	if( (numbytes = recv( sockfd, buf, MAXDATASIZE, 0)) == -1)
-	 {
-		perror("recv");
-		return 1;
-	 }
-
-	if( !numbytes ) return 1;
-	if( numbytes < MAXDATASIZE ) buf[numbytes] = '\0';
-	buf[MAXDATASIZE - 1] = '\0';
-
-	ptr = buf;
-
-	for( y = 0; y < numbytes; y++)
-	 {
-		while( *(ptr + y) != '\n' )
-		 {
-			tmpbuf[x] = *( ptr + y );
-			x+=1; y+=1;
-			if( x == MAXDATASIZE ) x--;
-			if( *(ptr + y) == '\0' ) break;
-		 }
-		tmpbuf[x] = '\0';
-		if( *(ptr + y) == '\n' )
-		 {
-			 x = 0;
-			 parse_incoming( tmpbuf );
-			 for( z = 0; z < MAXDATASIZE; z++ ) tmpbuf[z] = '\0';
-		 }
-	 }
-
-
-	return 0;
+	return !recvq_read( sockfd, parse_incoming );
 }
 
 
 
 /* full ircd messages come through here for parsing.
- * this form of parsing is based around the "typical" irc message where someone
- * actually says something. if it is some other type of message, the parser tries
- * to copy into msgarg1 etc but will fall through when the arguments don't fall
- * neatly into place.
+ * message_parse() splits the line into spans of cur_msg without copying each
+ * field, the msg_*() macros in bot.h give the fields as strings. the words of
+ * what was said are msg_arg( &cur_msg, 1 ) and on.
  */
 
 void parse_incoming( char *ptr )
 {
-	int position = 0;
 	int boot;
 
 	boot = clean_message( ptr );
@@ -306,47 +315,20 @@ void parse_incoming( char *ptr )
 		return;					/* no need to continue parsing */
 	}
 
-	memset( &cur_msg, 0, sizeof(cur_msg) );  /* clear the buffer... i want a safe default */
-
-	/* do an initial breakup of the message based on whitespace */
-
-	if( *ptr != '\0' ) position = chop( ptr, cur_msg.userline, 1, ' ' );  /* 1 to skip the leading colon */
-	if( ptr[position] != '\0' ) position = chop( ptr, cur_msg.msgtype, position, ' ' );
-	if( ptr[position] == ':' ) position++; /* skip the colon if there is one */
-	if( ptr[position] != '\0' ) position = chop( ptr, cur_msg.msgto, position, ' ' ); /* holds new NICK if previous statements succeeds */
-
-	if( ptr[position] != '\0' ) position = chop( ptr, cur_msg.fulltext, ptr[position]==':' ? position + 1 : position, '\n' );  /* + 1 to skip the colon */
-
-	/*break down the host/nick type stuff */
-
-	position = chop( ptr, cur_msg.nick, 1, '!' );
-	if( ptr[position] != '\0' ) position = chop( ptr, cur_msg.logname, position, '@' );
-	if( ptr[position] != '\0' ) position = chop( ptr, cur_msg.hostname, position, ' ' );
-
-	/* now that the protocol crap is gone, let's parse what the person said. */
-	if( (cur_msg.msgtype[0] == 'P') || (cur_msg.msgtype[0] == 'N') ) { /*PRIVMSG or NOTICE, NICK triggers too though */
-		position = chop( cur_msg.fulltext, cur_msg.msgarg1, 0, ' ' );
-		if( ptr[position] != '\0' ) position = chop( cur_msg.fulltext, cur_msg.msgarg2, position, ' ' );
-		if( ptr[position] != '\0' ) position = chop( cur_msg.fulltext, cur_msg.msgarg3, position, ' ' );
-		if( ptr[position] != '\0' ) position = chop( cur_msg.fulltext, cur_msg.msgarg4, position, ' ' );
-		if( ptr[position] != '\0' ) position = chop( cur_msg.fulltext, cur_msg.msgarg5, position, ' ' );
-		if( ptr[position] != '\0' ) position = chop( cur_msg.fulltext, cur_msg.msgarg6, position, ' ' );
-		if( ptr[position] != '\0' ) position = chop( cur_msg.fulltext, cur_msg.msgarg7, position, ' ' );
-		if( ptr[position] != '\0' ) position = chop( cur_msg.fulltext, cur_msg.msgarg8, position, ' ' );
-		if( ptr[position] != '\0' ) position = chop( cur_msg.fulltext, cur_msg.msgarg9, position, ' ' );
-	}
+	message_parse( &cur_msg, ptr );
+	cur_msg.type_id = notify_type_id( msg_type( &cur_msg ) );	/* dispatch is an array index from here on */
 
 	/* console output with simple formatting */
-	if( !strncasecmp( cur_msg.msgtype, "PRIVMSG", MAXDATASIZE ) )
-		printf( "|%s|  %s: %s\n", cur_msg.msgto, cur_msg.nick, cur_msg.fulltext );
+	if( !strncasecmp( msg_type( &cur_msg ), "PRIVMSG", MAXDATASIZE ) )
+		printf( "|%s|  %s: %s\n", msg_to( &cur_msg ), msg_nick( &cur_msg ), msg_text( &cur_msg ) );
 	else
 		puts( ptr );
 
 	/* color and attribute boot */
-	if (boot && strncmp(cur_msg.msgto, BOTNAME, MAXDATASIZE) && strncmp(cur_msg.nick, BOTNAME, MAXDATASIZE)) {
+	if (boot && strncmp(msg_to( &cur_msg ), BOTNAME, MAXDATASIZE) && strncmp(msg_nick( &cur_msg ), BOTNAME, MAXDATASIZE)) {
 		char buffer[MAXDATASIZE];
 		snprintf(buffer, MAXDATASIZE, "kick %s %s :%s",
-			cur_msg.msgto, cur_msg.nick,
+			msg_to( &cur_msg ), msg_nick( &cur_msg ),
 			"No color or text attributes allowed.");
 		send_irc_message(buffer);
 	}
@@ -355,6 +337,15 @@ void parse_incoming( char *ptr )
 	return;
 }
 
+/* the *_stub functions all work on cur_msg. a deferred notify handler runs
+ * after cur_msg has moved on to later lines, so it puts its copy back first.
+ */
+
+void set_cur_msg( const struct message *msg )
+{
+	if( msg != &cur_msg ) memcpy( &cur_msg, msg, sizeof( cur_msg ) );
+}
+
 /* after the message from the ircd has been parsed, i need to decide what course of
  * action to take based upon that input. this is where events are triggered.
  */
@@ -362,12 +353,12 @@ void parse_incoming( char *ptr )
 void make_a_decision( void )
 {
 	if(verbose>4) {
-		fprintf(stderr, "%s(): message type='%s'\n", __func__, cur_msg.msgtype);
+		fprintf(stderr, "%s(): message type='%s'\n", __func__, msg_type( &cur_msg ));
 	}
 	/* don't let it talk to itself, so make sure this is first in the list. Changes botname if bot is changing its nick*/
-	if( !strncasecmp( BOTNAME, cur_msg.nick, MAXDATASIZE ) ) {
-		if (cur_msg.msgtype[0] == 'N' && cur_msg.msgtype[1] == 'I') {
-			strncpy(BOTNAME, cur_msg.msgto, MAXDATASIZE);
+	if( !strncasecmp( BOTNAME, msg_nick( &cur_msg ), MAXDATASIZE ) ) {
+		if (msg_type( &cur_msg )[0] == 'N' && msg_type( &cur_msg )[1] == 'I') {
+			strncpy(BOTNAME, msg_to( &cur_msg ), MAXDATASIZE);
 		}
 		return;
 	}
@@ -376,22 +367,21 @@ void make_a_decision( void )
 }
 
 
-/* how to comment? this function is almost pointless as is. its purpose will become
- * clear later... after it is fully implemented. all it does now is ensure that a
- * newline char is sent after each message and provide a wrapper for the network I/O.
- * eventually, the bot will monitor its own output here.
+/* every line for the server goes through here. it is only queued, main_loop()
+ * writes it out when the socket is ready and the pacer in sendq.c allows,
+ * so nothing waits on the network.
  */
 
 void send_irc_message( char *sndmsg )
 {
-	char newline = '\n';
+	/* replies to someone still waiting on the worker pool go out after it */
+	if( work_hold( sndmsg ) ) return;
+
 	if(verbose>0) {
 		fprintf(stderr, "OUT> %s\n", sndmsg);
 	}
 
-	if( send (sockfd, sndmsg, strlen( sndmsg ), 0) == -1) perror("send");
-	if( send (sockfd, &newline, 1, 0) == -1) perror("send");
-	sleep( 1 );		/* pause for a second to help keep things from getting too crazy. */
+	sendq_push( sndmsg );
 	return;
 }
 
@@ -412,8 +402,8 @@ void rot13_stub( void )
         return;
     }
 
-	ptr = cur_msg.fulltext;
-	x = chop( cur_msg.fulltext, tmpray, 0, ' ' ); /* i use chop to find out where ptr should point */
+	ptr = msg_text( &cur_msg );
+	x = chop( msg_text( &cur_msg ), tmpray, 0, ' ' ); /* i use chop to find out where ptr should point */
 	ptr += x; /* skip the first argument but get the rest of the sentence */
 	x = 0; /* reset to 0 so it can be used in the loop below. */
 
@@ -448,7 +438,7 @@ void lsusers_stub( void )
         return;
     }
 
-	list_users( cur_msg.nick );
+	list_users( msg_nick( &cur_msg ) );
 	return;
 }
 
@@ -462,7 +452,7 @@ void chpass_stub( void )
         return;
     }
 
-    chpass( cur_msg.msgarg2, cur_msg.msgarg3, cur_msg.msgarg4 );
+    chpass( msg_arg( &cur_msg, 2 ), msg_arg( &cur_msg, 3 ), msg_arg( &cur_msg, 4 ) );
 	return;
 }
 
@@ -476,13 +466,33 @@ void docalc_stub( void )
         return;
     }
 
-	docalc( cur_msg.msgarg2 );
+	docalc( msg_arg( &cur_msg, 2 ) );
 	return;
 }
 
 
 /* op_people stub finished */
 
+/* "op #chan pass [login]" or "op pass [login]", the login defaults to the
+ * nick. the password is checked on the worker pool before oppeople_stub()
+ * runs. returns 0 if the request would be ignored anyway. */
+
+int oppeople_creds( struct message *msg, char **passwd, char **name )
+{
+	int word = 2;
+
+	if( msg_to( msg )[0] == '#' ) return 0; /* asked in the channel */
+
+	if( (msg_arg( msg, 2 )[0] == '#') || (msg_arg( msg, 2 )[0] == '&') )
+		word = 3;
+	else if( !DEF_CHAN[0] )
+		return 0;
+
+	*passwd = msg_arg( msg, word );
+	*name = msg_arg( msg, word + 1 )[0] ? msg_arg( msg, word + 1 ) : msg_nick( msg );
+	return 1;
+}
+
 void oppeople_stub( void )
 {
     if (!is_op_enabled)
@@ -494,20 +504,20 @@ void oppeople_stub( void )
 
 	/* making getting ops easier for other than the default channel */
 
-	if( (cur_msg.msgarg2[0] == '#') || (cur_msg.msgarg2[0] == '&') ) {
-		if( cur_msg.msgarg4[0] )
-			oppeople( cur_msg.msgarg2, cur_msg.msgarg3, cur_msg.msgarg4, cur_msg.nick );
+	if( (msg_arg( &cur_msg, 2 )[0] == '#') || (msg_arg( &cur_msg, 2 )[0] == '&') ) {
+		if( msg_arg( &cur_msg, 4 )[0] )
+			oppeople( msg_arg( &cur_msg, 2 ), msg_arg( &cur_msg, 3 ), msg_arg( &cur_msg, 4 ), msg_nick( &cur_msg ) );
 		else
-			oppeople( cur_msg.msgarg2, cur_msg.msgarg3, cur_msg.nick, cur_msg.nick );
+			oppeople( msg_arg( &cur_msg, 2 ), msg_arg( &cur_msg, 3 ), msg_nick( &cur_msg ), msg_nick( &cur_msg ) );
 		return;
 	}
 	/* op only in the default channel */
 
 	if( DEF_CHAN[0] ) {
-		if( cur_msg.msgarg3[0] )
-			oppeople( DEF_CHAN, cur_msg.msgarg2, cur_msg.msgarg3, cur_msg.nick );
+		if( msg_arg( &cur_msg, 3 )[0] )
+			oppeople( DEF_CHAN, msg_arg( &cur_msg, 2 ), msg_arg( &cur_msg, 3 ), msg_nick( &cur_msg ) );
 		else
-			oppeople( DEF_CHAN, cur_msg.msgarg2, cur_msg.nick, cur_msg.nick );
+			oppeople( DEF_CHAN, msg_arg( &cur_msg, 2 ), msg_nick( &cur_msg ), msg_nick( &cur_msg ) );
 	}
 	return;
 
@@ -523,7 +533,7 @@ void owncalc_stub( void )
         return;
     }
 
-	owncalc( cur_msg.msgarg2, cur_msg.msgarg3, cur_msg.nick );
+	owncalc( msg_arg( &cur_msg, 2 ), msg_arg( &cur_msg, 3 ), msg_nick( &cur_msg ) );
 	return;
 }
 
@@ -537,7 +547,7 @@ void whois_stub( void )
         return;
     }
 
-	whois( cur_msg.msgarg2 );
+	whois( msg_arg( &cur_msg, 2 ) );
 	return;
 }
 
@@ -551,7 +561,7 @@ void adduser_stub( void )
         return;
     }
 
-	adduser( cur_msg.msgarg2, cur_msg.msgarg3, cur_msg.msgarg4, cur_msg.msgarg5 );
+	adduser( msg_arg( &cur_msg, 2 ), msg_arg( &cur_msg, 3 ), msg_arg( &cur_msg, 4 ), msg_arg( &cur_msg, 5 ) );
 	return;
 }
 
@@ -565,7 +575,7 @@ void rmuser_stub( void )
         return;
     }
 
-	rmuser( cur_msg.msgarg2, cur_msg.msgarg3, cur_msg.msgarg4 );
+	rmuser( msg_arg( &cur_msg, 2 ), msg_arg( &cur_msg, 3 ), msg_arg( &cur_msg, 4 ) );
 	return;
 }
 
@@ -579,13 +589,13 @@ void rmcalc_stub( void )
         return;
     }
 
-	rmcalc( cur_msg.msgarg2, cur_msg.msgarg3, cur_msg.msgarg4 );
+	rmcalc( msg_arg( &cur_msg, 2 ), msg_arg( &cur_msg, 3 ), msg_arg( &cur_msg, 4 ) );
 	return;
 }
 
 
 /*
- * i parse cur_msg.fulltext to step over command arguments and login info.
+ * i parse msg_text( &cur_msg ) to step over command arguments and login info.
  * the actual calc data can obviously have spaces, so the original
  * parsing of the irc message is insufficient. note that 'newcalctext' gets
  * overwritten by each call to chop(). after the last call, it holds the calc data.
@@ -601,13 +611,13 @@ void mkcalc_stub( void )
         return;
     }
 
-	y = chop( cur_msg.fulltext, newcalctext, 0, ' ' );
-	y = chop( cur_msg.fulltext, newcalctext, y, ' ' );
-	y = chop( cur_msg.fulltext, newcalctext, y, ' ' );
-	y = chop( cur_msg.fulltext, newcalctext, y, ' ' );
-	y = chop( cur_msg.fulltext, newcalctext, y, '\0' );
+	y = chop( msg_text( &cur_msg ), newcalctext, 0, ' ' );
+	y = chop( msg_text( &cur_msg ), newcalctext, y, ' ' );
+	y = chop( msg_text( &cur_msg ), newcalctext, y, ' ' );
+	y = chop( msg_text( &cur_msg ), newcalctext, y, ' ' );
+	y = chop( msg_text( &cur_msg ), newcalctext, y, '\0' );
 
-	mkcalc( cur_msg.msgarg2, cur_msg.msgarg3, cur_msg.msgarg4, newcalctext );
+	mkcalc( msg_arg( &cur_msg, 2 ), msg_arg( &cur_msg, 3 ), msg_arg( &cur_msg, 4 ), newcalctext );
 	return;
 }
 
@@ -622,13 +632,13 @@ void chcalc_stub( void )
         return;
     }
 
-	y = chop( cur_msg.fulltext, newcalctext, 0, ' ' );
-	y = chop( cur_msg.fulltext, newcalctext, y, ' ' );
-	y = chop( cur_msg.fulltext, newcalctext, y, ' ' );
-	y = chop( cur_msg.fulltext, newcalctext, y, ' ' );
-	y = chop( cur_msg.fulltext, newcalctext, y, '\0' );
+	y = chop( msg_text( &cur_msg ), newcalctext, 0, ' ' );
+	y = chop( msg_text( &cur_msg ), newcalctext, y, ' ' );
+	y = chop( msg_text( &cur_msg ), newcalctext, y, ' ' );
+	y = chop( msg_text( &cur_msg ), newcalctext, y, ' ' );
+	y = chop( msg_text( &cur_msg ), newcalctext, y, '\0' );
 
-	chcalc( cur_msg.msgarg2, cur_msg.msgarg3, cur_msg.msgarg4, newcalctext );
+	chcalc( msg_arg( &cur_msg, 2 ), msg_arg( &cur_msg, 3 ), msg_arg( &cur_msg, 4 ), newcalctext );
 	return;
 }
 
@@ -643,112 +653,112 @@ void listcalc_stub( void )
         return;
     }
 
-	listcalc( cur_msg.msgarg2, cur_msg.msgarg3, cur_msg.nick );
+	listcalc( msg_arg( &cur_msg, 2 ), msg_arg( &cur_msg, 3 ), msg_nick( &cur_msg ) );
 	return;
 }
 
 
-/* searchcalc stub */
+/* searchcalc, run on a worker against a snapshot of the calcs */
 
-void searchcalc_stub( void )
+void searchcalc_run( const struct message *msg, const char *msgto, const struct calc_snapshot *calcs, char *text, size_t max )
 {
-    if (!is_searchcalc_enabled)
-    {
-        return;
-    }
-
-	searchcalc( cur_msg.msgarg2, cur_msg.msgarg3 );
+	searchcalc_snapshot( calcs, msg_arg( msg, 2 ), msg_arg( msg, 3 ), msgto, text, max );
 	return;
 }
 
 
-/*stub for couts RPN calculator */
+/* couts RPN calculator. the calculators run on a worker, so they only
+ * look at their own copy of the message and write the text of the reply
+ * for the main thread to send to msgto.
+ */
 
-int rpn_stub( void )
+void rpn_run( const struct message *msg, const char *msgto, const struct calc_snapshot *calcs, char *text, size_t max )
 {
 	int x = 0;
-	char tmpray[MAXDATASIZE], answer[MAXDATASIZE];
-
-    if (!is_rcalc_enabled)
-    {
-        return 0;
-    }
+	char answer[MAXDATASIZE];
 
-	rpn_calc( cur_msg.fulltext + (strlen( cur_msg.msgarg1 ) + 1), answer, (MAXDATASIZE - 2) );
+	(void)msgto;
+	(void)calcs;
+	rpn_calc( msg_text( msg ) + (strlen( msg_arg( msg, 1 ) ) + 1), answer, (MAXDATASIZE - 2) );
 
 	if( x != RPN_OK )
-		snprintf( tmpray, MAXDATASIZE, "privmsg %s :error: %s", MSGTO, answer );
+		snprintf( text, max, "error: %s", answer );
 	else
-		snprintf( tmpray, MAXDATASIZE, "privmsg %s :cout says: %s", MSGTO, answer );
+		snprintf( text, max, "cout says: %s", answer );
 
-	send_irc_message( tmpray );
-
-	return 0;
+	return;
 }
 
 
 
 /* stub for demoncrat's "normal" calculator code */
 
-int dcalc_stub( void )
+void dcalc_run( const struct message *msg, const char *msgto, const struct calc_snapshot *calcs, char *text, size_t max )
 {
-	char tmpray[MAXDATASIZE];
 	Value v;
 	const char *plaint;
 
-    if (!is_dcalc_enabled)
-    {
-        return 0;
-    }
-
-	plaint = dcalc(&v, cur_msg.fulltext + (strlen( cur_msg.msgarg1 ) + 1) );
+	(void)msgto;
+	(void)calcs;
+	plaint = dcalc(&v, msg_text( msg ) + (strlen( msg_arg( msg, 1 ) ) + 1) );
 
 	if( plaint )
-		snprintf( tmpray, MAXDATASIZE, "privmsg %s :answer: %s", MSGTO, plaint);
+		snprintf( text, max, "answer: %s", plaint);
 	else
-		snprintf( tmpray, MAXDATASIZE, "privmsg %s :answer: %.16g", MSGTO, v);
+		snprintf( text, max, "answer: %.16g", v);
 
-	send_irc_message( tmpray );
-
-	return 0;
+	return;
 }
 
 
-int wcalc_stub( void )
+void wcalc_run( const struct message *msg, const char *msgto, const struct calc_snapshot *calcs, char *text, size_t max )
 {
-	char tmpray[MAXDATASIZE];
-	size_t len;
-
-    if (!is_wcalc_enabled)
-    {
-        return 0;
-    }
-
-	snprintf(tmpray, MAXDATASIZE, "privmsg %s : ", MSGTO);
-	len = strlen(tmpray);
-	wcalc(tmpray + len, MAXDATASIZE - len - 1, cur_msg.fulltext + (strlen( cur_msg.msgarg1 ) + 1) );
-
-	send_irc_message( tmpray );
+	(void)msgto;
+	(void)calcs;
+	text[0] = ' ';
+	wcalc(text + 1, max - 2, msg_text( msg ) + (strlen( msg_arg( msg, 1 ) ) + 1) );
 
-	return 0;
+	return;
 }
 
-int proto_stub( void )
+void proto_stub( void )
 {
 	char tmpray[MAXDATASIZE];
 	size_t len;
+	const char *query;
+	unsigned gen;
 
     if (!is_proto_enabled)
     {
-        return 0;
+        return;
     }
 
 	snprintf(tmpray, MAXDATASIZE, "privmsg %s : ", MSGTO);
 	len = strlen(tmpray);
-	proto_result(tmpray+len, sizeof tmpray - len - 1, cur_msg.fulltext + (strlen( cur_msg.msgarg1 ) + 1) );
+	query = msg_text( &cur_msg ) + (strlen( msg_arg( &cur_msg, 1 ) ) + 1);
+
+	/* the same protos are asked for over and over, until proto.udb changes */
+	gen = proto_generation();
+	if( !cache_get( "proto", query, gen, tmpray+len, sizeof tmpray - len - 1 ) ) {
+		proto_result(tmpray+len, sizeof tmpray - len - 1, query );
+		cache_put( "proto", query, gen, tmpray+len );
+	}
 	send_irc_message( tmpray );
 
-	return 0;
+	return;
+}
+
+/* spell, run on a worker. the first misspelling builds the suggestion
+ * index, which takes a while */
+
+void spell_run( const struct message *msg, const char *msgto, const struct calc_snapshot *calcs, char *text, size_t max )
+{
+	(void)msgto;
+	(void)calcs;
+	text[0] = ' ';
+	spell_result(text + 1, max - 2, msg_text( msg ) + (strlen( msg_arg( msg, 1 ) ) + 1) );
+
+	return;
 }
 
 
@@ -785,7 +795,7 @@ void mball_stub( void )
         return;
     }
 
-	msg = cur_msg.fulltext + (strlen( cur_msg.msgarg1 ) + 1);
+	msg = msg_text( &cur_msg ) + (strlen( msg_arg( &cur_msg, 1 ) ) + 1);
 
 	while (*msg) { seed = *msg++ + (seed << 6) + (seed << 16) - seed; };
 	seed = ((seed >> 8) ^ (seed & 0xFF)) & 0x1F;
@@ -799,9 +809,10 @@ void enable_stub(void)
 {
 	char irc_message[MAXDATASIZE];
 
-	char *password = cur_msg.msgarg2;
-	char *username = cur_msg.msgarg3;
-	char *feature  = cur_msg.msgarg4;
+	char *password = msg_arg( &cur_msg, 2 );
+	char *username = msg_arg( &cur_msg, 3 );
+	char *feature  = msg_arg( &cur_msg, 4 );
+	int *flag;
 
 	if (MSGTO[0] == '#')
 	{
@@ -815,96 +826,14 @@ void enable_stub(void)
 		return;
 	}
 
-	if (!strcmp(feature, "chpass"))
-	{
-		is_chpass_enabled = 1;
-	}
-	else if (!strcmp(feature, "calc"))
-	{
-		is_calc_enabled = 1;
-	}
-	else if (!strcmp(feature, "chcalc"))
-	{
-		is_chcalc_enabled = 1;
-	}
-	else if (!strcmp(feature, "op"))
-	{
-		is_op_enabled = 1;
-	}
-	else if (!strcmp(feature, "owncalc"))
-	{
-		is_owncalc_enabled = 1;
-	}
-	else if (!strcmp(feature, "proto"))
-	{
-		is_proto_enabled = 1;
-	}
-	else if (!strcmp(feature, "whois"))
-	{
-		is_whois_enabled = 1;
-	}
-	else if (!strcmp(feature, "wcalc"))
-	{
-		is_wcalc_enabled = 1;
-	}
-	else if (!strcmp(feature, "adduser"))
-	{
-		is_adduser_enabled = 1;
-	}
-	else if (!strcmp(feature, "help"))
-	{
-		is_help_enabled = 1;
-	}
-	else if (!strcmp(feature, "rmuser"))
-	{
-		is_rmuser_enabled = 1;
-	}
-	else if (!strcmp(feature, "rmcalc"))
-	{
-		is_rmcalc_enabled = 1;
-	}
-	else if (!strcmp(feature, "rawirc"))
-	{
-		is_rawirc_enabled = 1;
-	}
-	else if (!strcmp(feature, "rcalc"))
-	{
-		is_rcalc_enabled = 1;
-	}
-	else if (!strcmp(feature, "rot13"))
-	{
-		is_rot13_enabled = 1;
-	}
-	else if (!strcmp(feature, "mkcalc"))
-	{
-		is_mkcalc_enabled = 1;
-	}
-	else if (!strcmp(feature, "listcalc"))
-	{
-		is_listcalc_enabled = 1;
-	}
-	else if (!strcmp(feature, "lsusers"))
-	{
-		is_lsusers_enabled = 1;
-	}
-	else if (!strcmp(feature, "dcalc"))
-	{
-		is_dcalc_enabled = 1;
-	}
-	else if (!strcmp(feature, "searchcalc"))
-	{
-		is_searchcalc_enabled = 1;
-	}
-	else if (!strcmp(feature, "autovoice"))
-	{
-		is_autovoice_enabled = 1;
-	}
-	else
+	flag = command_feature(feature);
+	if (!flag)
 	{
 		snprintf(irc_message, sizeof irc_message, "PRIVMSG %s :no such feature", MSGTO);
 		send_irc_message(irc_message);
 		return;
 	}
+	*flag = 1;
 
 	snprintf(irc_message, sizeof irc_message, "PRIVMSG %s :feature enabled", MSGTO);
 	send_irc_message(irc_message);
@@ -914,9 +843,10 @@ void disable_stub(void)
 {
 	char irc_message[MAXDATASIZE];
 
-	char *password = cur_msg.msgarg2;
-	char *username = cur_msg.msgarg3;
-	char *feature  = cur_msg.msgarg4;
+	char *password = msg_arg( &cur_msg, 2 );
+	char *username = msg_arg( &cur_msg, 3 );
+	char *feature  = msg_arg( &cur_msg, 4 );
+	int *flag;
 
 	if (MSGTO[0] == '#')
 	{
@@ -930,214 +860,190 @@ void disable_stub(void)
 		return;
 	}
 
-	if (!strcmp(feature, "chpass"))
-	{
-		is_chpass_enabled = 0;
-	}
-	else if (!strcmp(feature, "calc"))
-	{
-		is_calc_enabled = 0;
-	}
-	else if (!strcmp(feature, "chcalc"))
-	{
-		is_chcalc_enabled = 0;
-	}
-	else if (!strcmp(feature, "op"))
-	{
-		is_op_enabled = 0;
-	}
-	else if (!strcmp(feature, "owncalc"))
-	{
-		is_owncalc_enabled = 0;
-	}
-	else if (!strcmp(feature, "proto"))
-	{
-		is_proto_enabled = 0;
-	}
-	else if (!strcmp(feature, "whois"))
-	{
-		is_whois_enabled = 0;
-	}
-	else if (!strcmp(feature, "wcalc"))
-	{
-		is_wcalc_enabled = 0;
-	}
-	else if (!strcmp(feature, "adduser"))
-	{
-		is_adduser_enabled = 0;
-	}
-	else if (!strcmp(feature, "help"))
-	{
-		is_help_enabled = 0;
-	}
-	else if (!strcmp(feature, "rmuser"))
-	{
-		is_rmuser_enabled = 0;
-	}
-	else if (!strcmp(feature, "rmcalc"))
-	{
-		is_rmcalc_enabled = 0;
-	}
-	else if (!strcmp(feature, "rawirc"))
-	{
-		is_rawirc_enabled = 0;
-	}
-	else if (!strcmp(feature, "rcalc"))
-	{
-		is_rcalc_enabled = 0;
-	}
-	else if (!strcmp(feature, "rot13"))
-	{
-		is_rot13_enabled = 0;
-	}
-	else if (!strcmp(feature, "mkcalc"))
-	{
-		is_mkcalc_enabled = 0;
-	}
-	else if (!strcmp(feature, "listcalc"))
-	{
-		is_listcalc_enabled = 0;
-	}
-	else if (!strcmp(feature, "lsusers"))
-	{
-		is_lsusers_enabled = 0;
-	}
-	else if (!strcmp(feature, "dcalc"))
-	{
-		is_dcalc_enabled = 0;
-	}
-	else if (!strcmp(feature, "searchcalc"))
-	{
-		is_searchcalc_enabled = 0;
-	}
-	else if (!strcmp(feature, "autovoice"))
-	{
-		is_autovoice_enabled = 0;
-	}
-	else
+	flag = command_feature(feature);
+	if (!flag)
 	{
 		snprintf(irc_message, sizeof irc_message, "PRIVMSG %s :no such feature", MSGTO);
 		send_irc_message(irc_message);
 		return;
 	}
+	*flag = 0;
 
 	snprintf(irc_message, sizeof irc_message, "PRIVMSG %s :feature disabled", MSGTO);
 	send_irc_message(irc_message);
 }
 
-/********************************-----end stubs-----*************************************/
-
+/* stats stub. reports counters for the lookup tables. admins only */
 
-
-/* repsond only to private requests for help. the actual messages are #defined in bot.h
- * i should make these loadable from a file rather than compiled in.
- * erm... why don't i make this a switch() like i did in make_a_decision()?
- */
-
-void help( void )
+void stats_stub( void )
 {
 	char tmpray[MAXDATASIZE];
+	char line[MAXDATASIZE];
+	char *section = msg_arg( &cur_msg, 4 );
+
+    if (!is_stats_enabled)
+    {
+        return;
+    }
 
-	if( strncasecmp( cur_msg.msgto, BOTNAME, MAXDATASIZE ) ) return;
+	if( MSGTO[0] == '#' ) return; /* do not respond to stats requests made in the channel */
 
-	if( !strncasecmp( cur_msg.msgarg2, "commands", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, COMMANDS );
+	if( !valid_login( msg_arg( &cur_msg, 3 ), msg_arg( &cur_msg, 2 ) ) ) {
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :failed login", MSGTO );
 		send_irc_message( tmpray );
 		return;
 	}
-	if( !strncasecmp( cur_msg.msgarg2, "syntax", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, SYNTAX );
-		send_irc_message( tmpray );
-		return;
-	}
-	if( !strncasecmp( cur_msg.msgarg2, "adduser", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, ADDUSER );
-		send_irc_message( tmpray );
-		return;
-	}
-	if( !strncasecmp( cur_msg.msgarg2, "rmuser", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, RMUSER );
-		send_irc_message( tmpray );
-		return;
-	}
-	if( !strncasecmp( cur_msg.msgarg2, "op", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, OP );
-		send_irc_message( tmpray );
-		return;
-	}
-	if( !strncasecmp( cur_msg.msgarg2, "chpass", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, CHPASS );
+
+	if( !section[0] || !strcasecmp( section, "db" ) ) {
+		proto_stats( line, sizeof line );
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", MSGTO, line );
 		send_irc_message( tmpray );
-		return;
-	}
-	if( !strncasecmp( cur_msg.msgarg2, "rmcalc", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, RMCALC );
+
+		calcdb_stats( line, sizeof line );
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", MSGTO, line );
 		send_irc_message( tmpray );
-		return;
 	}
-	if( !strncasecmp( cur_msg.msgarg2, "owncalc", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, OWNCALC );
+
+	if( !section[0] || !strcasecmp( section, "cache" ) ) {
+		cache_stats( line, sizeof line );
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", MSGTO, line );
 		send_irc_message( tmpray );
-		return;
 	}
-	if( !strncasecmp( cur_msg.msgarg2, "mkcalc", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, MKCALC );
+
+	if( !section[0] || !strcasecmp( section, "sendq" ) ) {
+		sendq_stats( line, sizeof line );
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", MSGTO, line );
 		send_irc_message( tmpray );
-		return;
-	}
-	if( !strncasecmp( cur_msg.msgarg2, "chcalc", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, CHCALC );
+
+		recvq_stats( line, sizeof line );
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", MSGTO, line );
 		send_irc_message( tmpray );
-		return;
 	}
-	if( !strncasecmp( cur_msg.msgarg2, "rawirc", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, RAWIRC );
+
+	if( !section[0] || !strcasecmp( section, "mode" ) ) {
+		mode_queue_stats( line, sizeof line );
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", MSGTO, line );
 		send_irc_message( tmpray );
-		return;
 	}
-	if( !strncasecmp( cur_msg.msgarg2, "whois", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, WHOIS );
+
+	if( !section[0] || !strcasecmp( section, "ratelimit" ) ) {
+		ratelimit_stats( line, sizeof line );
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", MSGTO, line );
 		send_irc_message( tmpray );
-		return;
 	}
-	if( !strncasecmp( cur_msg.msgarg2, "listcalc", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, LISTCALC );
+
+	if( !section[0] || !strcasecmp( section, "work" ) ) {
+		work_stats( line, sizeof line );
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", MSGTO, line );
 		send_irc_message( tmpray );
-		return;
 	}
-	if( !strncasecmp( cur_msg.msgarg2, "searchcalc", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, SEARCHCALC );
-		send_irc_message( tmpray );
-		return;
+
+	if( !section[0] || !strcasecmp( section, "notify" ) ) {
+		unsigned n;
+
+		for( n = 0; notify_stats( n, line, sizeof line ); n++ ) {
+			snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", MSGTO, line );
+			send_irc_message( tmpray );
+		}
 	}
-	if( !strncasecmp( cur_msg.msgarg2, "chattr", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, CHATTR );
+
+	return;
+}
+
+/*
+ * mkproto and rmproto edit proto.udb. the prototype is everything after the
+ * login, parsed out of msg_text( &cur_msg ) the same way mkcalc_stub() does it.
+ */
+
+void mkproto_stub( void )
+{
+	int y;
+	char tmpray[MAXDATASIZE];
+	char line[MAXDATASIZE];
+	char newproto[MAXDATASIZE];
+
+    if (!is_mkproto_enabled)
+    {
+        return;
+    }
+
+	if( !valid_login( msg_arg( &cur_msg, 3 ), msg_arg( &cur_msg, 2 ) ) ) {
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :failed login", MSGTO );
 		send_irc_message( tmpray );
 		return;
 	}
-	if( !strncasecmp( cur_msg.msgarg2, "lsusers", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, LSUSERS );
+
+	y = chop( msg_text( &cur_msg ), newproto, 0, ' ' );
+	y = chop( msg_text( &cur_msg ), newproto, y, ' ' );
+	y = chop( msg_text( &cur_msg ), newproto, y, ' ' );
+	y = chop( msg_text( &cur_msg ), newproto, y, '\0' );
+
+	proto_put( line, sizeof line, newproto );
+	snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", MSGTO, line );
+	send_irc_message( tmpray );
+	return;
+}
+
+
+void rmproto_stub( void )
+{
+	char tmpray[MAXDATASIZE];
+	char line[MAXDATASIZE];
+
+    if (!is_rmproto_enabled)
+    {
+        return;
+    }
+
+	if( !valid_login( msg_arg( &cur_msg, 3 ), msg_arg( &cur_msg, 2 ) ) ) {
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :failed login", MSGTO );
 		send_irc_message( tmpray );
 		return;
 	}
-	if( !strncasecmp( cur_msg.msgarg2, "rot13", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, ROT13 );
+
+	proto_delete( line, sizeof line, msg_arg( &cur_msg, 4 ) );
+	snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", MSGTO, line );
+	send_irc_message( tmpray );
+	return;
+}
+
+/********************************-----end stubs-----*************************************/
+
+
+
+/* repsond only to private requests for help. the actual messages are #defined in bot.h
+ * i should make these loadable from a file rather than compiled in.
+ * erm... why don't i make this a switch() like i did in make_a_decision()?
+ */
+
+void help( void )
+{
+	char tmpray[MAXDATASIZE];
+	char list[MAXDATASIZE];
+	const struct command *cmd;
+
+	if( strncasecmp( msg_to( &cur_msg ), BOTNAME, MAXDATASIZE ) ) return;
+
+	if( !strncasecmp( msg_arg( &cur_msg, 2 ), "commands", MAXDATASIZE ) ) {
+		command_list( list, sizeof list );
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s. %s", msg_nick( &cur_msg ), list, COMMANDS_TRAILER );
 		send_irc_message( tmpray );
 		return;
 	}
-	if( !strncasecmp( cur_msg.msgarg2, "enable", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, ENABLE );
+	if( !strncasecmp( msg_arg( &cur_msg, 2 ), "syntax", MAXDATASIZE ) ) {
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", msg_nick( &cur_msg ), SYNTAX );
 		send_irc_message( tmpray );
 		return;
 	}
-	if( !strncasecmp( cur_msg.msgarg2, "disable", MAXDATASIZE ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, DISABLE );
+	/* the rest of the help text is in command.def */
+	cmd = command_find( msg_arg( &cur_msg, 2 ) );
+	if( cmd && cmd->help ) {
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", msg_nick( &cur_msg ), cmd->help );
 		send_irc_message( tmpray );
 		return;
 	}
 
-
-	snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", cur_msg.nick, HELPHELP );
+	snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :%s", msg_nick( &cur_msg ), HELPHELP );
 	send_irc_message( tmpray );
 
 	return;
@@ -1155,12 +1061,12 @@ void do_ctcp( void )
 {
 	char ray[MAXDATASIZE];
 
-	switch( cur_msg.msgarg1[1] ) {
+	switch( msg_arg( &cur_msg, 1 )[1] ) {
 		case 'V':
-			snprintf( ray, MAXDATASIZE, "NOTICE %s :\001VERSION ircII.5 not quite all there yet.\001", cur_msg.nick );
+			snprintf( ray, MAXDATASIZE, "NOTICE %s :\001VERSION ircII.5 not quite all there yet.\001", msg_nick( &cur_msg ) );
 			break;
 		default:
-			snprintf( ray, MAXDATASIZE, "NOTICE %s :%s\001", cur_msg.nick, cur_msg.msgarg1 );
+			snprintf( ray, MAXDATASIZE, "NOTICE %s :%s\001", msg_nick( &cur_msg ), msg_arg( &cur_msg, 1 ) );
 			break;
 	}
 
@@ -1184,17 +1090,17 @@ void rawirc( void )
         return;
     }
 
-	if( !valid_login( cur_msg.msgarg3, cur_msg.msgarg2 ) ) {
-		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :failed login", cur_msg.nick );
+	if( !valid_login( msg_arg( &cur_msg, 3 ), msg_arg( &cur_msg, 2 ) ) ) {
+		snprintf( tmpray, MAXDATASIZE, "PRIVMSG %s :failed login", msg_nick( &cur_msg ) );
 		send_irc_message( tmpray );
 		return;
 	}
 
 	/* this is the same parsing technique described in mkcalc_stub() */
-	y = chop( cur_msg.fulltext, tmpray, 0, ' ' );
-	y = chop( cur_msg.fulltext, tmpray, y, ' ' );
-	y = chop( cur_msg.fulltext, tmpray, y, ' ' );
-	y = chop( cur_msg.fulltext, tmpray, y, '\0' );
+	y = chop( msg_text( &cur_msg ), tmpray, 0, ' ' );
+	y = chop( msg_text( &cur_msg ), tmpray, y, ' ' );
+	y = chop( msg_text( &cur_msg ), tmpray, y, ' ' );
+	y = chop( msg_text( &cur_msg ), tmpray, y, '\0' );
 
 	send_irc_message( tmpray );
 
@@ -1345,6 +1251,8 @@ int irc_connect( void )
 	sockfd = 0;
 
 	if( (sockfd = host_connect(SERVER, PORT, sockfd)) < 1) return 1;
+	sendq_reset( sockfd );
+	recvq_reset();
 
 	strncpy( BOTNAME, NICK1, MAXDATASIZE );
 	send_irc_message( USER );
@@ -1352,6 +1260,7 @@ int irc_connect( void )
 	memset( ray, '\0', sizeof(ray) );
 	snprintf( ray, MAXDATASIZE, "nick %s", BOTNAME );
 	send_irc_message( ray );
+	sendq_drain( 3000 );	/* the server has to see these before it answers */
 
 	sleep( 3 );
 
@@ -1370,6 +1279,7 @@ int irc_connect( void )
 		memset( ray, '\0', sizeof(ray) );
 		snprintf( ray, MAXDATASIZE, "nick %s", BOTNAME );
 		send_irc_message( ray );
+		sendq_drain( 3000 );
 
 		if( (numbytes = recv( sockfd, ray, MAXDATASIZE, 0)) == -1)
 		 {
@@ -1448,6 +1358,9 @@ static struct config_node *load_cfg( void )
 		puts( "\n--------------- bot.cfg data ---------------\n" );
 
 		load_item_int(curr,"verbose", &verbose, "verbose debug level");
+		load_item_int(curr,"notify_summary", &NOTIFY_SUMMARY, "handler timing summary minutes");
+		load_item_int(curr,"workers", &WORKERS, "worker threads");
+		load_item_int(curr,"result_cache", &RESULT_CACHE, "result cache entries");
 		res= load_item_str(curr,"server",sizeof SERVER, SERVER, "irc server")
 		&& load_item_int(curr,"port", &PORT, "server port")
 		&& load_item_str(curr,"nick", sizeof NICK1, NICK1, "nick")
@@ -1474,29 +1387,19 @@ static struct config_node *load_cfg( void )
     curr = config_find(root, "features");
     if (curr && curr->child)
     {
+        const char *name;
+        char key[64];
+        int *flag;
+        unsigned n;
+
         curr = curr->child;
 
-        load_item_bool(curr, IS_CHPASS_ENABLED,     &is_chpass_enabled,     IS_CHPASS_ENABLED);
-        load_item_bool(curr, IS_CALC_ENABLED,       &is_calc_enabled,       IS_CALC_ENABLED);
-        load_item_bool(curr, IS_CHCALC_ENABLED,     &is_chcalc_enabled,     IS_CHCALC_ENABLED);
-        load_item_bool(curr, IS_OP_ENABLED,         &is_op_enabled,         IS_OP_ENABLED);
-        load_item_bool(curr, IS_OWNCALC_ENABLED,    &is_owncalc_enabled,    IS_OWNCALC_ENABLED);
-        load_item_bool(curr, IS_PROTO_ENABLED,      &is_proto_enabled,      IS_PROTO_ENABLED);
-        load_item_bool(curr, IS_WHOIS_ENABLED,      &is_whois_enabled,      IS_WHOIS_ENABLED);
-        load_item_bool(curr, IS_WCALC_ENABLED,      &is_wcalc_enabled,      IS_WCALC_ENABLED);
-        load_item_bool(curr, IS_ADDUSER_ENABLED,    &is_adduser_enabled,    IS_ADDUSER_ENABLED);
-        load_item_bool(curr, IS_HELP_ENABLED,       &is_help_enabled,       IS_HELP_ENABLED);
-        load_item_bool(curr, IS_RMUSER_ENABLED,     &is_rmuser_enabled,     IS_RMUSER_ENABLED);
-        load_item_bool(curr, IS_RMCALC_ENABLED,     &is_rmcalc_enabled,     IS_RMCALC_ENABLED);
-        load_item_bool(curr, IS_RAWIRC_ENABLED,     &is_rawirc_enabled,     IS_RAWIRC_ENABLED);
-        load_item_bool(curr, IS_RCALC_ENABLED,      &is_rcalc_enabled,      IS_RCALC_ENABLED);
-        load_item_bool(curr, IS_ROT13_ENABLED,      &is_rot13_enabled,      IS_ROT13_ENABLED);
-        load_item_bool(curr, IS_MKCALC_ENABLED,     &is_mkcalc_enabled,     IS_MKCALC_ENABLED);
-        load_item_bool(curr, IS_LISTCALC_ENABLED,   &is_listcalc_enabled,   IS_LISTCALC_ENABLED);
-        load_item_bool(curr, IS_LSUSERS_ENABLED,    &is_lsusers_enabled,    IS_LSUSERS_ENABLED);
-        load_item_bool(curr, IS_DCALC_ENABLED,      &is_dcalc_enabled,      IS_DCALC_ENABLED);
-        load_item_bool(curr, IS_SEARCHCALC_ENABLED, &is_searchcalc_enabled, IS_SEARCHCALC_ENABLED);
-        load_item_bool(curr, IS_AUTOVOICE_ENABLED,  &is_autovoice_enabled,  IS_AUTOVOICE_ENABLED);
+        /* the features are listed in command.def */
+        for (n = 0; (name = command_feature_name(n, &flag)); n++)
+        {
+            snprintf(key, sizeof key, "is_%s_enabled", name);
+            load_item_bool(curr, key, flag, key);
+        }
     }
 
 	puts( "\n--------------- data loaded ---------------\n" );
@@ -1516,15 +1419,24 @@ int prep( void )
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGFPE, SIG_IGN);
 	srand( time( NULL ) );
+	strhash_init();	/* before any table is filled */
 	config_root=load_cfg();
 
 	if( !config_root ) { puts( "failed at end of load_cfg()"); return 10; }
 	if( loadusers( "user.list" ) ) { puts( "failed loading the user.list " ); return 15; }
 	if( loaddb( CALCDB, MAXCALCS ) ) { puts( "failed loading the calc database." ); return 20; }
 	if( !command_init() ) { puts( "failed to load the command module." ); return 30; }
+	if( !work_init( WORKERS ) ) { puts( "failed to start the worker threads." ); return 35; }
+	if( !cache_init( RESULT_CACHE > 0 ? RESULT_CACHE : 0 ) ) { puts( "failed to set up the result cache." ); return 37; }
 	if( !proto_init() ) { puts( "failed to load the proto database." ); return 40; }
+	if( !spell_init() ) { puts( "failed to load the spelling dictionary." ); return 45; }
 	if( !autovoice_init(config_root) ) { puts( "failed to load the autovoice module." ); return 50; }
+	if( !ratelimit_init(config_root) ) { puts( "failed to load the ratelimit module." ); return 55; }
+	if( !sendq_init(config_root) ) { puts( "failed to load the send queue." ); return 60; }
+	if( !mode_queue_init() ) { puts( "failed to load the mode queue." ); return 65; }
 	config_free(config_root);
+	if( NOTIFY_SUMMARY > 0 )
+		pQueueAdd( &action_queue, pQueueRealtime() + NOTIFY_SUMMARY PQUE_MINUTES, notify_summary, NULL );
 	return 0;
 }
 
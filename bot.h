@@ -87,10 +87,7 @@ int irc_connect( void );
 void do_ctcp( void );
 int clean_message( char *msg );
 int prep( void );
-int dcalc_stub( void );
-int wcalc_stub( void );
 void rawirc( void );
-int rpn_stub( void );
 void help( void );
 void chpass_stub( void );
 void docalc_stub( void );
@@ -103,80 +100,77 @@ void rmcalc_stub( void );
 void mkcalc_stub( void );
 void chcalc_stub( void );
 void listcalc_stub( void );
-void searchcalc_stub( void );
 void lsusers_stub( void );
 void rot13_stub( void );
-int proto_stub( void );
+void proto_stub( void );
 void mball_stub( void );
 void enable_stub( void );
 void disable_stub( void );
+void stats_stub( void );
+void mkproto_stub( void );
+void rmproto_stub( void );
 
 
-/* this is what an irc message will be broken down to */
+/* this is what an irc message will be broken down to. message_parse() keeps
+ * two copies of the line: line as it came, and tok with a NUL written after
+ * every field, so each field is a string in place. the spans are offsets,
+ * not pointers, so a message can be copied with memcpy(). use the msg_*()
+ * macros below rather than the spans.
+ */
+
+#define MSG_MAXPARAMS 15	/* RFC 2812 */
+#define MSG_MAXWORDS 9		/* words of the text, for commands */
+
+struct msg_span {
+   unsigned short off, len;
+  };
 
 struct message {
-   char nick[MAXDATASIZE];
-   char userline[MAXDATASIZE];
-   char msgtype[MAXDATASIZE];
-   char msgto[MAXDATASIZE];
-   char fulltext[MAXDATASIZE];
-   char logname[MAXDATASIZE];
-   char hostname[MAXDATASIZE];
-   char msgarg1[MAXDATASIZE];
-   char msgarg2[MAXDATASIZE];
-   char msgarg3[MAXDATASIZE];
-   char msgarg4[MAXDATASIZE];
-   char msgarg5[MAXDATASIZE];
-   char msgarg6[MAXDATASIZE];
-   char msgarg7[MAXDATASIZE];
-   char msgarg8[MAXDATASIZE];
-   char msgarg9[MAXDATASIZE];
+   int type_id;	/* command interned by notify_type_id() */
+   struct msg_span prefix, nick, user, host, command;
+   struct msg_span params[MSG_MAXPARAMS];
+   struct msg_span words[MSG_MAXWORDS];
+   unsigned short text;	/* offset in line of everything after the first param */
+   unsigned char nr_params, nr_words;
+   char line[MAXDATASIZE];
+   char tok[MAXDATASIZE];
   };
 
+/* a missing field points here, at the NUL that ends both buffers */
+#define MSG_NONE (MAXDATASIZE - 1)
+
+#define msg_nick(m) ((m)->tok + (m)->nick.off)
+#define msg_user(m) ((m)->tok + (m)->user.off)
+#define msg_host(m) ((m)->tok + (m)->host.off)
+#define msg_type(m) ((m)->tok + (m)->command.off)
+/* the last param runs to the end of the line, take it from the copy that
+ * still has its spaces */
+#define msg_param(m, i) (((i) + 1 == (m)->nr_params ? (m)->line : (m)->tok) + (m)->params[i].off)
+#define msg_to(m) msg_param(m, 0)	/* a nick or channel, or JOIN's channel, or NICK's new nick */
+#define msg_text(m) ((m)->line + (m)->text)	/* what was said, or the rest of the line */
+#define msg_arg(m, n) ((m)->tok + (m)->words[(n) - 1].off)	/* n is 1 to MSG_MAXWORDS */
+
+void set_cur_msg( const struct message *msg );
+
+/* the commands run on the worker pool, see command.def */
+
+struct calc_snapshot;
+void rpn_run( const struct message *msg, const char *msgto, const struct calc_snapshot *calcs, char *text, size_t max );
+void dcalc_run( const struct message *msg, const char *msgto, const struct calc_snapshot *calcs, char *text, size_t max );
+void wcalc_run( const struct message *msg, const char *msgto, const struct calc_snapshot *calcs, char *text, size_t max );
+void searchcalc_run( const struct message *msg, const char *msgto, const struct calc_snapshot *calcs, char *text, size_t max );
+void spell_run( const struct message *msg, const char *msgto, const struct calc_snapshot *calcs, char *text, size_t max );
+
+/* where op finds the password and login, see LOGIN in command.def */
+int oppeople_creds( struct message *msg, char **passwd, char **name );
+
 
 
 #define HELPHELP "you should /msg me help commands or help <command-name>."
-#define COMMANDS "calc, op, chpass, whois, rmcalc, mkcalc, chcalc, owncalc, searchcalc, listcalc, rmuser, adduser, rawirc, lsusers, rot13, enable, disable. Try, help syntax or help commandname."
+#define COMMANDS_TRAILER "Try, help syntax or help commandname."
 #define SYNTAX "Most user commands take the form of COMMAND PASSWORD USERNAME ARGUMENT/S. The op command requires only a password if your nick is the same as your username."
-#define ADDUSER "adduser yourpass yourlogin newpass newlogin"
-#define CHPASS "chpass yourpass yourlogin newpass"
-#define RMUSER "rmuser yourpass yourlogin username-to-delete"
-#define RMCALC "rmcalc yourpass yourlogname calc-to-delete"
-#define MKCALC "mkcalc yourpass yourlogname calckey calcdata"
-#define CHCALC "chcalc yourpass yourlogname calckey calcdata"
-#define OP "op #channel yourpass yourlogin, or merely, op yourpass, if your nick, username, and default channel all synchronize."
-#define CHATTR "chattr yourpass yourlogin username attributes."
-#define RAWIRC "rawirc yourpass yourlogin raw-irc-protocol   no leading / is needed."
-#define OWNCALC "owncalc calcname index. will print who the owner of a calc is. will detect erroneus duplicates as well. index can be used to start the search at other than the beginning of the database."
-#define LISTCALC "listcalc username index. will print a list of calcs owned by username. index can be used to start the search at other than the beginning of the database."
-#define SEARCHCALC "searchcalc substring index. will search the calc data field for an occurrence of substring. index can be used to start the search at other than the beginning of the database."
-#define WHOIS "whois username."
-#define LSUSERS "lsusers will list all known users in as few messages as possible."
-#define ROT13 "rot13 will repeat your message in rot13. usage: rot13 this sentence will be encrypted in rot13."
-#define ENABLE "enable yourpass yourlogin feature"
-#define DISABLE "disable yourpass yourlogin feature"
-
-#define IS_CHPASS_ENABLED     "is_chpass_enabled"
-#define IS_CALC_ENABLED       "is_calc_enabled"
-#define IS_CHCALC_ENABLED     "is_chcalc_enabled"
-#define IS_OP_ENABLED         "is_op_enabled"
-#define IS_OWNCALC_ENABLED    "is_owncalc_enabled"
-#define IS_PROTO_ENABLED      "is_proto_enabled"
-#define IS_WHOIS_ENABLED      "is_whois_enabled"
-#define IS_WCALC_ENABLED      "is_wcalc_enabled"
-#define IS_ADDUSER_ENABLED    "is_adduser_enabled"
-#define IS_HELP_ENABLED       "is_help_enabled"
-#define IS_RMUSER_ENABLED     "is_rmuser_enabled"
-#define IS_RMCALC_ENABLED     "is_rmcalc_enabled"
-#define IS_RAWIRC_ENABLED     "is_rawirc_enabled"
-#define IS_RCALC_ENABLED      "is_rcalc_enabled"
-#define IS_ROT13_ENABLED      "is_rot13_enabled"
-#define IS_MKCALC_ENABLED     "is_mkcalc_enabled"
-#define IS_LISTCALC_ENABLED   "is_listcalc_enabled"
-#define IS_LSUSERS_ENABLED    "is_lsusers_enabled"
-#define IS_DCALC_ENABLED      "is_dcalc_enabled"
-#define IS_SEARCHCALC_ENABLED "is_searchcalc_enabled"
-#define IS_AUTOVOICE_ENABLED  "is_autovoice_enabled"
+
+/* the commands themselves, with their help text, are in command.def */
 
 #endif /* !_BOT_H */
 
@@ -0,0 +1,235 @@
+/* cache.c : remembers the answers of commands that always give the same one */
+/*
+ * an answer is kept under the command's name and its input with the spaces
+ * tidied up, so "1+ 2" and " 1+  2" are the same question. answers that come
+ * from a database also carry the database's generation, a lookup with any
+ * other generation is a miss and drops the old answer.
+ *
+ * there is a fixed number of entries. when they are all in use the one that
+ * was used longest ago is thrown out. only the main thread uses the cache.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+#include "strhash.h"
+
+#define MAX_KINDS 8 /* commands using the cache */
+#define INPUT_MAX 512 /* longer inputs are not cached */
+
+struct kind {
+	const char *name;
+	unsigned long hits, misses, stale;
+};
+
+struct entry {
+	struct entry *next; /* in the bucket */
+	struct entry *newer, *older; /* in the LRU list */
+	struct kind *kind;
+	unsigned hash;
+	unsigned generation;
+	char *input;
+	char *result;
+};
+
+static struct kind kinds[MAX_KINDS];
+static unsigned nr_kinds;
+
+static struct entry **buckets;
+static unsigned nr_buckets; /* power of 2 */
+static unsigned nr_entries, max_entries;
+static struct entry *newest, *oldest;
+static unsigned long nr_evicted;
+
+/** the counters for a command, added the first time it is seen.
+ * returns NULL if there are too many */
+static struct kind *find_kind(const char *name)
+{
+	unsigned i;
+
+	for(i=0;i<nr_kinds;i++) {
+		if(!strcmp(kinds[i].name, name)) return &kinds[i];
+	}
+	if(nr_kinds>=MAX_KINDS) return 0;
+	kinds[nr_kinds].name=name;
+	return &kinds[nr_kinds++];
+}
+
+/** copy in to out with leading and trailing space gone and every other run of
+ * space turned into one. returns 0 if it doesn't fit */
+static int normalize(char *out, size_t max, const char *in)
+{
+	size_t len=0;
+
+	while(*in==' ' || *in=='\t') in++;
+	while(*in) {
+		if(*in==' ' || *in=='\t') {
+			while(*in==' ' || *in=='\t') in++;
+			if(!*in) break;
+			if(len+1>=max) return 0;
+			out[len++]=' ';
+			continue;
+		}
+		if(len+1>=max) return 0;
+		out[len++]=*in++;
+	}
+	out[len]=0;
+	return 1;
+}
+
+static unsigned hash_of(const struct kind *k, const char *input)
+{
+	/* the input comes from anyone on IRC, so use the keyed hash */
+	return strsiphash(input)^(unsigned)(k-kinds)*0x9e3779b1u;
+}
+
+static struct entry *find_entry(const struct kind *k, const char *input, unsigned h)
+{
+	struct entry *e;
+
+	for(e=buckets[h&(nr_buckets-1)];e;e=e->next) {
+		if(e->hash==h && e->kind==k && !strcmp(e->input, input)) return e;
+	}
+	return 0;
+}
+
+static void unlink_lru(struct entry *e)
+{
+	if(e->newer) e->newer->older=e->older; else newest=e->older;
+	if(e->older) e->older->newer=e->newer; else oldest=e->newer;
+}
+
+static void push_lru(struct entry *e)
+{
+	e->newer=0;
+	e->older=newest;
+	if(newest) newest->newer=e; else oldest=e;
+	newest=e;
+}
+
+static void remove_entry(struct entry *e)
+{
+	struct entry **prev;
+
+	for(prev=&buckets[e->hash&(nr_buckets-1)];*prev!=e;prev=&(*prev)->next) ;
+	*prev=e->next;
+	unlink_lru(e);
+	free(e->input);
+	free(e->result);
+	free(e);
+	nr_entries--;
+}
+
+/* keep at most n answers, 0 turns the cache off.
+ * returns 0 on failure */
+int cache_init(unsigned n)
+{
+	max_entries=n;
+	if(!n) return 1; /* success */
+	for(nr_buckets=16;nr_buckets<n;nr_buckets*=2) ;
+	buckets=calloc(nr_buckets, sizeof *buckets);
+	if(!buckets) {
+		perror("calloc()");
+		return 0;
+	}
+	return 1; /* success */
+}
+
+/* look for the answer to input for the command name, made from the given
+ * generation of its data (0 if it has none). name must be a string that
+ * lasts, the command's own name.
+ * returns 1 and copies it to dest on a hit */
+int cache_get(const char *name, const char *input, unsigned generation, char *dest, size_t max)
+{
+	char norm[INPUT_MAX];
+	struct kind *k;
+	struct entry *e;
+	unsigned h;
+
+	assert(name!=NULL);
+	assert(input!=NULL);
+	if(!buckets) return 0;
+	k=find_kind(name);
+	if(!k) return 0;
+	if(!normalize(norm, sizeof norm, input)) {
+		k->misses++;
+		return 0;
+	}
+	h=hash_of(k, norm);
+	e=find_entry(k, norm, h);
+	if(e && e->generation!=generation) {
+		k->stale++;
+		remove_entry(e);
+		e=0;
+	}
+	if(!e) {
+		k->misses++;
+		return 0;
+	}
+	k->hits++;
+	unlink_lru(e);
+	push_lru(e);
+	snprintf(dest, max, "%s", e->result);
+	return 1;
+}
+
+/* remember result as the answer to input for the command name, made from
+ * the given generation of its data */
+void cache_put(const char *name, const char *input, unsigned generation, const char *result)
+{
+	char norm[INPUT_MAX];
+	struct kind *k;
+	struct entry *e;
+	unsigned h;
+
+	assert(name!=NULL);
+	assert(input!=NULL);
+	assert(result!=NULL);
+	if(!buckets) return;
+	k=find_kind(name);
+	if(!k || !normalize(norm, sizeof norm, input)) return;
+	h=hash_of(k, norm);
+	e=find_entry(k, norm, h);
+	if(e) remove_entry(e);
+	if(nr_entries>=max_entries) {
+		remove_entry(oldest);
+		nr_evicted++;
+	}
+
+	e=calloc(1, sizeof *e);
+	if(!e) return;
+	e->input=strdup(norm);
+	e->result=strdup(result);
+	if(!e->input || !e->result) {
+		free(e->input);
+		free(e->result);
+		free(e);
+		return;
+	}
+	e->kind=k;
+	e->hash=h;
+	e->generation=generation;
+	e->next=buckets[h&(nr_buckets-1)];
+	buckets[h&(nr_buckets-1)]=e;
+	push_lru(e);
+	nr_entries++;
+}
+
+void cache_stats(char *dest, size_t max)
+{
+	unsigned i;
+	size_t len;
+
+	len=snprintf(dest, max, "cache: %u of %u entries, %lu evicted", nr_entries, max_entries, nr_evicted);
+	for(i=0;i<nr_kinds && len<max;i++) {
+		unsigned long total=kinds[i].hits+kinds[i].misses;
+
+		len+=snprintf(dest+len, max-len, ", %s %lu/%lu hits (%.0f%%) %lu stale", kinds[i].name,
+			kinds[i].hits, total, total ? 100.*kinds[i].hits/total : 0., kinds[i].stale);
+	}
+}
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
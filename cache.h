@@ -0,0 +1,11 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include <stddef.h>
+int cache_init(unsigned n);
+int cache_get(const char *name, const char *input, unsigned generation, char *dest, size_t max);
+void cache_put(const char *name, const char *input, unsigned generation, const char *result);
+void cache_stats(char *dest, size_t max);
+#endif
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
@@ -44,8 +44,12 @@
 
 #include "calcdb.h"
 #include "bot.h"
+#include "bloom.h"
 #include "users.h"
 #include "strcasestr.h"
+#include "strhash.h"
+
+#define CALC_BLOOM_BITS 10		/* bits per calc in the bloom filter */
 
 /*
  * variables needed by many functions in the module.
@@ -55,6 +59,22 @@ static char **calc = NULL;			/* will become an array of pointers, each pointer p
 static long total_calcs = 0;		/* ummmm, duh */
 static int MAXCALCS;					/* duh again. passed into loaddb */
 static char CALCDB[MAXDATASIZE]; /* passed into loaddb, path/filename of the calc database */
+static struct bloom calc_bloom;		/* answers most lookups for calcs that don't exist */
+static unsigned long calc_lookups, calc_bloom_rejects, calc_bloom_fp; /* for calcdb_stats() */
+
+/* a copy of the calcs that never changes, for searches on the worker threads.
+ * one is made when the first search after a change asks for it, and freed
+ * when the last search using it is done. the counts are only touched by the
+ * main thread.
+ */
+
+struct calc_snapshot {
+	int refs;
+	long total;
+	char **lines;
+};
+
+static struct calc_snapshot *snapshot;	/* the latest, NULL if the calcs changed since */
 
 
 
@@ -72,6 +92,102 @@ void fix_owner(char *owners)
 			owners[k] = '-';
 }
 
+/* the bloom filter is keyed on the case folded calc name, same as findcalc() */
+
+static void bloom_add_calc( char *line )
+{
+	char calcname[MAXDATASIZE];
+
+	chop( line, calcname, 0, ' ' );
+	bloom_add( &calc_bloom, strcasesiphash( calcname ) );
+}
+
+
+
+/* sized for MAXCALCS so mkcalc() can keep adding to it. rmcalc() leaves the
+ * bits behind, which only costs a false positive.
+ */
+
+static void rebuild_bloom( void )
+{
+	register int x;
+
+	bloom_free( &calc_bloom );
+	if( !bloom_init( &calc_bloom, MAXCALCS, CALC_BLOOM_BITS ) ) return;
+
+	for( x = 0; x < total_calcs; x++ ) {
+		if( !(*(calc + x)) ) break;
+		bloom_add_calc( *(calc + x) );
+	  }
+}
+
+
+
+void calcdb_stats( char *dest, int max )
+{
+	unsigned long negatives = calc_bloom_rejects + calc_bloom_fp;
+
+	snprintf( dest, max, "calcdb: %ld calcs, %lu lookups, bloom %u bytes rejected %lu, false positives %lu (%.2f%%, expected %.2f%%)",
+		total_calcs, calc_lookups, (calc_bloom.nbits + 7) / 8, calc_bloom_rejects, calc_bloom_fp,
+		negatives ? 100. * calc_bloom_fp / negatives : 0., 100. * bloom_fp_rate( &calc_bloom ) );
+}
+
+
+
+/* a reference to the calcs as they are now. give it back with calcdb_release().
+ * returns NULL if there was no memory.
+ */
+
+struct calc_snapshot *calcdb_snapshot( void )
+{
+	struct calc_snapshot *snap;
+	long x;
+
+	if( !snapshot ) {
+		snap = calloc( 1, sizeof( *snap ) );
+		if( !snap ) return NULL;
+		snap->lines = calloc( total_calcs ? total_calcs : 1, sizeof( char * ) );
+		if( !snap->lines ) { free( snap ); return NULL; }
+		for( x = 0; x < total_calcs; x++ ) {
+			if( !(*(calc + x)) ) break;
+			snap->lines[x] = strdup( *(calc + x) );
+			if( !snap->lines[x] ) break;
+		  }
+		snap->total = x;
+		snap->refs = 1;		/* this one is held by snapshot itself */
+		snapshot = snap;
+	  }
+
+	snapshot->refs++;
+	return snapshot;
+}
+
+
+
+void calcdb_release( struct calc_snapshot *snap )
+{
+	long x;
+
+	if( !snap || --snap->refs > 0 ) return;
+	for( x = 0; x < snap->total; x++ ) free( snap->lines[x] );
+	free( snap->lines );
+	free( snap );
+}
+
+
+
+/* called whenever the calcs change, searches that already have the old
+ * snapshot go on using it.
+ */
+
+static void drop_snapshot( void )
+{
+	calcdb_release( snapshot );
+	snapshot = NULL;
+}
+
+
+
 int getowners( int dbindex, char *owners, int max )
 {
 	char calcname[MAXDATASIZE];
@@ -167,7 +283,12 @@ void listcalc( char *name, char *dbindex, char *nick )
 
 
 
-void searchcalc( char *searchkey, char *dbindex )
+/* the text of the reply to a searchcalc, worked out from a snapshot so it
+ * can be run on a worker thread. msgto is where the reply goes, it is
+ * searched for when there is no searchkey.
+ */
+
+void searchcalc_snapshot( const struct calc_snapshot *snap, const char *searchkey, const char *dbindex, const char *msgto, char *text, int max )
 {
 	register int x, index;
 	char tmpray[MAXDATASIZE];
@@ -178,25 +299,41 @@ void searchcalc( char *searchkey, char *dbindex )
 	const char *ptr = NULL;
 
 
-	if( !searchkey[0] ) strncpy( string, MSGTO, MAXDATASIZE );
-	else strncpy( string, searchkey, MAXDATASIZE );
+	if( !searchkey[0] ) snprintf( string, MAXDATASIZE, "%s", msgto );
+	else snprintf( string, MAXDATASIZE, "%s", searchkey );
 
 	tmpray[0] = '\0';
-	for( x = atol( dbindex ); (x < total_calcs) && (x >= 0); x++ ) {
-		if( !(*(calc + x)) ) return;
-		index = chop( *(calc + x), calcname, 0, ' ' );
-		index = chop( *(calc + x), calcowners, index, '|' );
-		index = chop( *(calc + x), calcdata, index, '\0' );
+	for( x = atol( dbindex ); (x < snap->total) && (x >= 0); x++ ) {
+		if( !snap->lines[x] ) break;
+		index = chop( snap->lines[x], calcname, 0, ' ' );
+		index = chop( snap->lines[x], calcowners, index, '|' );
+		index = chop( snap->lines[x], calcdata, index, '\0' );
 		// strstr() for case-sensitive search, strcasestr() for case-insensitive.
 		ptr = strcasestr( calcdata, string );
 		if( ptr == NULL ) continue;
 		if( (strlen(tmpray) + strlen(calcname)) > (MAXDATASIZE - 50) ) break;
-		if( (strlen(tmpray) + strlen(calcname)) > (MAXDATASIZE - 50) ) break;
 		strncat( tmpray, calcname, (MAXDATASIZE - 50) );
 		strncat( tmpray, " ", (MAXDATASIZE - 50) );
 	  }
 
-	snprintf( string, MAXDATASIZE, "PRIVMSG %s :index: %i. results: %s", MSGTO, x - 1, tmpray );
+	snprintf( text, max, "index: %i. results: %s", x - 1, tmpray );
+
+	return;
+}
+
+
+
+void searchcalc( char *searchkey, char *dbindex )
+{
+	struct calc_snapshot *snap;
+	char text[MAXDATASIZE];
+	char string[MAXDATASIZE];
+
+	snap = calcdb_snapshot();
+	if( !snap ) return;
+	searchcalc_snapshot( snap, searchkey, dbindex, MSGTO, text, MAXDATASIZE );
+	calcdb_release( snap );
+	snprintf( string, MAXDATASIZE, "PRIVMSG %s :%s", MSGTO, text );
 	send_irc_message( string );
 
 	return;
@@ -241,6 +378,7 @@ void rmcalc( char *passwd, char *name, char *rmstring )
 		free( *(calc + x) );
 		snprintf( sndmsg, MAXDATASIZE, "PRIVMSG %s :%s removed.", MSGTO, rmstring );
 		send_irc_message( sndmsg );
+		drop_snapshot();
 		savedb( CALCDB );
 		return;
 	  }
@@ -252,6 +390,7 @@ void rmcalc( char *passwd, char *name, char *rmstring )
 	snprintf( sndmsg, MAXDATASIZE, "PRIVMSG %s :%s removed.", MSGTO, rmstring );
 	send_irc_message( sndmsg );
 
+	drop_snapshot();
 	savedb( CALCDB );
 
 	return;
@@ -305,6 +444,7 @@ void chcalc( char *pass, char *name, char *calcname, char *newcalcdata )
 	snprintf( sndmsg, MAXDATASIZE, "PRIVMSG %s :calc %s changed.", MSGTO, calcname );
 	send_irc_message( sndmsg );
 
+	drop_snapshot();
 	savedb( CALCDB );
 
 	return;
@@ -348,7 +488,9 @@ void mkcalc( char *pass, char *name, char *newcalc, char *newcalcdata )
 	snprintf( sndmsg, MAXDATASIZE, "PRIVMSG %s :calc %s added.", MSGTO, newcalc );
 	send_irc_message( sndmsg );
 
+	bloom_add_calc( *(calc + total_calcs) );
 	total_calcs++;
+	drop_snapshot();
 	savedb( CALCDB );
 
 	return;
@@ -383,12 +525,19 @@ int findcalc( char *string )
 	register int x, index;
 	char tmpray[MAXDATASIZE];
 
+	calc_lookups++;
+	if( !bloom_check( &calc_bloom, strcasesiphash( string ) ) ) {
+		calc_bloom_rejects++;
+		return -1;	/* definitely not a calc, skip the scan */
+	  }
+
 	for( x = 0; x < total_calcs; x++ ) {
-		if( !(*(calc + x)) ) return -1;
+		if( !(*(calc + x)) ) break;
 		index = chop( *(calc + x), tmpray, 0, ' ' );
 		if( index ) if( !strncasecmp( string, tmpray, MAXDATASIZE ) ) return x;
 	  }
 
+	if( calc_bloom.bits ) calc_bloom_fp++;
 	return -1;
 }
 
@@ -436,6 +585,8 @@ int loaddb( char *filename, int maxdbsize )
 			fclose( fp );
 			free(*(calc + x));
 			*(calc + x) = NULL;
+			drop_snapshot();
+			rebuild_bloom();
 			return 0;
 		  }
 		clean_message( *(calc + x) );
@@ -443,6 +594,8 @@ int loaddb( char *filename, int maxdbsize )
 	  }
 
 	fclose( fp );
+	drop_snapshot();
+	rebuild_bloom();
 
 	return 0;
 }
@@ -47,6 +47,7 @@
 
 #include "bot.h"
 
+struct calc_snapshot;
 
 int loaddb( char *filename, int maxdbsize );
 int savedb( char *filename );
@@ -58,8 +59,12 @@ void chcalc( char *pass, char *name, char *calcname, char *newcalctext );
 void owncalc( char *name, char *index, char *nick );
 void listcalc( char *name, char *dbindex, char *nick );
 void searchcalc( char *searchkey, char *dbindex );
+struct calc_snapshot *calcdb_snapshot( void );
+void calcdb_release( struct calc_snapshot *snap );
+void searchcalc_snapshot( const struct calc_snapshot *snap, const char *searchkey, const char *dbindex, const char *msgto, char *text, int max );
 void calcnotfound(char *response, int max, char *calcstring);
 void calcnotfound_test();
+void calcdb_stats( char *dest, int max );
 
 
 
@@ -31,88 +31,283 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "bot.h"
+#include "cache.h"
+#include "calcdb.h"
 #include "command.h"
 #include "notify.h"
+#include "strhash.h"
+#include "users.h"
+#include "work.h"
+#include "cmdtab.h"
 
-static void got_message(void *p, struct message *msg)
+#define FEATURE(name, flag) extern int flag;
+#define COMMAND(name, func, flag, help)
+#define LOGIN(name, func, flag, help, creds)
+#define WORKER(name, run, flag, help, flags)
+#define ALIAS(name, command)
+#include "command.def"
+#undef FEATURE
+#undef COMMAND
+#undef LOGIN
+#undef WORKER
+#undef ALIAS
+
+/* in the same order as command.def, cmd_slots[] indexes this */
+static const struct command commands[] = {
+#define FEATURE(name, flag)
+#define COMMAND(name, func, flag, help) { name, CMD_MAIN, func, NULL, 0, flag, help, NULL },
+#define LOGIN(name, func, flag, help, creds) { name, CMD_LOGIN, func, NULL, 0, flag, help, creds },
+#define WORKER(name, run, flag, help, flags) { name, CMD_WORKER, NULL, run, flags, flag, help, NULL },
+#define ALIAS(name, command)
+#include "command.def"
+#undef FEATURE
+#undef COMMAND
+#undef LOGIN
+#undef WORKER
+#undef ALIAS
+};
+
+static const struct feature {
+	const char *name;
+	int *flag;
+} features[] = {
+#define FEATURE(name, flag) { name, &flag },
+#define COMMAND(name, func, flag, help)
+#define LOGIN(name, func, flag, help, creds)
+#define WORKER(name, run, flag, help, flags)
+#define ALIAS(name, command)
+#include "command.def"
+#undef FEATURE
+#undef COMMAND
+#undef LOGIN
+#undef WORKER
+#undef ALIAS
+};
+
+/* look up a command or alias, any case.
+ * returns NULL if there is no such command */
+const struct command *command_find(const char *name)
+{
+	unsigned s;
+
+	assert(name!=NULL);
+	s=COMMAND_SLOT(strcasehash(name), CMD_SALT, CMD_BITS);
+	if(!cmd_slots[s].name || strcasecmp(cmd_slots[s].name, name)) {
+		return NULL; /* not found */
+	}
+	return &commands[cmd_slots[s].cmd];
+}
+
+/* the flag for a feature, for enable and disable.
+ * returns NULL if there is no such feature */
+int *command_feature(const char *name)
+{
+	unsigned i;
+
+	for(i=0;i<sizeof features/sizeof *features;i++) {
+		if(!strcmp(features[i].name, name)) {
+			return features[i].flag;
+		}
+	}
+	return NULL; /* not found */
+}
+
+/* name and flag of the n'th feature, for loading bot.cfg.
+ * returns NULL after the last one */
+const char *command_feature_name(unsigned n, int **flag)
+{
+	if(n>=sizeof features/sizeof *features) return NULL;
+	*flag=features[n].flag;
+	return features[n].name;
+}
+
+/* comma separated list of the commands that have help */
+void command_list(char *dest, size_t max)
+{
+	unsigned i;
+	size_t len=0;
+
+	assert(max>0);
+	dest[0]=0;
+	for(i=0;i<sizeof commands/sizeof *commands && len<max;i++) {
+		if(!commands[i].help) continue;
+		len+=snprintf(dest+len, max-len, "%s%s", len ? ", " : "", commands[i].name);
+	}
+}
+
+/* a LOGIN or WORKER command on its way through the pool */
+struct pending {
+	const struct command *cmd;
+	struct message msg; /* copy of the message it came in */
+	char msgto[MAXDATASIZE];
+	struct calc_snapshot *calcs; /* if cmd->flags has CMD_CALCS */
+	char hash[MAXDATASIZE]; /* LOGIN: the user's password hash */
+	char *passwd, *name; /* LOGIN: what the user gave, pointing into msg */
+	int login_ok; /* LOGIN: what check_password() said */
+};
+
+/** the text after the command's name */
+static const char *args_of(const struct message *msg)
+{
+	const char *s=msg_text(msg)+strlen(msg_arg(msg, 1));
+
+	return *s ? s+1 : s;
+}
+
+/** send the reply of a WORKER command, and keep it if it can be kept */
+static void worker_reply(const struct command *cmd, const struct message *msg, const char *msgto, const char *text)
+{
+	char line[MAXDATASIZE];
+
+	if(cmd->flags&CMD_CACHE) cache_put(cmd->name, args_of(msg), 0, text);
+	if(!text[0]) return;
+	snprintf(line, sizeof line, "privmsg %s :%s", msgto, text);
+	send_irc_message(line);
+}
+
+/** answer a WORKER command from the result cache.
+ * returns 1 if it was there */
+static int reply_cached(const struct command *cmd, const struct message *msg)
 {
+	char text[MAXDATASIZE], line[MAXDATASIZE];
+
+	if(!(cmd->flags&CMD_CACHE)) return 0;
+	if(!cache_get(cmd->name, args_of(msg), 0, text, sizeof text)) return 0;
+	if(text[0]) {
+		snprintf(line, sizeof line, "privmsg %s :%s", MSGTO, text);
+		send_irc_message(line);
+	}
+	return 1;
+}
+
+/** the part done on a worker thread */
+static void pending_run(void *arg, char *reply, size_t max)
+{
+	struct pending *p=arg;
+
+	if(p->cmd->how==CMD_WORKER) {
+		p->cmd->run(&p->msg, p->msgto, p->calcs, reply, max);
+	} else {
+		p->login_ok=check_password(p->passwd, p->hash);
+	}
+}
+
+/** the part done back on the main thread, in turn */
+static void pending_done(void *arg, const char *reply)
+{
+	struct pending *p=arg;
+
+	if(p->cmd->how==CMD_WORKER) {
+		worker_reply(p->cmd, &p->msg, p->msgto, reply);
+	} else {
+		/* put things back the way they were when the command came in */
+		set_cur_msg(&p->msg);
+		snprintf(MSGTO, MAXDATASIZE, "%s", p->msgto);
+		login_verified(p->name, p->passwd, p->hash, p->login_ok);
+		p->cmd->func();
+		login_verified(NULL, NULL, NULL, 0);
+	}
+	calcdb_release(p->calcs);
+	free(p);
+}
+
+/** hand a LOGIN or WORKER command to the pool.
+ * returns 0 if it has to be run here instead */
+static int submit(const struct command *cmd, const struct message *msg)
+{
+	struct pending *p;
+
+	p=malloc(sizeof *p);
+	if(!p) return 0;
+	p->cmd=cmd;
+	memcpy(&p->msg, msg, sizeof p->msg);
+	snprintf(p->msgto, sizeof p->msgto, "%s", MSGTO);
+	p->calcs=NULL;
+	p->login_ok=0;
+	if(cmd->how==CMD_LOGIN) {
+		if(!cmd->creds) {
+			p->passwd=msg_arg(&p->msg, 2);
+			p->name=msg_arg(&p->msg, 3);
+		} else if(!cmd->creds(&p->msg, &p->passwd, &p->name)) {
+			free(p);
+			return 0; /* nothing to check */
+		}
+		/* no such user means no crypt() to save */
+		if(!user_password_hash(p->name, p->hash, sizeof p->hash)) {
+			free(p);
+			return 0;
+		}
+	} else if(cmd->flags&CMD_CALCS) {
+		p->calcs=calcdb_snapshot();
+		if(!p->calcs) {
+			free(p);
+			return 0;
+		}
+	}
+	if(!work_submit(p->msgto, pending_run, pending_done, p)) {
+		calcdb_release(p->calcs);
+		free(p);
+		return 0;
+	}
+	return 1;
+}
+
+/** run a command on the main thread */
+static void run_here(const struct command *cmd, const struct message *msg)
+{
+	struct calc_snapshot *calcs=NULL;
+	char reply[MAXDATASIZE];
+
+	if(cmd->how!=CMD_WORKER) {
+		cmd->func();
+		return;
+	}
+	if(cmd->flags&CMD_CALCS && !(calcs=calcdb_snapshot())) return;
+	reply[0]=0;
+	cmd->run(msg, MSGTO, calcs, reply, sizeof reply);
+	calcdb_release(calcs);
+	worker_reply(cmd, msg, MSGTO, reply);
+}
+
+static int got_message(void *p, struct message *msg)
+{
+	const struct command *cmd;
+
 	assert(msg!=NULL);
-	if(!msg) return; /* ignore msg==NULL */
+	if(!msg) return NOTIFY_CONTINUE; /* ignore msg==NULL */
+
+	set_cur_msg(msg); /* the stubs read cur_msg */
 
 	/* this sets msgto to the msg sender's nick if it was a privmsg to the bot itself.*/
 	/* otherwise it makes it possible to talk to the channel that sent the message. */
-	if( !strcmp( msg->msgto, BOTNAME ) )
-		strncpy( MSGTO, msg->nick, MAXDATASIZE );
+	if( !strcmp( msg_to(msg), BOTNAME ) )
+		strncpy( MSGTO, msg_nick(msg), MAXDATASIZE );
 	else
-		strncpy( MSGTO, msg->msgto, MAXDATASIZE );
-
-	/* switch on the first character of the first "word" in the message */
-	switch( tolower(msg->msgarg1[0]) ) {
-		case 1:
-			if( !strncasecmp( BOTNAME, msg->msgto, MAXDATASIZE ) ) { do_ctcp(); return; }
-			break;
-		case 'c':
-			if( !strncasecmp( "chpass", msg->msgarg1, MAXDATASIZE ) ) { chpass_stub(); return; }
-			if( !strncasecmp( "calc", msg->msgarg1, MAXDATASIZE ) ) { docalc_stub(); return; }
-			if( !strncasecmp( "clac", msg->msgarg1, MAXDATASIZE ) ) { docalc_stub(); return; }
-			if( !strncasecmp( "chcalc", msg->msgarg1, MAXDATASIZE ) ) { chcalc_stub(); return; }
-			break;
-		case 'o':
-			if( !strncasecmp( "op", msg->msgarg1, MAXDATASIZE ) ) { oppeople_stub(); return; }
-			if( !strncasecmp( "owncalc", msg->msgarg1, MAXDATASIZE ) ) { owncalc_stub(); return; }
-			break;
-		case 'p':
-			if( !strncasecmp( "proto", msg->msgarg1, MAXDATASIZE ) ) { proto_stub(); return; }
-			break;
-		case 'w':
-			if( !strncasecmp( "whois", msg->msgarg1, MAXDATASIZE ) ) { whois_stub(); return; }
-			if( !strncasecmp( "wcalc", msg->msgarg1, MAXDATASIZE ) ) { wcalc_stub(); return; }
-			break;
-		case 'a':
-			if( !strncasecmp( "adduser", msg->msgarg1, MAXDATASIZE ) ) { adduser_stub(); return; }
-			break;
-		case 'h':
-			if( !strncasecmp( "help", msg->msgarg1, MAXDATASIZE ) ) { help(); return; }
-			break;
-		case 'r':
-			if( !strncasecmp( "rmuser", msg->msgarg1, MAXDATASIZE ) ) { rmuser_stub(); return; }
-			if( !strncasecmp( "rmcalc", msg->msgarg1, MAXDATASIZE ) ) { rmcalc_stub(); return; }
-			if( !strncasecmp( "rawirc", msg->msgarg1, MAXDATASIZE ) ) { rawirc(); return; }
-			if( !strncasecmp( "rcalc", msg->msgarg1, MAXDATASIZE ) ) { rpn_stub(); return; }
-			if( !strncasecmp( "recalc", msg->msgarg1, MAXDATASIZE ) ) { chcalc_stub(); return; }
-			if( !strncasecmp( "rot13", msg->msgarg1, MAXDATASIZE ) ) { rot13_stub(); return; }
-			break;
-		case 'm':
-			if( !strncasecmp( "mkcalc", msg->msgarg1, MAXDATASIZE ) ) { mkcalc_stub(); return; }
-			break;
-		case 'l':
-			if( !strncasecmp( "listcalc", msg->msgarg1, MAXDATASIZE ) ) { listcalc_stub(); return; }
-			if( !strncasecmp( "lsusers", msg->msgarg1, MAXDATASIZE ) ) { lsusers_stub(); return; }
-			if( !strncasecmp( "login", msg->msgarg1, MAXDATASIZE ) ) { help(); return; }
-			break;
-		case 'x':
-			if( !strncasecmp( "xpln", msg->msgarg1, MAXDATASIZE ) ) { docalc_stub(); return; }
-			break;
-		case 'd':
-			if( !strncasecmp( "dcalc", msg->msgarg1, MAXDATASIZE ) ) { dcalc_stub(); return; }
-			if( !strncasecmp( "disable", msg->msgarg1, MAXDATASIZE ) ) { disable_stub(); return; }
-			break;
-		case 's':
-			if( !strncasecmp( "searchcalc", msg->msgarg1, MAXDATASIZE ) ) { searchcalc_stub(); return; }
-			break;
-		case '8':
-			if( !strncasecmp( "8ball", msg->msgarg1, MAXDATASIZE) ) { mball_stub(); return; }
-			break;
-		case 'e':
-			if( !strncasecmp( "enable", msg->msgarg1, MAXDATASIZE) ) { enable_stub(); return; }
-			break;
+		strncpy( MSGTO, msg_to(msg), MAXDATASIZE );
+
+	/* CTCPs start with a \001 and are only answered when sent to the bot */
+	if( msg_arg(msg, 1)[0] == 1 ) {
+		if( strncasecmp( BOTNAME, msg_to(msg), MAXDATASIZE ) ) return NOTIFY_CONTINUE;
+		do_ctcp();
+		return NOTIFY_CONSUMED;
 	}
+
+	cmd = command_find( msg_arg(msg, 1) );
+	if( !cmd ) return NOTIFY_CONTINUE; /* not a command */
+	if( cmd->enabled && !*cmd->enabled ) return NOTIFY_CONSUMED;
+	if( cmd->how == CMD_WORKER && reply_cached( cmd, msg ) ) return NOTIFY_CONSUMED;
+	if( cmd->how == CMD_MAIN || !submit( cmd, msg ) ) run_here( cmd, msg );
+	return NOTIFY_CONSUMED;
 }
 
 int command_init(void)
 {
-	notify_register("PRIVMSG", got_message, 0);
+	/* commands can be slow, so run them after the socket has been read */
+	notify_register("PRIVMSG", "got_message", got_message, 0, NOTIFY_PRIO_DEFAULT, NOTIFY_DEFERRED);
 	return 1; /* succcess */
 }
 
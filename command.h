@@ -1,4 +1,39 @@
 #ifndef COMMAND_H
 #define COMMAND_H
+#include <stddef.h>
+
+struct message;
+struct calc_snapshot;
+
+/* where a command runs */
+#define CMD_MAIN 0 /* COMMAND(), func() on the main thread */
+#define CMD_LOGIN 1 /* LOGIN(), password checked on the pool, then func() */
+#define CMD_WORKER 2 /* WORKER(), run() on the pool */
+
+/* WORKER() flags */
+#define CMD_CALCS 1 /* run() needs a snapshot of the calcs */
+#define CMD_CACHE 2 /* the reply can be kept in the result cache */
+
+/* one COMMAND(), LOGIN() or WORKER() line from command.def */
+struct command {
+	const char *name;
+	int how; /* CMD_MAIN, CMD_LOGIN or CMD_WORKER */
+	void (*func)(void);
+	void (*run)(const struct message *msg, const char *msgto, const struct calc_snapshot *calcs, char *text, size_t max);
+	int flags; /* CMD_CALCS, CMD_CACHE */
+	int *enabled; /* feature flag, NULL if it is always on */
+	const char *help;
+	/* LOGIN: finds the password and login, NULL if they are words 2 and 3 */
+	int (*creds)(struct message *msg, char **passwd, char **name);
+};
+
+/* slot in cmdtab.h for a name whose strcasehash() is hash. gencmd picks salt
+ * and bits so that no two names share a slot */
+#define COMMAND_SLOT(hash, salt, bits) ((unsigned)(((hash)^(salt))*0x9e3779b1u)>>(32-(bits)))
+
 int command_init(void);
+const struct command *command_find(const char *name);
+int *command_feature(const char *name);
+const char *command_feature_name(unsigned n, int **flag);
+void command_list(char *dest, size_t max);
 #endif
@@ -14,4 +14,8 @@ SRCS+= strcasestr.c users.c
 LIBS+=-lcrypt
 LDLIBS=-lcrypt
 
+# udb reloads the database on a worker thread
+CFLAGS+= -pthread
+LDLIBS+= -lpthread
+
 ## end
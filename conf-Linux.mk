@@ -12,4 +12,11 @@ CPPFLAGS+= -D_XOPEN_SOURCE=500 -D_XOPEN_SOURCE_EXTENDED -D_GNU_SOURCE
 SRCS+= users.c 
 LDLIBS+= -lcrypt
 
+# udb reloads the database on a worker thread
+CFLAGS+= -pthread
+LDLIBS+= -lpthread
+
+# clock_gettime() for the notify handler timings
+LDLIBS+= -lrt
+
 ## end
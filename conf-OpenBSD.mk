@@ -7,4 +7,8 @@ CPPFLAGS+= -DBUILD_STRCASESTR
 # use the following for crypt() passwords
 SRCS+= strcasestr.c users.c 
 
+# udb reloads the database on a worker thread
+CFLAGS+= -pthread
+LDLIBS+= -lpthread
+
 ## end
@@ -12,4 +12,11 @@ LDLIBS:= -lm -lsocket -lnsl
 SRCS+= strcasestr.c users.c isinf.c
 LDLIBS+= -lcrypt
 
+# udb reloads the database on a worker thread
+CFLAGS+= -pthread
+LDLIBS+= -lpthread
+
+# clock_gettime() for the notify handler timings
+LDLIBS+= -lrt
+
 ## end
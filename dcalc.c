@@ -8,7 +8,8 @@
 #include "dcalc.h"
 
 
-static const char *complaint = NULL;
+/* the pool can run several dcalc()s at once, so each thread has its own */
+static __thread const char *complaint = NULL;
 
 static void complain (const char *msg)
 {
@@ -23,8 +24,8 @@ enum {
 
 typedef Value instruc;
 
-static instruc code[CODESIZE];
-static instruc *here = code;
+static __thread instruc code[CODESIZE];
+static __thread instruc *here;	/* dcalc() starts it at code */
 
 static void gen (instruc opcode)
 {
@@ -74,9 +75,9 @@ static Value run()
 }
 
 
-static const char *p;
-static int token;
-static Value token_value;
+static __thread const char *p;
+static __thread int token;
+static __thread Value token_value;
 
 static void next ()
 {
@@ -0,0 +1,35 @@
+pQueue.o: pQueue.c pQueue.h
+autovoice.o: autovoice.c autovoice.h bot.h pQueue.h debug.h rc.h mode.h \
+ notify.h
+bloom.o: bloom.c bloom.h
+bot.o: bot.c autovoice.h bot.h pQueue.h cache.h calcdb.h command.h \
+ dcalc.h message.h mode.h notify.h proto.h ratelimit.h rc.h recvq.h rpn.h \
+ sendq.h spell.h strhash.h users.h wcalc.h work.h
+cache.o: cache.c cache.h strhash.h
+calcdb.o: calcdb.c calcdb.h bot.h pQueue.h bloom.h users.h strcasestr.h \
+ strhash.h
+calcnotfound.o: calcnotfound.c calcdb.h bot.h pQueue.h users.h \
+ strcasestr.h
+command.o: command.c bot.h pQueue.h cache.h calcdb.h command.h notify.h \
+ strhash.h users.h work.h cmdtab.h command.def
+dcalc.o: dcalc.c dcalc.h
+keystore.o: keystore.c keystore.h
+message.o: message.c bot.h pQueue.h message.h
+mode.o: mode.c bot.h pQueue.h debug.h mode.h notify.h
+monotime.o: monotime.c monotime.h
+notify.o: notify.c bot.h pQueue.h debug.h monotime.h notify.h strhash.h
+proto.o: proto.c udb.h proto.h
+ratelimit.o: ratelimit.c bot.h pQueue.h command.h debug.h monotime.h \
+ notify.h ratelimit.h rc.h strhash.h
+rc.o: rc.c rc.h debug.h
+recvq.o: recvq.c bot.h pQueue.h debug.h recvq.h
+rpn.o: rpn.c rpn.h
+sendq.o: sendq.c bot.h pQueue.h debug.h monotime.h notify.h rc.h sendq.h \
+ strhash.h
+spell.o: spell.c spell.h strhash.h udb.h
+strhash.o: strhash.c strhash.h
+udb.o: udb.c bloom.h keystore.h strhash.h udb.h
+wcalc.o: wcalc.c wcalc.h isinf.h
+work.o: work.c bot.h pQueue.h strhash.h work.h
+users.o: users.c users.h bot.h pQueue.h mode.h
+cmdtab.o: cmdtab.h
@@ -0,0 +1,126 @@
+/* gencmd.c : build the command table's perfect hash from command.def */
+/*
+ * writes cmdtab.h to stdout. every command name and alias gets its own slot,
+ * so command_find() is one hash and one compare. the table is kept at most
+ * half full and the salt is searched for, the first one without collisions
+ * wins.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "command.h"
+#include "strhash.h"
+
+#define MAX_NAMES 256
+#define MAX_BITS 10
+#define MAX_TRIES 1000000
+
+struct name {
+	const char *name;
+	const char *command; /* the command it is, or is an alias of */
+};
+
+static const struct name names[] = {
+#define FEATURE(name, flag)
+#define COMMAND(name, func, flag, help) { name, name },
+#define LOGIN(name, func, flag, help, creds) { name, name },
+#define WORKER(name, run, flag, help, flags) { name, name },
+#define ALIAS(name, command) { name, command },
+#include "command.def"
+#undef FEATURE
+#undef COMMAND
+#undef LOGIN
+#undef WORKER
+#undef ALIAS
+};
+
+static const char *commands[] = {
+#define FEATURE(name, flag)
+#define COMMAND(name, func, flag, help) name,
+#define LOGIN(name, func, flag, help, creds) name,
+#define WORKER(name, run, flag, help, flags) name,
+#define ALIAS(name, command)
+#include "command.def"
+#undef FEATURE
+#undef COMMAND
+#undef LOGIN
+#undef WORKER
+#undef ALIAS
+};
+
+#define NR_NAMES (sizeof names/sizeof *names)
+#define NR_COMMANDS (sizeof commands/sizeof *commands)
+
+/** index of a command in command.def, or -1 */
+static int command_index(const char *command) {
+	unsigned i;
+
+	for(i=0;i<NR_COMMANDS;i++) {
+		if(!strcasecmp(commands[i], command)) return i;
+	}
+	return -1;
+}
+
+/** try to place every name with salt.
+ * return 1 if none collide */
+static int try_salt(int *slot, unsigned salt, unsigned bits) {
+	unsigned i, s;
+
+	for(i=0;i<1u<<bits;i++) {
+		slot[i]=-1;
+	}
+	for(i=0;i<NR_NAMES;i++) {
+		s=COMMAND_SLOT(strcasehash(names[i].name), salt, bits);
+		if(slot[s]>=0) return 0;
+		slot[s]=i;
+	}
+	return 1;
+}
+
+int main(void) {
+	int slot[1<<MAX_BITS];
+	unsigned bits, salt=0, i, tries;
+	int found=0;
+
+	for(i=0;i<NR_NAMES;i++) {
+		if(command_index(names[i].command)<0) {
+			fprintf(stderr, "command.def: %s is an alias of unknown command %s\n", names[i].name, names[i].command);
+			return 1;
+		}
+	}
+
+	for(bits=1;(1u<<bits)<NR_NAMES*2;bits++) ;
+	for(;!found && bits<=MAX_BITS;bits++) {
+		for(tries=0;tries<MAX_TRIES;tries++) {
+			salt=tries*0x9e3779b9u;
+			if(try_salt(slot, salt, bits)) {
+				found=1;
+				break;
+			}
+		}
+	}
+	if(!found) {
+		fprintf(stderr, "gencmd: no perfect hash found for %u names\n", (unsigned)NR_NAMES);
+		return 1;
+	}
+	bits--;
+
+	printf("/* cmdtab.h : generated by gencmd from command.def, do not edit */\n");
+	printf("#define CMD_SALT 0x%08xu\n", salt);
+	printf("#define CMD_BITS %u\n", bits);
+	printf("/* name and index in command.def of the command in each slot */\n");
+	printf("static const struct { const char *name; int cmd; } cmd_slots[1<<CMD_BITS] = {\n");
+	for(i=0;i<1u<<bits;i++) {
+		if(slot[i]<0) {
+			printf("\t{ 0, -1 },\n");
+		} else {
+			printf("\t{ \"%s\", %d },\n", names[slot[i]].name, command_index(names[slot[i]].command));
+		}
+	}
+	printf("};\n");
+	return 0;
+}
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
@@ -0,0 +1,242 @@
+/* keystore.c : front-coded sorted key storage */
+/*
+ * keys are kept in sorted order and each key is stored as the length of the
+ * prefix it shares with the key before it, plus the bytes that differ. for a
+ * dictionary ("Aachen", "Aachen's", ...) that is usually only a few bytes a
+ * key. every KEYSTORE_BLOCK keys a restart point stores the whole key, so a
+ * lookup binary searches the restart points and then decodes at most one
+ * block.
+ *
+ * layout of one key in data:
+ *   varint shared - bytes taken from the previous key (0 at a restart)
+ *   varint suffix_len
+ *   suffix_len bytes
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "keystore.h"
+
+void keystore_init(struct keystore *ks) {
+	assert(ks!=NULL);
+	memset(ks, 0, sizeof *ks);
+}
+
+void keystore_free(struct keystore *ks) {
+	if(!ks) return;
+	free(ks->data);
+	free(ks->restart);
+	free(ks->ofs);
+	memset(ks, 0, sizeof *ks);
+}
+
+/** make room for len more bytes of data.
+ * return 0 on out of memory */
+static int grow_data(struct keystore *ks, size_t len) {
+	unsigned char *tmp;
+	size_t newmax;
+
+	if(ks->data_len+len<=ks->data_max) return 1;
+	newmax=ks->data_max?ks->data_max*2:4096;
+	while(newmax<ks->data_len+len) newmax*=2;
+	tmp=realloc(ks->data, newmax);
+	if(!tmp) {
+		perror("realloc()");
+		return 0;
+	}
+	ks->data=tmp;
+	ks->data_max=newmax;
+	return 1;
+}
+
+static void put_varint(struct keystore *ks, size_t n) {
+	while(n>=0x80) {
+		ks->data[ks->data_len++]=(n&0x7f)|0x80;
+		n>>=7;
+	}
+	ks->data[ks->data_len++]=n;
+}
+
+static size_t get_varint(const unsigned char *data, size_t *pos) {
+	size_t n=0;
+	unsigned shift=0;
+
+	while(data[*pos]&0x80) {
+		n|=(size_t)(data[(*pos)++]&0x7f)<<shift;
+		shift+=7;
+	}
+	n|=(size_t)data[(*pos)++]<<shift;
+	return n;
+}
+
+/** append a key. keys must be added in strictly increasing strcmp() order.
+ * return 0 on failure */
+int keystore_add(struct keystore *ks, const char *key, off_t ofs) {
+	size_t len, shared;
+
+	assert(ks!=NULL);
+	assert(key!=NULL);
+
+	len=strlen(key);
+	if(len>=KEYSTORE_KEY_MAX) {
+		return 0; /* too long */
+	}
+	if(ks->nr_keys && strcmp(ks->last, key)>=0) {
+		return 0; /* out of order or duplicate */
+	}
+
+	if(ks->nr_keys>=ks->max_keys) {
+		off_t *tmp_ofs;
+		size_t *tmp_restart;
+		unsigned newmax=ks->max_keys?ks->max_keys*2:1024;
+
+		tmp_ofs=realloc(ks->ofs, newmax * sizeof *tmp_ofs);
+		if(!tmp_ofs) {
+			perror("realloc()");
+			return 0;
+		}
+		ks->ofs=tmp_ofs;
+		tmp_restart=realloc(ks->restart, (newmax/KEYSTORE_BLOCK+1) * sizeof *tmp_restart);
+		if(!tmp_restart) {
+			perror("realloc()");
+			return 0;
+		}
+		ks->restart=tmp_restart;
+		ks->max_keys=newmax;
+	}
+
+	/* 2 varints of at most 2 bytes each, since keys are short */
+	if(!grow_data(ks, len+4)) {
+		return 0;
+	}
+
+	if(ks->nr_keys%KEYSTORE_BLOCK==0) {
+		ks->restart[ks->nr_blocks++]=ks->data_len;
+		shared=0;
+	} else {
+		for(shared=0;shared<ks->last_len && ks->last[shared]==key[shared];shared++) ;
+	}
+	put_varint(ks, shared);
+	put_varint(ks, len-shared);
+	memcpy(ks->data+ks->data_len, key+shared, len-shared);
+	ks->data_len+=len-shared;
+
+	ks->ofs[ks->nr_keys++]=ofs;
+	memcpy(ks->last, key, len+1);
+	ks->last_len=len;
+	return 1; /* success */
+}
+
+/** give back the slack left over from building */
+void keystore_finish(struct keystore *ks) {
+	void *tmp;
+
+	assert(ks!=NULL);
+
+	if(!ks->nr_keys) return;
+	if((tmp=realloc(ks->data, ks->data_len))) {
+		ks->data=tmp;
+		ks->data_max=ks->data_len;
+	}
+	if((tmp=realloc(ks->ofs, ks->nr_keys * sizeof *ks->ofs))) {
+		ks->ofs=tmp;
+		ks->max_keys=ks->nr_keys;
+	}
+	if((tmp=realloc(ks->restart, ks->nr_blocks * sizeof *ks->restart))) {
+		ks->restart=tmp;
+	}
+}
+
+/** memory used by the store */
+size_t keystore_bytes(const struct keystore *ks) {
+	assert(ks!=NULL);
+	return ks->data_max + ks->max_keys * sizeof *ks->ofs
+		+ (ks->max_keys/KEYSTORE_BLOCK+1) * sizeof *ks->restart;
+}
+
+/** decode the key at it->pos on top of the previous key */
+static void decode(struct keystore_iter *it) {
+	const unsigned char *data=it->ks->data;
+	size_t shared, suffix;
+
+	shared=get_varint(data, &it->pos);
+	suffix=get_varint(data, &it->pos);
+	memcpy(it->key+shared, data+it->pos, suffix);
+	it->pos+=suffix;
+	it->len=shared+suffix;
+	it->key[it->len]=0;
+}
+
+/** position it at the first key that is not less than key.
+ * return 0 if every key is less than key */
+int keystore_seek(struct keystore_iter *it, const struct keystore *ks, const char *key) {
+	unsigned lo, hi, mid;
+
+	assert(it!=NULL);
+	assert(ks!=NULL);
+	assert(key!=NULL);
+
+	it->ks=ks;
+	if(!ks->nr_keys) {
+		it->i=0;
+		return 0;
+	}
+
+	/* find the last block that starts at or before key */
+	lo=0;
+	hi=ks->nr_blocks;
+	while(hi-lo>1) {
+		mid=lo+(hi-lo)/2;
+		it->pos=ks->restart[mid];
+		decode(it);
+		if(strcmp(it->key, key)<=0) {
+			lo=mid;
+		} else {
+			hi=mid;
+		}
+	}
+
+	/* then walk forward through it. this can run into the next block */
+	it->i=lo*KEYSTORE_BLOCK;
+	it->pos=ks->restart[lo];
+	decode(it);
+	while(strcmp(it->key, key)<0) {
+		if(!keystore_next(it)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/** move to the next key.
+ * return 0 at the end */
+int keystore_next(struct keystore_iter *it) {
+	assert(it!=NULL);
+
+	if(it->i+1>=it->ks->nr_keys) {
+		it->i=it->ks->nr_keys;
+		return 0;
+	}
+	it->i++;
+	decode(it);
+	return 1;
+}
+
+/** exact match lookup.
+ * return 1 and fill in ofs if found */
+int keystore_find(const struct keystore *ks, const char *key, off_t *ofs) {
+	struct keystore_iter it;
+
+	if(!keystore_seek(&it, ks, key) || strcmp(it.key, key)) {
+		return 0; /* not found */
+	}
+	if(ofs) {
+		*ofs=ks->ofs[it.i];
+	}
+	return 1; /* found */
+}
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
@@ -0,0 +1,41 @@
+#ifndef KEYSTORE_H
+#define KEYSTORE_H
+#include <stddef.h>
+#include <sys/types.h>
+
+#define KEYSTORE_KEY_MAX 256 /* longest key, including the terminator */
+#define KEYSTORE_BLOCK 16 /* keys between restart points */
+
+/* sorted, front-coded keys, each with a file offset */
+struct keystore {
+	unsigned char *data; /* the encoded blocks */
+	size_t data_len, data_max;
+	size_t *restart; /* start of each block in data */
+	unsigned nr_blocks;
+	off_t *ofs; /* one per key, in key order */
+	unsigned nr_keys, max_keys;
+	char last[KEYSTORE_KEY_MAX]; /* previous key added, used while building */
+	size_t last_len;
+};
+
+/* a position in a keystore. key holds the current key */
+struct keystore_iter {
+	const struct keystore *ks;
+	unsigned i; /* index of the current key */
+	size_t pos; /* where the next key starts in data */
+	char key[KEYSTORE_KEY_MAX];
+	size_t len;
+};
+
+void keystore_init(struct keystore *ks);
+void keystore_free(struct keystore *ks);
+int keystore_add(struct keystore *ks, const char *key, off_t ofs);
+void keystore_finish(struct keystore *ks);
+size_t keystore_bytes(const struct keystore *ks);
+int keystore_find(const struct keystore *ks, const char *key, off_t *ofs);
+int keystore_seek(struct keystore_iter *it, const struct keystore *ks, const char *key);
+int keystore_next(struct keystore_iter *it);
+#endif
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
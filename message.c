@@ -0,0 +1,136 @@
+/* message.c : splits a line from the server into its parts */
+/*
+ * parse_incoming() used to clear a struct message of sixteen full size
+ * buffers and copy every field out of the line into one of them, even the
+ * fields nothing looks at. now the line is copied twice, once as it is and
+ * once to write NULs into, and every field is a span of those copies.
+ *
+ * the line is read the RFC 2812 way:
+ *
+ *	[":" prefix " "] command {" " param} [" :" trailing]
+ *
+ * with the prefix split into nick, user and host, at most 15 params where the
+ * 15th takes the rest of the line even without a colon, and the text after
+ * the first param split into words for the commands.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "bot.h"
+#include "message.h"
+
+static const struct msg_span none={ MSG_NONE, 0 };
+
+/** end the field that starts at pos at the next of the characters in seps,
+ * in tok. returns where it ended */
+static size_t cut(struct message *msg, size_t pos, size_t len, const char *seps)
+{
+	size_t end;
+
+	for(end=pos;end<len && !strchr(seps, msg->line[end]);end++) ;
+	msg->tok[end]=0;
+	return end;
+}
+
+static void set_span(struct msg_span *span, size_t start, size_t end)
+{
+	span->off=start;
+	span->len=end-start;
+}
+
+void message_parse(struct message *msg, const char *line)
+{
+	size_t len, pos=0, end;
+	unsigned i;
+
+	assert(msg!=NULL);
+	assert(line!=NULL);
+
+	len=strlen(line);
+	if(len>MSG_NONE-1) len=MSG_NONE-1;
+	while(len && strchr(WHITESPACE, line[len-1])) len--;
+	memcpy(msg->line, line, len);
+	msg->line[len]=0;
+	/* the old fixed buffers were cleared, and callers still step one past
+	 * the end of the text with "text + strlen( first word ) + 1" */
+	msg->line[len+1]=0;
+	msg->line[MSG_NONE]=0;
+	memcpy(msg->tok, msg->line, len+1);
+	msg->tok[MSG_NONE]=0;
+
+	msg->prefix=msg->nick=msg->user=msg->host=msg->command=none;
+	for(i=0;i<MSG_MAXPARAMS;i++) msg->params[i]=none;
+	for(i=0;i<MSG_MAXWORDS;i++) msg->words[i]=none;
+	msg->nr_params=msg->nr_words=0;
+	msg->text=len;
+
+	if(line[0]==':') {
+		/* nick!user@host, or a server name */
+		end=cut(msg, 1, len, " ");
+		set_span(&msg->prefix, 1, end);
+		pos=cut(msg, 1, end, "!@");
+		set_span(&msg->nick, 1, pos);
+		if(pos<end && msg->line[pos]=='!') {
+			i=pos+1;
+			pos=cut(msg, i, end, "@");
+			set_span(&msg->user, i, pos);
+		}
+		if(pos<end) set_span(&msg->host, pos+1, end);
+		pos=end;
+	}
+
+	pos+=strspn(msg->line+pos, " ");
+	end=cut(msg, pos, len, " ");
+	set_span(&msg->command, pos, end);
+	pos=end;
+
+	while(msg->nr_params<MSG_MAXPARAMS) {
+		pos+=strspn(msg->line+pos, " ");
+		if(pos>=len) break;
+		if(msg->line[pos]==':' || msg->nr_params==MSG_MAXPARAMS-1) {
+			/* the trailing param, spaces and all */
+			if(msg->line[pos]==':') pos++;
+			set_span(&msg->params[msg->nr_params++], pos, len);
+			break;
+		}
+		end=cut(msg, pos, len, " ");
+		set_span(&msg->params[msg->nr_params++], pos, end);
+		pos=end;
+	}
+
+	if(msg->nr_params<2) return;
+	msg->text=msg->params[1].off;
+
+	/* words are split on every space, so two spaces make an empty word */
+	for(pos=msg->text;pos<len && msg->nr_words<MSG_MAXWORDS;pos=end+1) {
+		end=cut(msg, pos, len, " ");
+		set_span(&msg->words[msg->nr_words++], pos, end);
+	}
+}
+
+/* copy a field out of msg, for when it has to outlive the message.
+ * returns its length */
+size_t msg_copy(const struct message *msg, const struct msg_span *span, char *dest, size_t max)
+{
+	assert(msg!=NULL);
+	assert(span!=NULL);
+	snprintf(dest, max, "%.*s", (int)span->len, msg->line+span->off);
+	return span->len;
+}
+
+#if 0 /* example code */
+int main() {
+	struct message m;
+	unsigned i;
+
+	message_parse(&m, ":nick!user@host PRIVMSG #chan :!calc foo  bar");
+	printf("nick=%s user=%s host=%s type=%s to=%s text=%s\n",
+		msg_nick(&m), msg_user(&m), msg_host(&m), msg_type(&m), msg_to(&m), msg_text(&m));
+	for(i=1;i<=m.nr_words;i++) printf("arg%u=%s\n", i, msg_arg(&m, i));
+	return 0;
+}
+#endif
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
@@ -0,0 +1,11 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+#include <stddef.h>
+struct message;
+struct msg_span;
+void message_parse(struct message *msg, const char *line);
+size_t msg_copy(const struct message *msg, const struct msg_span *span, char *dest, size_t max);
+#endif
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
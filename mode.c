@@ -1,4 +1,4 @@
-/* mode.c */
+/* mode.c : parses MODE lines, and batches the +v and +o the bot hands out */
 /*
  * Copyright (c) 2008 Jon Mayo
  * This work may be modified and/or redistributed, as long as this license and
@@ -10,10 +10,31 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include "bot.h"
+#include "debug.h"
 #include "mode.h"
+#include "notify.h"
+#include "pQueue.h"
+
+#define MODE_DELAY 1 /* seconds a mode waits for others to join it */
+#define MODES_DEFAULT 3 /* modes in one line until the server says otherwise */
+#define MODES_MAX 12 /* even if the server allows more */
+
+struct pending_mode {
+    char channel[MAX_CHANNEL_NAME];
+    char flag[2]; /* like "+v", without a terminator */
+    char nick[MAXNICKSIZE];
+    struct pending_mode *next;
+};
+
+static struct pending_mode *pending_head, **pending_tail=&pending_head;
+static int modes_limit=MODES_DEFAULT;
+static int flush_scheduled;
+static unsigned long nr_queued, nr_lines, nr_dropped;
 
 /* there is no parse_mode_end */
 void parse_mode_begin(struct mode_parser *st, const char *fulltext) {
@@ -56,7 +77,7 @@ int parse_mode_next(struct mode_parser *st, char mode_flag[2], char *arg, size_t
     }
 
     /* these modes don't take parameters - add more for fancier irc servers */
-    if(mode_flag[0]=='i' || mode_flag[0]=='m' || mode_flag[0]=='n' || mode_flag[0]=='p' || mode_flag[0]=='s' || mode_flag[0]=='t') {
+    if(mode_flag[1]=='i' || mode_flag[1]=='m' || mode_flag[1]=='n' || mode_flag[1]=='p' || mode_flag[1]=='s' || mode_flag[1]=='t') {
         arg[0]=0; /* no arg */
         return 1;
     }
@@ -75,6 +96,200 @@ int parse_mode_next(struct mode_parser *st, char mode_flag[2], char *arg, size_t
     return 1; /* success */
 }
 
+/*
+ * a netsplit rejoin used to cost one "mode #chan +v nick" line for each
+ * person. now the modes wait MODE_DELAY seconds and go out as
+ * "mode #chan +vvv a b c", as many in a line as the server's MODES allows.
+ * a mode is dropped while it waits if the nick leaves, changes nick, or
+ * someone else sets or unsets that mode on them first.
+ */
+
+/** remove the pending modes that match. a NULL channel or flag matches any */
+static void forget(const char *channel, const char *nick, char letter) {
+    struct pending_mode *curr, **prev;
+
+    for(prev=&pending_head;(curr=*prev);) {
+        if((!channel || !strcasecmp(curr->channel, channel))
+         && !strcasecmp(curr->nick, nick)
+         && (!letter || curr->flag[1]==letter)) {
+            *prev=curr->next;
+            free(curr);
+            nr_dropped++;
+            continue;
+        }
+        prev=&curr->next;
+    }
+    pending_tail=prev;
+}
+
+/** send one line for channel, taking as many of its modes as fit */
+static void send_line(const char *chan) {
+    char flags[MODES_MAX*2+1], nicks[MAXDATASIZE], line[MAXDATASIZE];
+    char channel[MAX_CHANNEL_NAME];
+    struct pending_mode *curr, **prev;
+    size_t flen=0, nlen=0;
+    int n=0;
+    char sign=0;
+
+    snprintf(channel, sizeof channel, "%s", chan); /* chan may be freed below */
+    for(prev=&pending_head;(curr=*prev) && n<modes_limit;) {
+        if(strcasecmp(curr->channel, channel)) {
+            prev=&curr->next;
+            continue;
+        }
+        /* leave room for "mode #chan " in front */
+        if(nlen+strlen(curr->nick)+1+flen+2+strlen(channel)+8>=MAXDATASIZE-2) break;
+        if(curr->flag[0]!=sign) flags[flen++]=sign=curr->flag[0];
+        flags[flen++]=curr->flag[1];
+        nlen+=snprintf(nicks+nlen, sizeof nicks-nlen, " %s", curr->nick);
+        n++;
+        *prev=curr->next;
+        free(curr);
+    }
+    pending_tail=&pending_head;
+    while(*pending_tail) pending_tail=&(*pending_tail)->next;
+    flags[flen]=0;
+    snprintf(line, sizeof line, "mode %s %s%s", channel, flags, nlen ? nicks : "");
+    send_irc_message(line);
+    nr_lines++;
+}
+
+static void flush_timer(void *unused) {
+    (void)unused;
+    flush_scheduled=0;
+    mode_queue_flush();
+}
+
+/* send everything that is waiting */
+void mode_queue_flush(void) {
+    while(pending_head) send_line(pending_head->channel);
+}
+
+/* set a channel mode that takes a nick, like "+v". it is sent with others
+ * for the same channel after a short wait */
+void mode_queue(const char *channel, const char *flag, const char *nick) {
+    struct pending_mode *newent, *curr;
+    int n=0;
+
+    assert(channel!=NULL);
+    assert(flag!=NULL);
+    assert(nick!=NULL);
+    if(!channel[0] || !nick[0] || (flag[0]!='+' && flag[0]!='-') || !flag[1]) return;
+
+    for(curr=pending_head;curr;curr=curr->next) {
+        if(strcasecmp(curr->channel, channel)) continue;
+        if(curr->flag[1]==flag[1] && !strcasecmp(curr->nick, nick)) {
+            curr->flag[0]=flag[0]; /* the last one asked for wins */
+            return;
+        }
+        n++;
+    }
+
+    newent=malloc(sizeof *newent);
+    if(!newent) {
+        /* out of memory - send it on its own */
+        char line[MAXDATASIZE];
+        snprintf(line, sizeof line, "mode %s %c%c %s", channel, flag[0], flag[1], nick);
+        send_irc_message(line);
+        return;
+    }
+    snprintf(newent->channel, sizeof newent->channel, "%s", channel);
+    newent->flag[0]=flag[0];
+    newent->flag[1]=flag[1];
+    snprintf(newent->nick, sizeof newent->nick, "%s", nick);
+    newent->next=0;
+    *pending_tail=newent;
+    pending_tail=&newent->next;
+    nr_queued++;
+
+    if(n+1>=modes_limit) {
+        /* a full line for this channel, no reason to wait */
+        send_line(channel);
+    }
+    if(pending_head && !flush_scheduled) {
+        flush_scheduled=1;
+        pQueueAdd(&action_queue, pQueueRealtime() + MODE_DELAY PQUE_SECONDS, flush_timer, NULL);
+    }
+}
+
+static int mq_onpart(void *p, struct message *msg) {
+    (void)p;
+    forget(msg_to(msg), msg_nick(msg), 0);
+    return NOTIFY_CONTINUE;
+}
+
+static int mq_onkick(void *p, struct message *msg) {
+    (void)p;
+    forget(msg_to(msg), msg_param(msg, 1), 0);
+    return NOTIFY_CONTINUE;
+}
+
+/* QUIT and NICK */
+static int mq_ongone(void *p, struct message *msg) {
+    (void)p;
+    forget(0, msg_nick(msg), 0);
+    return NOTIFY_CONTINUE;
+}
+
+/* someone else got there first */
+static int mq_onmode(void *p, struct message *msg) {
+    struct mode_parser mp;
+    char flag[2];
+    char buf[MAXNICKSIZE];
+
+    (void)p;
+    if(!pending_head) return NOTIFY_CONTINUE;
+    parse_mode_begin(&mp, msg_text(msg));
+    while(parse_mode_next(&mp, flag, buf, sizeof buf)) {
+        if(buf[0]) forget(msg_to(msg), buf, flag[1]);
+    }
+    return NOTIFY_CONTINUE;
+}
+
+/* RPL_ISUPPORT, for MODES=n */
+static int mq_on005(void *p, struct message *msg) {
+    const char *s;
+    size_t len;
+    int n;
+
+    (void)p;
+    for(s=msg_text(msg);*s && *s!=':';s+=len,s+=strspn(s, WHITESPACE)) {
+        len=strcspn(s, WHITESPACE);
+        if(len==5 && !strncmp(s, "MODES", 5)) {
+            n=MODES_MAX; /* no value means no limit */
+        } else if(!strncmp(s, "MODES=", 6)) {
+            n=atoi(s+6);
+        } else {
+            continue;
+        }
+        if(n<1) n=1;
+        if(n>MODES_MAX) n=MODES_MAX;
+        if(verbose>0 && n!=modes_limit) {
+            INFO("mode: server allows %d modes in a line\n", n);
+        }
+        modes_limit=n;
+    }
+    return NOTIFY_CONTINUE;
+}
+
+int mode_queue_init(void) {
+    return notify_register("PART", "mq_onpart", mq_onpart, 0, NOTIFY_PRIO_DEFAULT, 0)
+        && notify_register("KICK", "mq_onkick", mq_onkick, 0, NOTIFY_PRIO_DEFAULT, 0)
+        && notify_register("QUIT", "mq_ongone", mq_ongone, 0, NOTIFY_PRIO_DEFAULT, 0)
+        && notify_register("NICK", "mq_ongone", mq_ongone, 0, NOTIFY_PRIO_DEFAULT, 0)
+        && notify_register("MODE", "mq_onmode", mq_onmode, 0, NOTIFY_PRIO_DEFAULT, 0)
+        && notify_register("005", "mq_on005", mq_on005, 0, NOTIFY_PRIO_DEFAULT, 0);
+}
+
+void mode_queue_stats(char *dest, size_t max) {
+    unsigned n=0;
+    struct pending_mode *curr;
+
+    for(curr=pending_head;curr;curr=curr->next) n++;
+    snprintf(dest, max, "mode: %u waiting, %lu queued, %lu lines sent, %lu dropped, %d modes a line",
+        n, nr_queued, nr_lines, nr_dropped, modes_limit);
+}
+
 #if 0 /* example code */
 int main() {
     struct mode_parser st;
@@ -8,4 +8,9 @@ struct mode_parser {
 
 void parse_mode_begin(struct mode_parser *st, const char *fulltext);
 int parse_mode_next(struct mode_parser *st, char mode_flag [2 ], char *arg, size_t arglen);
+
+int mode_queue_init(void);
+void mode_queue(const char *channel, const char *flag, const char *nick);
+void mode_queue_flush(void);
+void mode_queue_stats(char *dest, size_t max);
 #endif
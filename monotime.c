@@ -0,0 +1,18 @@
+/* monotime.c : a clock for measuring intervals */
+/*
+ * CLOCK_MONOTONIC doesn't jump when the date is set, so it is what handler
+ * timings, rate limits and the send queue's pacing are measured against.
+ */
+#include <time.h>
+#include "monotime.h"
+
+/** monotonic time in nanoseconds */
+unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
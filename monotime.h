@@ -0,0 +1,7 @@
+#ifndef MONOTIME_H
+#define MONOTIME_H
+unsigned long long now_ns(void);
+#endif
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
@@ -9,61 +9,146 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "bot.h"
 #include "debug.h"
+#include "monotime.h"
 #include "notify.h"
 #include "strhash.h"
 
 #define HASH_SZ 256 /* hash table size - does not have to be power of 2 */
+#define NR_NUMERICS 1000 /* 3 digit replies use their number as the id */
+#define MAX_VERBS 64 /* named types, like PRIVMSG, get the ids after that */
+#define NR_TYPES (NR_NUMERICS+MAX_VERBS)
+#define QUEUE_MAX 256 /* events waiting per queue before handlers run inline */
 
 struct notify_handler {
     struct notify_handler **prev, *next;
-    void (*func)(void *p, struct message *msg);
+    int (*func)(void *p, struct message *msg);
     void *p;
+	int priority; /* lists are kept in priority order */
+	int flags; /* NOTIFY_DEFERRED or NOTIFY_THREADED */
+	char *name; /* for the stats */
+	unsigned long calls, consumed;
+	unsigned long long total_ns, max_ns;
 };
 
-struct notify_head {
+/* a copy of a message waiting for one handler */
+struct notify_event {
+	struct notify_handler *h;
+	struct notify_event *next;
+	struct message msg;
+};
+
+struct notify_queue {
+	struct notify_event *head, **tail;
+	unsigned len;
+};
+
+/* a named message type and its interned id */
+struct notify_verb {
 	char *type; /* key for the entry */
-	struct notify_handler *head;
-	struct notify_head *next; /* collision */
+	int id;
+	struct notify_verb *next; /* collision */
 };
 
-/* hash table for notify based on prototype message type */
-static struct notify_head *notify_hash[HASH_SZ];
+/* handler lists, indexed by type id */
+static struct notify_handler *handlers[NR_TYPES];
+/* hash table to intern named message types. ids are never given back, so a
+ * type keeps its id for the life of the program */
+static struct notify_verb *verb_hash[HASH_SZ];
+static const char *verb_names[MAX_VERBS]; /* id-NR_NUMERICS to name */
+static int nr_verbs;
 /* TODO: add a table for event based notification. like myname events */
 
-/* if should_create is non-zero, it can only return error for out of memory */
-static struct notify_head *find_head(const char *type, int should_create, struct notify_head ***prev)
+/* NOTIFY_DEFERRED events, run by notify_run_deferred() */
+static struct notify_queue deferred={ 0, &deferred.head, 0 };
+/* NOTIFY_THREADED events and the thread that runs them. worker_lock also
+ * covers the counters of threaded handlers */
+static struct notify_queue threaded={ 0, &threaded.head, 0 };
+static pthread_mutex_t worker_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_wake=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t worker_done=PTHREAD_COND_INITIALIZER;
+static struct notify_handler *worker_busy; /* handler the worker is in */
+static pthread_t worker;
+static int worker_started;
+
+/** return the numeric value of a 3 digit reply, or -1 */
+static int numeric_id(const char *type)
+{
+	if(isdigit((unsigned char)type[0]) && isdigit((unsigned char)type[1]) && isdigit((unsigned char)type[2]) && !type[3]) {
+		return (type[0]-'0')*100 + (type[1]-'0')*10 + (type[2]-'0');
+	}
+	return -1;
+}
+
+/* if should_create is non-zero, it can only return error for out of memory
+ * or when MAX_VERBS types have been interned */
+static struct notify_verb *find_verb(const char *type, int should_create)
 {
 	unsigned h;
-	struct notify_head *curr, **_prev;
-	h=strcasehash(type)%HASH_SZ;
-	for(_prev=&notify_hash[h],curr=*_prev;curr;_prev=&curr->next,curr=*_prev) {
+	struct notify_verb *curr;
+	/* types come from the server, so use the keyed hash */
+	h=strcasesiphash(type)%HASH_SZ;
+	for(curr=verb_hash[h];curr;curr=curr->next) {
 		if(!strcasecmp(curr->type, type)) {
-			if(prev) *prev=_prev;
 			return curr; /* found entry */
 		}
 	}
 	/** not found **/
 	if(should_create) {
+		if(nr_verbs>=MAX_VERBS) {
+			ERROR("too many message types, can't add %s\n", type);
+			return 0;
+		}
 		curr=malloc(sizeof *curr);
 		if(!curr) {
 			perror("malloc()");
 			return 0; /* out of memory */
 		}
 		curr->type=strdup(type);
-		curr->head=0;
+		verb_names[nr_verbs]=curr->type;
+		curr->id=NR_NUMERICS+nr_verbs++;
 		/* insert onto the top */
-		curr->next=notify_hash[h];
-		notify_hash[h]=curr;
+		curr->next=verb_hash[h];
+		verb_hash[h]=curr;
 		return curr; /* created new entry */
 	}
 	return 0; /* not found */
 }
 
-static struct notify_handler *add_entry(struct notify_handler **head, void (*func)(void *p, struct message *msg), void *p)
+/** id for a message type, for struct message's type_id.
+ * a named type that nothing has registered for has no id, and is reported
+ * as NOTIFY_TYPE_NONE */
+int notify_type_id(const char *type)
+{
+	struct notify_verb *verb;
+	int id;
+
+	if(!type || !type[0]) return NOTIFY_TYPE_NONE;
+	if((id=numeric_id(type))>=0) return id;
+	verb=find_verb(type, 0);
+	return verb ? verb->id : NOTIFY_TYPE_NONE;
+}
+
+/** like notify_type_id(), but creates an id for a new named type */
+static int intern_type(const char *type)
+{
+	struct notify_verb *verb;
+	int id;
+
+	if((id=numeric_id(type))>=0) return id;
+	verb=find_verb(type, 1);
+	return verb ? verb->id : NOTIFY_TYPE_NONE;
+}
+
+/* insert after every handler of the same or lower priority, so equal
+ * priorities run in the order they were registered */
+static struct notify_handler *add_entry(struct notify_handler **head, const char *name, int (*func)(void *p, struct message *msg), void *p, int priority, int flags)
 {
     struct notify_handler *ret;
 	assert(head!=NULL);
@@ -76,10 +161,22 @@ static struct notify_handler *add_entry(struct notify_handler **head, void (*fun
 	assert(ret!=NULL);
     if(!ret) return NULL;
 
-    ret->next=*head;
-    ret->prev=head;
     ret->p=p;
     ret->func=func;
+	ret->priority=priority;
+	ret->flags=flags;
+	ret->name=strdup(name ? name : "?");
+	ret->calls=ret->consumed=0;
+	ret->total_ns=ret->max_ns=0;
+
+	while(*head && (*head)->priority<=priority) {
+		head=&(*head)->next;
+	}
+    ret->next=*head;
+    ret->prev=head;
+	if(ret->next) {
+		ret->next->prev=&ret->next;
+	}
 	*head=ret;
 
     return ret;
@@ -95,84 +192,287 @@ static void remove_and_free_handler(struct notify_handler *h)
         (*h->prev)=h->next;
 
         /* TODO: how do we free p ?? */
+        free(h->name);
         free(h);
     }
 }
 
-/* detach a notify_head and free it */
-static void remove_and_free_head(struct notify_head *head, struct notify_head **prev) {
-	assert(head!=NULL);
-	assert(prev!=NULL);
-	assert(head->head==NULL);
-	if(!head || !prev || head->head) return; /* ignore invalid state */
-	*prev=head->next;
-	free(head->type);
-	free(head);
+/** call a handler and store how long it took in elapsed.
+ * return what the handler returned */
+static int call_handler(struct notify_handler *h, struct message *msg, unsigned long long *elapsed)
+{
+	unsigned long long start;
+	int ret;
+
+	if(verbose>2) {
+		INFO("calling %s for msgtype:%s\n", h->name, msg_type(msg));
+	}
+	start=now_ns();
+	ret=h->func(h->p, msg);
+	*elapsed=now_ns()-start;
+	return ret;
+}
+
+static void count_call(struct notify_handler *h, int ret, unsigned long long elapsed)
+{
+	h->calls++;
+	if(ret==NOTIFY_CONSUMED) h->consumed++;
+	h->total_ns+=elapsed;
+	if(elapsed>h->max_ns) h->max_ns=elapsed;
 }
 
-/* push a notify event out for a message */
+/** append a copy of msg for h.
+ * return 0 if the queue is full or out of memory */
+static int queue_event(struct notify_queue *q, struct notify_handler *h, const struct message *msg)
+{
+	struct notify_event *ev;
+
+	if(q->len>=QUEUE_MAX) return 0;
+	ev=malloc(sizeof *ev);
+	if(!ev) {
+		perror("malloc()");
+		return 0;
+	}
+	ev->h=h;
+	ev->next=0;
+	memcpy(&ev->msg, msg, sizeof ev->msg);
+	*q->tail=ev;
+	q->tail=&ev->next;
+	q->len++;
+	return 1;
+}
+
+/** remove the first event, or return 0 if there are none */
+static struct notify_event *dequeue_event(struct notify_queue *q)
+{
+	struct notify_event *ev=q->head;
+
+	if(ev) {
+		q->head=ev->next;
+		if(!q->head) q->tail=&q->head;
+		q->len--;
+	}
+	return ev;
+}
+
+/** drop the events waiting for h */
+static void purge_events(struct notify_queue *q, struct notify_handler *h)
+{
+	struct notify_event **pp, *ev;
+
+	for(pp=&q->head;(ev=*pp);) {
+		if(ev->h==h) {
+			*pp=ev->next;
+			q->len--;
+			free(ev);
+		} else {
+			pp=&ev->next;
+		}
+	}
+	/* the last one might have gone */
+	for(q->tail=&q->head;*q->tail;q->tail=&(*q->tail)->next) ;
+}
+
+static void *worker_main(void *unused)
+{
+	struct notify_event *ev;
+	unsigned long long elapsed;
+	int ret;
+
+	(void)unused;
+	pthread_mutex_lock(&worker_lock);
+	for(;;) {
+		while(!(ev=dequeue_event(&threaded))) {
+			pthread_cond_wait(&worker_wake, &worker_lock);
+		}
+		worker_busy=ev->h;
+		pthread_mutex_unlock(&worker_lock);
+
+		ret=call_handler(ev->h, &ev->msg, &elapsed);
+
+		pthread_mutex_lock(&worker_lock);
+		count_call(ev->h, ret, elapsed);
+		worker_busy=0;
+		pthread_cond_broadcast(&worker_done);
+		free(ev);
+	}
+	return 0;
+}
+
+/** start the thread for NOTIFY_THREADED handlers, if it isn't running.
+ * returns 0 on failure */
+static int start_worker(void)
+{
+	if(worker_started) return 1;
+	if(pthread_create(&worker, 0, worker_main, 0)) {
+		perror("pthread_create()");
+		return 0;
+	}
+	pthread_detach(worker);
+	worker_started=1;
+	return 1;
+}
+
+/* push a notify event out for a message.
+ * msg->type_id must have been set with notify_type_id().
+ * handlers are called in priority order until one returns NOTIFY_CONSUMED.
+ * deferred and threaded handlers get a copy of msg and run later, so what
+ * they return is only counted. if their queue is full they run now
+ * instead, so a flood can't use up all memory */
 void notify_report_message(struct message *msg)
 {
-	struct notify_head *head;
 	struct notify_handler *curr;
+	unsigned long long elapsed;
+	int queued, ret;
+
 	if(!msg) return;
-	if(msg->msgtype[0]==0) return; /* ignore untyped messages*/
+	if(msg->type_id<0 || msg->type_id>=NR_TYPES) return; /* no handler - ignore */
 	if(verbose>2) {
-		INFO("Reporting msgtype:%s\n", msg->msgtype);
+		INFO("Reporting msgtype:%s (id %d)\n", msg_type(msg), msg->type_id);
 	}
-	head=find_head(msg->msgtype, 0, 0);
-	if(!head) return; /* no handler - ignore */
 
-	if(verbose>2) {
-		INFO("Found head for msgtype:%s\n", msg->msgtype);
-	}
-	for(curr=head->head;curr;curr=curr->next) {
-		if(verbose>2) {
-			INFO("calling func:%p for msgtype:%s\n", curr->func, msg->msgtype);
-		}
-		if(curr->func) {
-			curr->func(curr->p, msg);
+	for(curr=handlers[msg->type_id];curr;curr=curr->next) {
+		if(!curr->func) continue;
+		if(curr->flags&NOTIFY_THREADED) {
+			pthread_mutex_lock(&worker_lock);
+			queued=queue_event(&threaded, curr, msg);
+			if(queued) {
+				pthread_cond_signal(&worker_wake);
+			}
+			pthread_mutex_unlock(&worker_lock);
+			if(queued) continue;
+			/* thread safe, so it can run here too */
+			ret=call_handler(curr, msg, &elapsed);
+			pthread_mutex_lock(&worker_lock);
+			count_call(curr, ret, elapsed);
+			pthread_mutex_unlock(&worker_lock);
+		} else if(curr->flags&NOTIFY_DEFERRED && queue_event(&deferred, curr, msg)) {
+			continue;
+		} else {
+			ret=call_handler(curr, msg, &elapsed);
+			count_call(curr, ret, elapsed);
+			if(ret==NOTIFY_CONSUMED && !curr->flags) {
+				if(verbose>2) {
+					INFO("%s consumed msgtype:%s\n", curr->name, msg_type(msg));
+				}
+				break;
+			}
 		}
 	}
 }
 
-/* register a notify handler
+/* run the NOTIFY_DEFERRED handlers for the messages reported so far.
+ * returns the number of handlers called */
+unsigned notify_run_deferred(void)
+{
+	struct notify_event *ev;
+	unsigned long long elapsed;
+	unsigned n=0;
+	int ret;
+
+	while((ev=dequeue_event(&deferred))) {
+		ret=call_handler(ev->h, &ev->msg, &elapsed);
+		count_call(ev->h, ret, elapsed);
+		free(ev);
+		n++;
+	}
+	return n;
+}
+
+/* register a notify handler. name is what the handler is called in the
+ * stats, usually the function name. handlers with a lower priority run
+ * first, see NOTIFY_PRIO_FILTER. flags is 0 to run the handler as each
+ * message is parsed, NOTIFY_DEFERRED to run it from notify_run_deferred()
+ * or NOTIFY_THREADED to run it on a worker thread. a threaded handler must
+ * be thread safe and must not use cur_msg.
  * returns 0 on failure */
-int notify_register(const char *type, void (*func)(void *p, struct message *msg), void *p)
+int notify_register(const char *type, const char *name, int (*func)(void *p, struct message *msg), void *p, int priority, int flags)
 {
-	struct notify_head *head;
+	int id;
 
 	if(!type) return 0; /* failure */
-	head=find_head(type, 1, 0);
-	if(!head) return 0; /* failure - probably out of memory */
-    return add_entry(&head->head, func, p)!=NULL;
+	id=intern_type(type);
+	if(id<0) return 0; /* failure - probably out of memory */
+	if(flags&NOTIFY_THREADED && !start_worker()) {
+		flags=NOTIFY_DEFERRED; /* still off the receive path */
+	}
+    return add_entry(&handlers[id], name, func, p, priority, flags)!=NULL;
 }
 
 /* unregister a handler with matching function pointer
- * keep calling to unregister all. returns 0 when done. */
-int notify_unregister(const char *type, void (*func)(void *p, struct message *msg))
+ * keep calling to unregister all. returns 0 when done.
+ * events still queued for it are dropped. must not be called from a
+ * threaded handler */
+int notify_unregister(const char *type, int (*func)(void *p, struct message *msg))
 {
-    struct notify_handler *curr, **prev;
-	struct notify_head *head, **headprev;
+    struct notify_handler *curr;
+	int id;
 
 	if(!type) return 0; /* failure */
-	head=find_head(type, 0, &headprev);
-	if(!head) return 0; /* failure - not registered */
+	id=notify_type_id(type);
+	if(id<0) return 0; /* failure - not registered */
 
-    prev=&head->head;
-    for(curr=*prev;curr;prev=&curr->next,curr=curr->next) {
+    for(curr=handlers[id];curr;curr=curr->next) {
         if(curr->func==func) {
-            remove_and_free_handler(curr);
-            curr=*prev;
-			assert(headprev!=NULL);
-			if(!head->head && headprev) { /* it's empty - free it */
-			 	remove_and_free_head(head, headprev);
+			if(curr->flags&NOTIFY_THREADED) {
+				pthread_mutex_lock(&worker_lock);
+				purge_events(&threaded, curr);
+				while(worker_busy==curr) {
+					pthread_cond_wait(&worker_done, &worker_lock);
+				}
+				pthread_mutex_unlock(&worker_lock);
+			} else {
+				purge_events(&deferred, curr);
 			}
+            remove_and_free_handler(curr);
             return 1; /* removed */
         }
     }
     return 0; /* not found */
 }
 
+/** name of a type id, in buf if it has to be made up */
+static const char *type_name(int id, char *buf, size_t max)
+{
+	if(id>=NR_NUMERICS) return verb_names[id-NR_NUMERICS];
+	snprintf(buf, max, "%03d", id);
+	return buf;
+}
+
+/* describe the n'th registered handler's counters in dest.
+ * returns 0 when there is no n'th handler */
+int notify_stats(unsigned n, char *dest, size_t max)
+{
+	struct notify_handler *curr;
+	char buf[4];
+	int id;
+
+	for(id=0;id<NR_TYPES;id++) {
+		for(curr=handlers[id];curr;curr=curr->next) {
+			if(n--) continue;
+			pthread_mutex_lock(&worker_lock);
+			snprintf(dest, max, "notify: %s %s%s priority %d: %lu calls, %lu consumed, total %.3fms, avg %.1fus, max %.1fus",
+				type_name(id, buf, sizeof buf), curr->name,
+				curr->flags&NOTIFY_THREADED ? " (threaded)" : curr->flags&NOTIFY_DEFERRED ? " (deferred)" : "",
+				curr->priority, curr->calls, curr->consumed, curr->total_ns/1e6, curr->calls ? curr->total_ns/1e3/curr->calls : 0.,
+				curr->max_ns/1e3);
+			pthread_mutex_unlock(&worker_lock);
+			return 1;
+		}
+	}
+	return 0; /* no more handlers */
+}
+
+/* write every handler's counters to f */
+void notify_dump_stats(FILE *f)
+{
+	char line[256];
+	unsigned n;
+
+	for(n=0;notify_stats(n, line, sizeof line);n++) {
+		fprintf(f, "%s\n", line);
+	}
+}
+
 /*****************************----end code----*****************************/
 // vi: noet sts=0 ts=4 sw=4
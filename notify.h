@@ -1,9 +1,24 @@
 #ifndef NOTIFY_H
 #define NOTIFY_H
+#include <stddef.h>
+#include <stdio.h>
 struct message;
-int notify_register(const char *type, void (*func)(void *p, struct message *msg), void *p);
-int notify_unregister(const char *type, void (*func)(void *p, struct message *msg));
+#define NOTIFY_TYPE_NONE (-1) /* type_id of a message nothing listens for */
+#define NOTIFY_DEFERRED 1 /* run from notify_run_deferred(), after the socket is read */
+#define NOTIFY_THREADED 2 /* run on the notify thread. the handler must be thread safe */
+/* what a handler returns */
+#define NOTIFY_CONTINUE 0 /* let the next handler see the message */
+#define NOTIFY_CONSUMED 1 /* no more handlers for this message */
+/* priorities. lower runs first */
+#define NOTIFY_PRIO_FILTER (-100) /* cheap filters, like ignore lists and flood guards */
+#define NOTIFY_PRIO_DEFAULT 0
+int notify_type_id(const char *type);
+int notify_register(const char *type, const char *name, int (*func)(void *p, struct message *msg), void *p, int priority, int flags);
+int notify_unregister(const char *type, int (*func)(void *p, struct message *msg));
 void notify_report_message(struct message *msg);
+unsigned notify_run_deferred(void);
+int notify_stats(unsigned n, char *dest, size_t max);
+void notify_dump_stats(FILE *f);
 #endif
 
 /*****************************----end code----*****************************/
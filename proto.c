@@ -5,6 +5,9 @@
 #include "proto.h"
 
 #define NR(x) (sizeof(x)/sizeof*(x))
+#define PROTO_MAX_KEYS 8 /* words looked up by one proto command */
+#define PROTO_MAX_FIELDS 3 /* prototype, standard, header */
+#define PROTO_COMPACT_MIN 64 /* dead records before compacting is worth it */
 
 static struct udb_handle *proto_h;
 
@@ -152,6 +155,10 @@ int proto_init(void) {
 	if(!proto_h) {
 		return 0;
 	}
+	/* edits to proto.udb are picked up without stalling the bot */
+	udb_set_background(proto_h, 1);
+	/* most misses are typos, let the bloom filter answer them */
+	udb_set_bloom(proto_h, 10);
 	return 1;
 }
 
@@ -159,43 +166,163 @@ void proto_shutdown(void) {
 	udb_close(proto_h);
 }
 
-int proto_result(char *dest, size_t max, const char *in) {
-	unsigned res;
+/** changes whenever a proto is added, removed or reloaded, for anything
+ * that keeps answers around */
+unsigned proto_generation(void) {
+	return udb_generation(proto_h);
+}
+
+/** one line summary of the proto database for the stats command */
+void proto_stats(char *dest, size_t max) {
+	struct udb_stats st;
+
+	udb_get_stats(proto_h, &st);
+	snprintf(dest, max, "proto: gen %u, %d records (%lu bytes, %d dead, %u unindexed), %lu lookups, %lu hits, "
+		"bloom %lu bytes rejected %lu, false positives %lu (%.2f%%, expected %.2f%%)",
+		st.generation, st.records, st.index_bytes, st.dead_records, st.pending_writes, st.lookups, st.hits,
+		st.bloom_bytes, st.bloom_rejects, st.bloom_false_positives,
+		st.bloom_fp_measured*100., st.bloom_fp_expected*100.);
+}
+
+/** rewrite proto.udb once it is mostly dead records */
+static void maybe_compact(void) {
+	struct udb_stats st;
+
+	udb_get_stats(proto_h, &st);
+	if(st.dead_records>=PROTO_COMPACT_MIN && st.dead_records>st.records) {
+		udb_compact(proto_h);
+	}
+}
+
+/** add or replace a prototype. in is "prototype | standard | header", the
+ * last two are optional. a reply goes in dest.
+ * return 0 on failure */
+int proto_put(char *dest, size_t max, const char *in) {
+	char buf[512];
 	char key[64];
-	char proto[200], from[80], headers[100];
+	const char *fields[PROTO_MAX_FIELDS];
+	unsigned nr_fields;
+	char *p, *bar, *end;
 
-	while(isspace(*in)) in++;
+	if(strlen(in)>=sizeof buf) {
+		snprintf(dest, max, "That's too long.");
+		return 0;
+	}
+	strcpy(buf, in);
 
-	res=next_word(in);
-	if(!res || res+1>64) {
+	/* split on '|' and trim each field */
+	for(nr_fields=0,p=buf;p && nr_fields<PROTO_MAX_FIELDS;nr_fields++) {
+		bar=strchr(p, '|');
+		if(bar) {
+			*bar++=0;
+		}
+		p+=eat_spaces(p);
+		for(end=p+strlen(p);end>p && isspace(end[-1]);end--) ;
+		*end=0;
+		fields[nr_fields]=p;
+		p=bar;
+	}
+	if(p || !*fields[0]) {
 		snprintf(dest, max, "Makes no sense.");
-		return 0; /* not found */
+		return 0;
+	}
+
+	if(!parse_proto_key(fields[0], key, sizeof key)) {
+		snprintf(dest, max, "Could not find a name in '%s'.", fields[0]);
+		return 0;
+	}
+	if(!udb_put(proto_h, fields, nr_fields)) {
+		snprintf(dest, max, "Could not save '%s'.", key);
+		return 0;
+	}
+	maybe_compact();
+	snprintf(dest, max, "Saved '%s'.", key);
+	return 1;
+}
+
+/** remove the prototype for name. a reply goes in dest.
+ * return 0 on failure */
+int proto_delete(char *dest, size_t max, const char *name) {
+	name+=eat_spaces(name);
+	if(!udb_delete(proto_h, name)) {
+		snprintf(dest, max, "I don't know about '%s'.", name);
+		return 0;
 	}
+	maybe_compact();
+	snprintf(dest, max, "Removed '%s'.", name);
+	return 1;
+}
 
-	memcpy(key,	in, res);
-	key[res]=0;
+/** format one record of a batch into dest.
+ * return 0 if the record was not found */
+static int format_view(char *dest, size_t max, const struct udb_view *v) {
+	const char *proto, *from, *headers;
+	size_t proto_len, from_len, headers_len;
 
-	if(!udb_lookup(proto_h, key)) {
-		snprintf(dest, max, "I don't know about '%s'.", key);
+	if(!v->data) {
+		snprintf(dest, max, "I don't know about '%s'.", v->key);
 		return 0; /* not found */
 	}
 
-	if(!udb_read_field(proto_h, proto, sizeof proto)) {
-		fprintf(stderr, "Error reading proto record for '%s'\n", key);
-		snprintf(dest, max, "Error reading proto record for '%s'.", key);
+	if(!udb_view_field(v, 0, &proto, &proto_len)) {
+		fprintf(stderr, "Error reading proto record for '%s'\n", v->key);
+		snprintf(dest, max, "Error reading proto record for '%s'.", v->key);
 		return 0; /* not found / error */
 	}
 
-	if(!udb_read_field(proto_h, from, sizeof from)) {
-		snprintf(dest, max, "%s", proto);
-	} else if(!udb_read_field(proto_h, headers, sizeof headers)) {
-		snprintf(dest, max, "%s /* %s */", proto, from);
+	if(!udb_view_field(v, 1, &from, &from_len)) {
+		snprintf(dest, max, "%.*s", (int)proto_len, proto);
+	} else if(!udb_view_field(v, 2, &headers, &headers_len)) {
+		snprintf(dest, max, "%.*s /* %.*s */", (int)proto_len, proto, (int)from_len, from);
 	} else {
-		snprintf(dest, max, "%s %s /* %s */", headers, proto, from);
+		snprintf(dest, max, "%.*s %.*s /* %.*s */", (int)headers_len, headers, (int)proto_len, proto, (int)from_len, from);
+	}
+	return 1;
+}
+
+/** look up every word of in. all of the records are fetched in one pass */
+int proto_result(char *dest, size_t max, const char *in) {
+	unsigned res, i, nr_keys;
+	char keys[PROTO_MAX_KEYS][64];
+	const char *keyp[PROTO_MAX_KEYS];
+	struct udb_batch *batch;
+	size_t len;
+	int found;
+
+	for(nr_keys=0;nr_keys<PROTO_MAX_KEYS;nr_keys++) {
+		while(isspace(*in)) in++;
+
+		res=next_word(in);
+		if(!res && nr_keys) break; /* end of the list */
+		if(!res || res+1>sizeof *keys) {
+			snprintf(dest, max, "Makes no sense.");
+			return 0; /* not found */
+		}
+
+		memcpy(keys[nr_keys], in, res);
+		keys[nr_keys][res]=0;
+		keyp[nr_keys]=keys[nr_keys];
+		in+=res;
 	}
 
+	batch=udb_lookup_many(proto_h, keyp, nr_keys);
+	if(!batch) {
+		snprintf(dest, max, "Error reading proto record for '%s'.", keys[0]);
+		return 0; /* error */
+	}
 
-	return 1;
+	found=0;
+	for(i=0,len=0;i<batch->nr_views && len<max;i++) {
+		if(i) {
+			len+=snprintf(dest+len, max-len, " | ");
+			if(len>=max) break;
+		}
+		found+=format_view(dest+len, max-len, &batch->view[i]);
+		len+=strlen(dest+len);
+	}
+
+	udb_batch_free(batch);
+	return found>0;
 }
 
 /*** UNIT TEST ***/
@@ -3,6 +3,10 @@
 int proto_init(void);
 void proto_shutdown(void);
 int proto_result(char *dest, size_t max, const char *in);
+void proto_stats(char *dest, size_t max);
+unsigned proto_generation(void);
+int proto_put(char *dest, size_t max, const char *in);
+int proto_delete(char *dest, size_t max, const char *name);
 #endif
 
 /*****************************----end code----*****************************/
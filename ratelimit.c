@@ -0,0 +1,254 @@
+/* ratelimit.c : token buckets for commands, per user and per channel */
+/*
+ * every command costs a token from the bucket of the nick!user@host that
+ * sent it, and from the channel's bucket if it was said in a channel.
+ * buckets fill at a steady rate up to a burst size. they are only brought
+ * up to date when they are used, so idle buckets cost nothing.
+ *
+ * buckets are found by a keyed hash of the name alone, the names are not
+ * kept. two names that share a 32-bit hash share a bucket, which only makes
+ * the limit a bit tighter for them. a bucket that has filled back up is the
+ * same as a new one, so those are dropped when the table gets crowded.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bot.h"
+#include "command.h"
+#include "debug.h"
+#include "monotime.h"
+#include "notify.h"
+#include "ratelimit.h"
+#include "rc.h"
+#include "strhash.h"
+
+#define MIN_SLOTS 256 /* power of 2 */
+#define MAX_SLOTS 65536 /* past this the table is emptied instead of grown */
+#define WHO_MAX 256 /* longest nick!user@host that is hashed whole */
+
+#define KIND_BIT 0x80000000u /* set in the hash of channel buckets */
+
+struct bucket {
+	unsigned hash; /* 0 for an empty slot */
+	float tokens;
+	unsigned long long last_ns; /* when tokens was last brought up to date */
+};
+
+/* a rate and burst for one kind of bucket. rate 0 turns it off */
+struct limit {
+	double rate; /* tokens per second */
+	double burst;
+};
+
+static struct limit user_limit={ 6/60., 5 };
+static struct limit channel_limit={ 20/60., 10 };
+
+#define LIMIT_OF(b) (((b)->hash&KIND_BIT) ? &channel_limit : &user_limit)
+
+static struct bucket *slots;
+static unsigned nr_slots, nr_used;
+
+static unsigned long nr_allowed, nr_user_rejects, nr_channel_rejects;
+
+/** tokens in b after refilling it up to now */
+static double refill(const struct bucket *b, const struct limit *lim, unsigned long long now)
+{
+	double tokens=b->tokens + (now-b->last_ns)/1e9*lim->rate;
+	return tokens>lim->burst ? lim->burst : tokens;
+}
+
+/** put a bucket into a table known to have room */
+static void place(struct bucket *table, unsigned size, const struct bucket *b)
+{
+	unsigned i;
+
+	for(i=b->hash&(size-1);table[i].hash;i=(i+1)&(size-1)) ;
+	table[i]=*b;
+}
+
+/** is b in use and not yet full */
+static int is_busy(const struct bucket *b, unsigned long long now)
+{
+	return b->hash && refill(b, LIMIT_OF(b), now)<LIMIT_OF(b)->burst;
+}
+
+/** drop full buckets, and grow the table if it is still crowded.
+ * return 0 if there was no memory */
+static int make_room(unsigned long long now)
+{
+	struct bucket *old=slots, *table;
+	unsigned old_size=nr_slots, size, i, kept=0;
+
+	for(i=0;i<old_size;i++) {
+		if(is_busy(&old[i], now)) kept++;
+	}
+
+	size=old_size ? old_size : MIN_SLOTS;
+	while(kept*2>=size && size<MAX_SLOTS) size*=2;
+	if(kept*2>=size) {
+		ERROR("ratelimit: table full, forgetting every bucket\n");
+		kept=0;
+		old_size=0;
+	}
+
+	table=calloc(size, sizeof *table);
+	if(!table) {
+		perror("calloc()");
+		return 0;
+	}
+	for(i=0;i<old_size;i++) {
+		if(is_busy(&old[i], now)) {
+			place(table, size, &old[i]);
+		}
+	}
+	free(old);
+	slots=table;
+	nr_slots=size;
+	nr_used=kept;
+	return 1;
+}
+
+/** find or make the bucket for key. a new bucket starts full.
+ * return NULL if there was no memory */
+static struct bucket *get_bucket(const char *key, int is_channel, unsigned long long now)
+{
+	struct bucket b;
+	unsigned h, i;
+
+	/* IRC names are case insensitive, and chosen by whoever is on the
+	 * other end, so use the keyed hash */
+	h=strcasesiphash(key)&~KIND_BIT;
+	if(is_channel) h|=KIND_BIT;
+	if(!h) h=1; /* 0 marks empty slots */
+
+	if(nr_slots) {
+		for(i=h&(nr_slots-1);slots[i].hash;i=(i+1)&(nr_slots-1)) {
+			if(slots[i].hash==h) return &slots[i];
+		}
+	}
+	/* keep the table at most 3/4 full */
+	if((nr_used+1)*4>nr_slots*3 && !make_room(now)) {
+		return NULL;
+	}
+	b.hash=h;
+	b.tokens=LIMIT_OF(&b)->burst;
+	b.last_ns=now;
+	place(slots, nr_slots, &b);
+	nr_used++;
+	for(i=h&(nr_slots-1);slots[i].hash!=h;i=(i+1)&(nr_slots-1)) ;
+	return &slots[i];
+}
+
+/* charge a command to who (nick!user@host) and to channel, which may be NULL.
+ * if either is out of tokens nothing is charged.
+ * returns 1 if the command may run */
+int ratelimit_allow(const char *who, const char *channel)
+{
+	unsigned long long now=now_ns();
+	struct bucket *user=NULL, *chan=NULL;
+	double user_tokens=0, chan_tokens=0;
+
+	assert(who!=NULL);
+
+	if(user_limit.rate>0) {
+		user=get_bucket(who, 0, now);
+		if(user) {
+			user_tokens=refill(user, &user_limit, now);
+			if(user_tokens<1) {
+				nr_user_rejects++;
+				return 0;
+			}
+		}
+	}
+	/* looking the channel up may move the user's bucket */
+	if(channel && channel_limit.rate>0) {
+		chan=get_bucket(channel, 1, now);
+		if(chan) {
+			chan_tokens=refill(chan, &channel_limit, now);
+			if(chan_tokens<1) {
+				nr_channel_rejects++;
+				return 0;
+			}
+			chan->tokens=chan_tokens-1;
+			chan->last_ns=now;
+		}
+		if(user) user=get_bucket(who, 0, now);
+	}
+	if(user) {
+		user->tokens=user_tokens-1;
+		user->last_ns=now;
+	}
+	nr_allowed++;
+	return 1;
+}
+
+/* drop commands from anyone who is over their limit, before the command
+ * handler is queued */
+static int rl_filter(void *p, struct message *msg)
+{
+	char who[WHO_MAX];
+	const char *channel;
+
+	(void)p;
+	if(!msg || !msg_arg(msg, 1)[0]) return NOTIFY_CONTINUE;
+	/* only commands and CTCPs cost anything */
+	if(msg_arg(msg, 1)[0]!=1 && !command_find(msg_arg(msg, 1))) return NOTIFY_CONTINUE;
+
+	snprintf(who, sizeof who, "%s!%s@%s", msg_nick(msg), msg_user(msg), msg_host(msg));
+	channel=(msg_to(msg)[0]=='#' || msg_to(msg)[0]=='&') ? msg_to(msg) : NULL;
+	if(ratelimit_allow(who, channel)) return NOTIFY_CONTINUE;
+
+	if(verbose>0) {
+		INFO("ratelimit: dropped %s from %s in %s\n", msg_arg(msg, 1), who, channel ? channel : "private");
+	}
+	return NOTIFY_CONSUMED;
+}
+
+void ratelimit_stats(char *dest, size_t max)
+{
+	snprintf(dest, max, "ratelimit: %lu allowed, %lu rejected by user, %lu rejected by channel, %u buckets in %u slots",
+		nr_allowed, nr_user_rejects, nr_channel_rejects, nr_used, nr_slots);
+}
+
+/** read a per minute rate and a burst */
+static void load_limit(struct config_node *curr, const char *kind, struct limit *lim)
+{
+	struct config_node *item;
+	char name[32];
+	int n;
+
+	snprintf(name, sizeof name, "%s_rate", kind);
+	item=config_find(curr, name);
+	if(item && config_get_int(item, &n)) {
+		lim->rate=n>0 ? n/60. : 0;
+	}
+	snprintf(name, sizeof name, "%s_burst", kind);
+	item=config_find(curr, name);
+	if(item && config_get_int(item, &n)) {
+		lim->burst=n>1 ? n : 1;
+	}
+	if(verbose>0) {
+		INFO("ratelimit: %s %g a minute, burst %g\n", kind, lim->rate*60, lim->burst);
+	}
+}
+
+/* the ratelimit section of bot.cfg is optional, the defaults are used for
+ * anything missing */
+int ratelimit_init(struct config_node *config_root)
+{
+	struct config_node *config_curr;
+
+	config_curr=config_find(config_root, "ratelimit");
+	if(config_curr && config_curr->child) {
+		config_curr=config_curr->child;
+		load_limit(config_curr, "user", &user_limit);
+		load_limit(config_curr, "channel", &channel_limit);
+	}
+
+	return notify_register("PRIVMSG", "ratelimit", rl_filter, 0, NOTIFY_PRIO_FILTER, 0);
+}
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
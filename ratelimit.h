@@ -0,0 +1,11 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+#include <stddef.h>
+struct config_node;
+int ratelimit_init(struct config_node *config_root);
+int ratelimit_allow(const char *who, const char *channel);
+void ratelimit_stats(char *dest, size_t max);
+#endif
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
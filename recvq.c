@@ -0,0 +1,108 @@
+/* recvq.c : splits what the server sends into lines */
+/*
+ * process_in() used to copy the socket's bytes one at a time into a line
+ * buffer the size of one message, clearing all of it after every line, and
+ * a line that didn't fit ran into the next one.
+ *
+ * now each recv() fills as much of a larger buffer as is free, memchr()
+ * finds the line ends, and every complete line is handed over where it
+ * lies, its "\r\n" replaced by a terminator. only a partial line left at the
+ * end is moved to the front, so there is room for the rest of it.
+ *
+ * a line longer than MAXDATASIZE can't be parsed safely, so it is dropped
+ * and counted, up to the next line end even if that comes in a later read.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "bot.h"
+#include "debug.h"
+#include "recvq.h"
+
+#define IN_SIZE 16384 /* many lines a read */
+#define IN_LINE_MAX (MAXDATASIZE-1) /* longest line handed on, without "\r\n" */
+
+static char in[IN_SIZE+1]; /* +1 so a full buffer can still be terminated */
+static size_t in_start, in_end; /* the bytes not yet handed on */
+static int skipping; /* dropping the rest of a line that was too long */
+
+static unsigned long nr_reads, nr_lines, nr_long, nr_moved;
+static unsigned long long nr_bytes;
+
+/* forget any partial line, for a new connection */
+void recvq_reset(void)
+{
+	in_start=in_end=0;
+	skipping=0;
+}
+
+/* read what the socket has and call line() for each complete line in it.
+ * line() may change the text, but not keep it.
+ * returns 0 if the connection was closed or failed */
+int recvq_read(int fd, void (*line)(char *text))
+{
+	char *start, *nl;
+	ssize_t res;
+	size_t len;
+
+	assert(line!=NULL);
+	if(in_start) {
+		/* make room after a partial line */
+		memmove(in, in+in_start, in_end-in_start);
+		in_end-=in_start;
+		in_start=0;
+		if(in_end) nr_moved++;
+	}
+	res=recv(fd, in+in_end, IN_SIZE-in_end, 0);
+	if(res<0) {
+		if(errno==EINTR || errno==EAGAIN || errno==EWOULDBLOCK) return 1;
+		perror("recv");
+		return 0;
+	}
+	if(!res) return 0; /* closed */
+	nr_reads++;
+	nr_bytes+=res;
+	in_end+=res;
+
+	while((nl=memchr(in+in_start, '\n', in_end-in_start))) {
+		start=in+in_start;
+		len=nl-start;
+		in_start+=len+1;
+		if(skipping) {
+			skipping=0;
+			continue;
+		}
+		*nl=0;
+		if(len && start[len-1]=='\r') start[--len]=0;
+		if(len>IN_LINE_MAX) {
+			nr_long++;
+			ERROR("recvq: dropped a line of %zu bytes\n", len);
+			continue;
+		}
+		nr_lines++;
+		line(start);
+	}
+
+	if(skipping || in_start==in_end) {
+		in_start=in_end=0;
+	} else if(in_end-in_start>IN_LINE_MAX+1) {
+		/* no line end in sight, and it is already too long */
+		nr_long++;
+		ERROR("recvq: dropped a line of more than %zu bytes\n", in_end-in_start);
+		in_start=in_end=0;
+		skipping=1;
+	}
+	return 1;
+}
+
+void recvq_stats(char *dest, size_t max)
+{
+	snprintf(dest, max, "recvq: %lu lines in %lu reads of %llu bytes, %lu partial lines moved, %lu too long, %zu bytes waiting",
+		nr_lines, nr_reads, nr_bytes, nr_moved, nr_long, in_end-in_start);
+}
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
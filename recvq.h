@@ -0,0 +1,10 @@
+#ifndef RECVQ_H
+#define RECVQ_H
+#include <stddef.h>
+void recvq_reset(void);
+int recvq_read(int fd, void (*line)(char *text));
+void recvq_stats(char *dest, size_t max);
+#endif
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
@@ -0,0 +1,584 @@
+/* sendq.c : lines waiting to go to the server, paced like the server counts */
+/*
+ * send_irc_message() used to sleep for a second after every line, which
+ * stopped the bot from reading, answering PINGs or running timers while a
+ * reply went out. now lines are put on a queue and main_loop() writes them
+ * when the socket is writable and the pacer allows.
+ *
+ * a line the pacer lets out is framed with "\r\n" into an output ring, and
+ * the ring is written with one sendmsg() of up to two pieces, so a burst of
+ * lines costs one system call instead of one or two each. the socket is
+ * never blocked on. a short write leaves the rest in the ring for the next
+ * time the socket is writable.
+ *
+ * the pacer copies the flood rules ircds use. every line adds a penalty of a
+ * fixed cost plus a cost for each byte, and the penalty wears off in real
+ * time. a line may go as long as the penalty stays inside the budget, past
+ * that the server would start holding our lines back and, a little later,
+ * drop us for "Excess Flood". a few short lines go out at once, long ones
+ * are spread out more than short ones.
+ *
+ * servers don't all count the same way, so while lines are going out the
+ * pacer sends its own PINGs now and then. the PONG takes longer than usual
+ * when the server has our lines waiting, and then every cost is scaled up
+ * and the wait is added to the penalty. when the lag goes back to normal
+ * the scale comes back down.
+ *
+ * which line goes next is fair between destinations. PRIVMSGs and NOTICEs
+ * are queued per nick or channel and the queues take turns by deficit
+ * round robin, so a long lsusers for one person doesn't hold up a calc for
+ * another channel. lines the connection depends on, like PONG, NICK and
+ * MODE, skip the turns and go first.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "bot.h"
+#include "debug.h"
+#include "monotime.h"
+#include "notify.h"
+#include "rc.h"
+#include "sendq.h"
+#include "strhash.h"
+
+#define SENDQ_MAX 1024 /* lines queued before new ones are dropped */
+#define TARGET_LINES_MAX 256 /* the most one target may have queued */
+#define TARGET_BUCKETS 64
+#define TARGET_MAX 128
+#define OUT_SIZE 8192 /* output ring, a power of 2 */
+#define QUANTUM 64 /* bytes a target may send each time round, a line or two */
+#define PROBE_MS 10000 /* between lag probes, while there is something to send */
+#define PROBE_TIMEOUT_MS 60000 /* a probe without an answer is forgotten */
+#define PROBE_TOKEN "sendq"
+#define LAG_SLACK_MS 500 /* lag over the least seen that means we are held back */
+#define SCALE_MAX 4.
+
+struct line {
+	struct line *next;
+	size_t len; /* without the line ending */
+	char text[];
+};
+
+/* the lines for one PRIVMSG or NOTICE destination. anything else that
+ * isn't urgent shares the target with the empty name */
+struct target {
+	char name[TARGET_MAX];
+	struct line *head, **tail;
+	unsigned nr_lines;
+	size_t deficit; /* bytes it may still send this turn */
+	int has_turn; /* deficit was topped up for this turn */
+	struct target *next; /* in the bucket */
+	struct target *next_active; /* in the round */
+};
+
+static int fd=-1;
+static unsigned nr_lines, max_lines;
+
+/* PONG, NICK, MODE and the like skip the round and go first */
+static struct line *urgent, **urgent_tail=&urgent;
+
+static struct target *buckets[TARGET_BUCKETS];
+static struct target *active, **active_tail=&active; /* targets with lines */
+static unsigned nr_targets;
+
+/* the next line to go in the ring, and where it came from (NULL for urgent) */
+static struct line *cur;
+static struct target *cur_target;
+
+/* lines framed and paid for, waiting for the socket. head and tail only
+ * ever go up, they are taken modulo OUT_SIZE */
+static char out[OUT_SIZE];
+static unsigned out_head, out_tail;
+
+/* the flood model, all in milliseconds */
+static double line_ms=800; /* every line costs this */
+static double byte_ms=1000/200.; /* and this for each byte */
+static double budget_ms=5000; /* the most penalty allowed */
+static double penalty; /* how far the server's count is ahead of now */
+static double scale=1; /* costs are multiplied by this while the server lags */
+static unsigned long long last_ns; /* when penalty was last brought up to date */
+
+/* lag probes */
+static struct line *probe_line; /* queued, not yet written */
+static unsigned probe_seq;
+static unsigned long long probe_ns; /* when the outstanding probe went, 0 if none */
+static unsigned long long last_probe_ns;
+static double lag_ms=-1, least_lag_ms=-1; /* -1 until measured */
+
+static unsigned long nr_sent, nr_urgent, nr_dropped, nr_paced, nr_probes, nr_lagged;
+static unsigned long nr_writes, nr_short;
+static unsigned long long nr_bytes;
+
+/** wear the penalty down by the time that has passed */
+static void settle(unsigned long long now)
+{
+	penalty-=(now-last_ns)/1e6;
+	if(penalty<0) penalty=0;
+	last_ns=now;
+}
+
+static double cost_of(const struct line *l)
+{
+	return (line_ms+byte_ms*(l->len+2))*scale;
+}
+
+static struct target **bucket_of(const char *name)
+{
+	return &buckets[name_bucket(name, TARGET_BUCKETS)];
+}
+
+/** find or make the queue for name, and put it in the round if it is new.
+ * returns NULL if there was no memory */
+static struct target *get_target(const char *name)
+{
+	struct target *t, **b;
+
+	b=bucket_of(name);
+	for(t=*b;t;t=t->next) {
+		if(!strcasecmp(t->name, name)) return t;
+	}
+	t=calloc(1, sizeof *t);
+	if(!t) {
+		perror("calloc()");
+		return 0;
+	}
+	snprintf(t->name, sizeof t->name, "%s", name);
+	t->tail=&t->head;
+	t->next=*b;
+	*b=t;
+	*active_tail=t;
+	active_tail=&t->next_active;
+	nr_targets++;
+	return t;
+}
+
+/** take the target at the front of the round out of it, and free it if it
+ * has nothing left */
+static void end_turn(void)
+{
+	struct target *t=active, **prev;
+
+	active=t->next_active;
+	if(!active) active_tail=&active;
+	t->next_active=0;
+	t->has_turn=0;
+	if(t->head) {
+		*active_tail=t;
+		active_tail=&t->next_active;
+		return;
+	}
+	for(prev=bucket_of(t->name);*prev!=t;prev=&(*prev)->next) ;
+	*prev=t->next;
+	free(t);
+	nr_targets--;
+}
+
+/** where a line goes: the PRIVMSG or NOTICE destination, or "" for other
+ * lines. returns 1 if it is urgent instead */
+static int classify(const char *text, char *name, size_t max)
+{
+	static const char *const urgent_cmds[] = {
+		"PONG", "PING", "NICK", "MODE", "QUIT", "USER", "PASS",
+	};
+	size_t len;
+	unsigned i;
+
+	name[0]=0;
+	text+=strspn(text, " ");
+	len=strcspn(text, " ");
+	for(i=0;i<sizeof urgent_cmds/sizeof *urgent_cmds;i++) {
+		if(len==strlen(urgent_cmds[i]) && !strncasecmp(text, urgent_cmds[i], len)) return 1;
+	}
+	if((len==7 && !strncasecmp(text, "PRIVMSG", 7)) || (len==6 && !strncasecmp(text, "NOTICE", 6))) {
+		text+=len;
+		text+=strspn(text, " ");
+		len=strcspn(text, " ");
+		if(len<max) {
+			memcpy(name, text, len);
+			name[len]=0;
+		}
+	}
+	return 0;
+}
+
+static void free_list(struct line *l)
+{
+	struct line *next;
+
+	for(;l;l=next) {
+		next=l->next;
+		free(l);
+	}
+}
+
+static void free_lines(void)
+{
+	struct target *t;
+	unsigned i;
+
+	free_list(urgent);
+	urgent=0;
+	urgent_tail=&urgent;
+	for(i=0;i<TARGET_BUCKETS;i++) {
+		while((t=buckets[i])) {
+			buckets[i]=t->next;
+			free_list(t->head);
+			free(t);
+		}
+	}
+	active=0;
+	active_tail=&active;
+	nr_targets=0;
+	nr_lines=0;
+	cur=0;
+	cur_target=0;
+	out_head=out_tail=0;
+	probe_line=0;
+}
+
+/* start over on a new connection. anything still queued for the old one
+ * is thrown away */
+void sendq_reset(int new_fd)
+{
+	free_lines();
+	fd=new_fd;
+	penalty=0;
+	scale=1;
+	probe_ns=0;
+	last_probe_ns=last_ns=now_ns();
+	lag_ms=least_lag_ms=-1;
+}
+
+/* queue a line, without its line ending. anything after a CR or LF in it
+ * is cut off, one call is one line.
+ * returns 0 if the queue is full or there was no memory */
+int sendq_push(const char *text)
+{
+	char name[TARGET_MAX];
+	struct target *t=0;
+	struct line *l;
+	size_t len;
+	int is_urgent;
+
+	assert(text!=NULL);
+	if(nr_lines>=SENDQ_MAX) goto full;
+	len=strcspn(text, "\r\n");
+	if(len>OUT_SIZE-2) len=OUT_SIZE-2;
+	l=malloc(sizeof *l + len + 1);
+	if(!l) {
+		perror("malloc()");
+		nr_dropped++;
+		return 0;
+	}
+	is_urgent=classify(text, name, sizeof name);
+	if(!is_urgent) {
+		t=get_target(name);
+		if(!t || t->nr_lines>=TARGET_LINES_MAX) {
+			free(l);
+			if(!t) {
+				nr_dropped++;
+				return 0;
+			}
+			goto full;
+		}
+	}
+	memcpy(l->text, text, len);
+	l->text[len]=0;
+	l->len=len;
+	l->next=0;
+	if(is_urgent) {
+		*urgent_tail=l;
+		urgent_tail=&l->next;
+	} else {
+		*t->tail=l;
+		t->tail=&l->next;
+		t->nr_lines++;
+	}
+	if(++nr_lines>max_lines) max_lines=nr_lines;
+	return 1;
+full:
+	nr_dropped++;
+	ERROR("sendq: queue full, dropping: %s\n", text);
+	return 0;
+}
+
+/** pick the next line to write: urgent ones first, then deficit round robin
+ * over the targets, so one long reply can't hold up everyone else */
+static void pick_line(void)
+{
+	struct target *t;
+
+	if(cur && cur_target && urgent) {
+		/* an urgent line came in while this one waited on the pacer */
+		cur_target->deficit+=cur->len;
+		cur=0;
+	}
+	if(cur) return;
+	if(urgent) {
+		cur=urgent;
+		cur_target=0;
+		return;
+	}
+	while((t=active)) {
+		if(!t->has_turn) {
+			t->deficit+=QUANTUM;
+			t->has_turn=1;
+		}
+		if(t->head->len<=t->deficit) {
+			t->deficit-=t->head->len;
+			cur=t->head;
+			cur_target=t;
+			return;
+		}
+		end_turn();
+	}
+}
+
+/** cur is in the ring, take it off its queue */
+static void line_done(void)
+{
+	struct target *t=cur_target;
+
+	if(!t) {
+		urgent=cur->next;
+		if(!urgent) urgent_tail=&urgent;
+		nr_urgent++;
+		if(cur==probe_line) {
+			probe_line=0;
+			probe_ns=now_ns();
+		}
+	} else {
+		t->head=cur->next;
+		if(!t->head) t->tail=&t->head;
+		t->nr_lines--;
+		/* its turn is over once it runs out of lines or of deficit */
+		if(!t->head) {
+			t->deficit=0;
+			end_turn();
+		} else if(t->head->len>t->deficit) {
+			end_turn();
+		}
+	}
+	free(cur);
+	cur=0;
+	cur_target=0;
+	nr_lines--;
+	nr_sent++;
+}
+
+/** copy l into the ring with its line ending. the caller made sure there
+ * is room */
+static void frame(const struct line *l)
+{
+	static const char crlf[2]={ '\r', '\n' };
+	unsigned tail=out_tail%OUT_SIZE, n;
+
+	n=l->len<OUT_SIZE-tail ? l->len : OUT_SIZE-tail;
+	memcpy(out+tail, l->text, n);
+	memcpy(out, l->text+n, l->len-n);
+	out_tail+=l->len;
+	tail=out_tail%OUT_SIZE;
+	out[tail]=crlf[0];
+	out[(tail+1)%OUT_SIZE]=crlf[1];
+	out_tail+=2;
+}
+
+/** queue a PING to measure the lag, if one is due */
+static void probe(unsigned long long now)
+{
+	char text[32];
+
+	if(probe_ns && now-probe_ns>PROBE_TIMEOUT_MS*1000000ULL) {
+		probe_ns=0; /* lost, or the server doesn't answer */
+	}
+	if(probe_line || probe_ns || now-last_probe_ns<PROBE_MS*1000000ULL) return;
+	snprintf(text, sizeof text, "PING :" PROBE_TOKEN "%u", ++probe_seq);
+	if(!sendq_push(text)) return;
+	for(probe_line=urgent;probe_line->next;probe_line=probe_line->next) ;
+	last_probe_ns=now;
+	nr_probes++;
+}
+
+/** the answer to a probe. the server answers in turn with the lines it got
+ * before the PING, so lag over the least seen is time our lines waited */
+static int got_pong(void *p, struct message *msg)
+{
+	unsigned long long now=now_ns();
+	double held;
+	char *end;
+
+	(void)p;
+	if(strncmp(msg_text(msg), PROBE_TOKEN, strlen(PROBE_TOKEN))) return NOTIFY_CONTINUE;
+	if(strtoul(msg_text(msg)+strlen(PROBE_TOKEN), &end, 10)!=probe_seq || *end || !probe_ns) {
+		return NOTIFY_CONSUMED; /* an old one */
+	}
+	lag_ms=(now-probe_ns)/1e6;
+	probe_ns=0;
+	if(least_lag_ms<0 || lag_ms<least_lag_ms) least_lag_ms=lag_ms;
+	held=lag_ms-least_lag_ms;
+	settle(now);
+	if(held>LAG_SLACK_MS) {
+		/* our idea of the server's count is too low */
+		nr_lagged++;
+		scale*=1.5;
+		if(scale>SCALE_MAX) scale=SCALE_MAX;
+		if(penalty<held) penalty=held;
+		INFO("sendq: lag %.0f ms, costs now x%.2f\n", lag_ms, scale);
+	} else if(scale>1) {
+		scale*=.9;
+		if(scale<1) scale=1;
+	}
+	return NOTIFY_CONSUMED;
+}
+
+/* how long main_loop() may sleep before the pacer lets the next line out.
+ * returns -1 if nothing is waiting, and 0 if a line may go as soon as the
+ * socket is writable */
+long sendq_wait_ms(void)
+{
+	double over;
+
+	if(fd<0) return -1;
+	/* what is in the ring has already paid */
+	if(out_tail!=out_head) return 0;
+	if(!nr_lines) return -1;
+	pick_line();
+	settle(now_ns());
+	over=penalty+cost_of(cur)-budget_ms;
+	/* a line costing more than the whole budget goes when the count is 0 */
+	if(over<=0 || penalty<=0) return 0;
+	return (long)(over<penalty ? over : penalty)+1;
+}
+
+/* write what the pacer allows, without blocking. call when the socket is
+ * writable.
+ * returns 0 if the connection failed */
+int sendq_flush(void)
+{
+	unsigned long long now;
+	struct iovec iov[2];
+	struct msghdr mh;
+	unsigned head, len;
+	ssize_t res;
+	double cost;
+
+	if(fd<0) return 1;
+	now=now_ns();
+	settle(now);
+	if(nr_lines) probe(now);
+	for(;;) {
+		while(nr_lines) {
+			pick_line();
+			if(cur->len+2>OUT_SIZE-(out_tail-out_head)) break; /* no room */
+			cost=cost_of(cur);
+			if(penalty>0 && penalty+cost>budget_ms) {
+				nr_paced++;
+				break;
+			}
+			penalty+=cost;
+			frame(cur);
+			line_done();
+		}
+		len=out_tail-out_head;
+		if(!len) break;
+
+		/* the ring's bytes are in at most two pieces */
+		memset(&mh, 0, sizeof mh);
+		head=out_head%OUT_SIZE;
+		iov[0].iov_base=out+head;
+		iov[0].iov_len=len<OUT_SIZE-head ? len : OUT_SIZE-head;
+		iov[1].iov_base=out;
+		iov[1].iov_len=len-iov[0].iov_len;
+		mh.msg_iov=iov;
+		mh.msg_iovlen=iov[1].iov_len ? 2 : 1;
+		res=sendmsg(fd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL);
+		if(res<0) {
+			if(errno==EINTR) continue;
+			if(errno==EAGAIN || errno==EWOULDBLOCK) break;
+			perror("sendmsg");
+			return 0;
+		}
+		nr_writes++;
+		nr_bytes+=res;
+		out_head+=res;
+		if((unsigned)res<len) {
+			nr_short++;
+			break; /* the socket buffer is full */
+		}
+	}
+	return 1;
+}
+
+/* keep writing until the queue is empty or timeout_ms has passed, for the
+ * few places that need an answer from the server before going on.
+ * returns 0 if the connection failed */
+int sendq_drain(long timeout_ms)
+{
+	unsigned long long now, end=now_ns()+timeout_ms*1000000ULL;
+	struct timeval tv;
+	fd_set wfds;
+	long ms, wait;
+
+	while((ms=sendq_wait_ms())>=0 && (now=now_ns())<end) {
+		FD_ZERO(&wfds);
+		FD_SET(fd, &wfds);
+		/* sleep for the pacer, or wait for room in the socket until end */
+		wait=ms ? ms : (long)((end-now+999999)/1000000);
+		tv.tv_sec=wait/1000;
+		tv.tv_usec=wait%1000*1000;
+		if(select(fd+1, 0, ms ? 0 : &wfds, 0, &tv)<0 && errno!=EINTR) {
+			perror("select");
+			return 0;
+		}
+		if(!sendq_flush()) return 0;
+	}
+	return 1;
+}
+
+void sendq_stats(char *dest, size_t max)
+{
+	settle(now_ns());
+	snprintf(dest, max, "sendq: %u lines queued for %u targets (most %u), %lu sent (%lu urgent) in %lu writes of %llu bytes (%lu short), %lu waits for the pacer, %lu dropped, penalty %.0f of %.0f ms, costs x%.2f, lag %.0f ms (least %.0f) over %lu probes, %lu lagged",
+		nr_lines, nr_targets, max_lines, nr_sent, nr_urgent, nr_writes, nr_bytes, nr_short, nr_paced, nr_dropped, penalty, budget_ms, scale, lag_ms, least_lag_ms, nr_probes, nr_lagged);
+}
+
+/* the sendq section of bot.cfg is optional */
+int sendq_init(struct config_node *config_root)
+{
+	struct config_node *config_curr, *item;
+	int n;
+
+	config_curr=config_find(config_root, "sendq");
+	if(config_curr && config_curr->child) {
+		config_curr=config_curr->child;
+		item=config_find(config_curr, "line_ms");
+		if(item && config_get_int(item, &n)) {
+			line_ms=n>0 ? n : 0;
+		}
+		item=config_find(config_curr, "bytes_per_sec");
+		if(item && config_get_int(item, &n)) {
+			byte_ms=n>0 ? 1000./n : 0;
+		}
+		item=config_find(config_curr, "budget_ms");
+		if(item && config_get_int(item, &n)) {
+			budget_ms=n>0 ? n : 0;
+		}
+	}
+	if(line_ms<=0 && byte_ms<=0) {
+		ERROR("sendq: lines must cost something\n");
+		return 0;
+	}
+	INFO("sendq: %g ms a line and %g a byte, budget %g ms\n", line_ms, byte_ms, budget_ms);
+	last_ns=now_ns();
+	return notify_register("PONG", "sendq_pong", got_pong, 0, NOTIFY_PRIO_FILTER, 0);
+}
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
@@ -0,0 +1,15 @@
+#ifndef SENDQ_H
+#define SENDQ_H
+#include <stddef.h>
+struct config_node;
+int sendq_init(struct config_node *config_root);
+void sendq_reset(int fd);
+int sendq_push(const char *text);
+long sendq_wait_ms(void);
+int sendq_flush(void);
+int sendq_drain(long timeout_ms);
+void sendq_stats(char *dest, size_t max);
+#endif
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
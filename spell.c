@@ -0,0 +1,584 @@
+/* spell.c : spell checker over dict.udb
+ * words are checked against the dictionary with udb. suggestions come from
+ * a symmetric delete index: every dictionary word is stored under all of the
+ * strings you get by deleting up to MAX_DISTANCE letters from its prefix.
+ * a misspelling finds its candidates by generating its own deletes and
+ * looking those up, so no edit candidates have to be generated by insertion
+ * or substitution. the index is built the first time a word is misspelled,
+ * and cached next to the dictionary so later starts can just read it.
+ * spell_result() runs on the worker pool, so building the index only holds
+ * up other spell checks. everything below is used under spell_lock.
+ */
+#include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "spell.h"
+#include "strhash.h"
+#include "udb.h"
+
+#define NR(x) (sizeof(x)/sizeof*(x))
+
+#define SPELL_DB "dict.udb"
+#define SPELL_CACHE "dict.udb.spell"
+#define SPELL_MAGIC "SPELLIX1"
+#define MAX_DISTANCE 2 /* largest edit distance we suggest */
+#define PREFIX_LEN 7 /* only deletes of the first letters are indexed */
+#define WORD_MAX 64 /* longest word we check */
+#define MAX_WORDS 32 /* words checked per message */
+#define MAX_SUGGEST 3 /* suggestions given per word */
+#define MAX_RESULTS 64 /* distinct candidates kept while ranking */
+
+struct spell_del {
+	uint32_t hash; /* strhash() of the deleted prefix. not the keyed hash,
+	                * it is saved in the cache and the array is binary
+	                * searched, so there are no chains to flood */
+	uint32_t word; /* index into word_ofs */
+};
+
+/* the cache file is this header followed by word_ofs, pool and dels. it is
+ * written in native byte order, it is not meant to be copied around */
+struct cache_header {
+	char magic[8];
+	uint32_t hash_check; /* strhash(SPELL_MAGIC), a changed hash function invalidates the file */
+	uint32_t nr_words, pool_len, nr_dels;
+	int64_t src_size, src_mtime; /* stat of dict.udb the index was built from */
+};
+
+struct spell_index {
+	int loaded;
+	unsigned generation; /* dictionary generation this was built from */
+	uint32_t nr_words, pool_len, nr_dels;
+	uint32_t *word_ofs; /* start of each word in pool */
+	char *pool; /* null terminated words */
+	struct spell_del *dels; /* sorted by hash, then word */
+};
+
+struct suggestion {
+	uint32_t word;
+	int distance;
+	int swapped; /* only two neighbouring letters are swapped */
+};
+
+static pthread_mutex_t spell_lock=PTHREAD_MUTEX_INITIALIZER;
+static struct udb_handle *dict_h;
+static struct spell_index ix;
+static const char *spell_word; /* word being ranked by suggestion_cmp() */
+
+/** free the index */
+static void free_index(struct spell_index *x) {
+	free(x->word_ofs);
+	free(x->pool);
+	free(x->dels);
+	memset(x, 0, sizeof *x);
+}
+
+/** lower case copy of the first max-1 letters */
+static size_t lower_prefix(char *out, const char *in, size_t max) {
+	size_t i;
+
+	for(i=0;in[i] && i+1<max;i++) {
+		out[i]=tolower((unsigned char)in[i]);
+	}
+	out[i]=0;
+	return i;
+}
+
+/** call cb with the hash of s and of every string made by deleting up to
+ * depth letters from s. deleting positions in increasing order only,
+ * which visits each combination once. */
+static void each_delete(char *s, size_t len, size_t start, int depth, void (*cb)(void *p, uint32_t hash), void *p) {
+	char tmp[PREFIX_LEN+1];
+	size_t i;
+
+	if(!depth) return;
+
+	for(i=start;i<len;i++) {
+		memcpy(tmp, s, i);
+		memcpy(tmp+i, s+i+1, len-i); /* includes terminator */
+		cb(p, strhash(tmp));
+		each_delete(tmp, len-1, i, depth-1, cb, p);
+	}
+}
+
+/** hashes of word's prefix and all of its deletes */
+static void word_deletes(const char *word, void (*cb)(void *p, uint32_t hash), void *p) {
+	char prefix[PREFIX_LEN+1];
+	size_t len;
+
+	len=lower_prefix(prefix, word, sizeof prefix);
+	cb(p, strhash(prefix));
+	each_delete(prefix, len, 0, MAX_DISTANCE, cb, p);
+}
+
+/*** building the index ***/
+
+struct build_state {
+	struct spell_index *x;
+	uint32_t words_max, dels_max, pool_max;
+	uint32_t curr_word; /* word the deletes belong to */
+	int failed;
+};
+
+static int grow(void *pp, uint32_t *max, uint32_t need, size_t elem) {
+	void **p=pp;
+	void *tmp;
+	uint32_t newmax;
+
+	if(need<=*max) return 1;
+	newmax=*max?*max:1024;
+	while(newmax<need) newmax*=2;
+	tmp=realloc(*p, (size_t)newmax*elem);
+	if(!tmp) {
+		perror("realloc()");
+		return 0;
+	}
+	*p=tmp;
+	*max=newmax;
+	return 1;
+}
+
+static int add_word(void *p, const char *key) {
+	struct build_state *st=p;
+	struct spell_index *x=st->x;
+	size_t len;
+
+	len=strlen(key);
+	if(!len || len>=WORD_MAX) return 1; /* ignore - nobody can ask for it */
+
+	if(!grow(&x->word_ofs, &st->words_max, x->nr_words+1, sizeof *x->word_ofs)
+	|| !grow(&x->pool, &st->pool_max, x->pool_len+len+1, 1)) {
+		st->failed=1;
+		return 0; /* stop */
+	}
+	x->word_ofs[x->nr_words++]=x->pool_len;
+	memcpy(x->pool+x->pool_len, key, len+1);
+	x->pool_len+=len+1;
+	return 1;
+}
+
+static void add_delete(void *p, uint32_t hash) {
+	struct build_state *st=p;
+	struct spell_index *x=st->x;
+
+	if(st->failed) return;
+	if(!grow(&x->dels, &st->dels_max, x->nr_dels+1, sizeof *x->dels)) {
+		st->failed=1;
+		return;
+	}
+	x->dels[x->nr_dels].hash=hash;
+	x->dels[x->nr_dels].word=st->curr_word;
+	x->nr_dels++;
+}
+
+static int del_cmp(const void *a, const void *b) {
+	const struct spell_del *x=a, *y=b;
+	if(x->hash!=y->hash) return x->hash<y->hash ? -1 : 1;
+	return x->word<y->word ? -1 : x->word>y->word;
+}
+
+/** build the delete index from the dictionary in memory */
+static int build_index(struct spell_index *x) {
+	struct build_state st;
+	uint32_t i, j;
+
+	memset(x, 0, sizeof *x);
+	memset(&st, 0, sizeof st);
+	st.x=x;
+
+	udb_foreach(dict_h, add_word, &st);
+	for(i=0;i<x->nr_words && !st.failed;i++) {
+		st.curr_word=i;
+		word_deletes(x->pool+x->word_ofs[i], add_delete, &st);
+	}
+	if(st.failed) {
+		free_index(x);
+		return 0;
+	}
+
+	/* short prefixes delete into the same string more than once */
+	qsort(x->dels, x->nr_dels, sizeof *x->dels, del_cmp);
+	for(i=j=0;i<x->nr_dels;i++) {
+		if(j && !del_cmp(&x->dels[i], &x->dels[j-1])) continue;
+		x->dels[j++]=x->dels[i];
+	}
+	x->nr_dels=j;
+
+	fprintf(stderr, "spell: indexed %u words with %u deletes\n", x->nr_words, x->nr_dels);
+	return 1;
+}
+
+/*** cache file ***/
+
+static void fill_header(struct cache_header *hdr, const struct spell_index *x, const struct stat *st) {
+	memset(hdr, 0, sizeof *hdr);
+	memcpy(hdr->magic, SPELL_MAGIC, sizeof hdr->magic);
+	hdr->hash_check=strhash(SPELL_MAGIC);
+	if(x) {
+		hdr->nr_words=x->nr_words;
+		hdr->pool_len=x->pool_len;
+		hdr->nr_dels=x->nr_dels;
+	}
+	hdr->src_size=st->st_size;
+	hdr->src_mtime=st->st_mtime;
+}
+
+/** load the cached index if it was built from the current dictionary */
+static int load_cache(struct spell_index *x) {
+	struct cache_header hdr, want;
+	struct stat st;
+	FILE *f;
+
+	if(stat(SPELL_DB, &st)) {
+		return 0;
+	}
+	f=fopen(SPELL_CACHE, "rb");
+	if(!f) {
+		return 0; /* no cache yet */
+	}
+
+	fill_header(&want, 0, &st);
+	memset(x, 0, sizeof *x);
+	if(fread(&hdr, sizeof hdr, 1, f)!=1
+	|| memcmp(hdr.magic, want.magic, sizeof hdr.magic)
+	|| hdr.hash_check!=want.hash_check
+	|| hdr.src_size!=want.src_size
+	|| hdr.src_mtime!=want.src_mtime) {
+		fclose(f);
+		return 0; /* stale */
+	}
+
+	x->nr_words=hdr.nr_words;
+	x->pool_len=hdr.pool_len;
+	x->nr_dels=hdr.nr_dels;
+	x->word_ofs=malloc((size_t)x->nr_words*sizeof *x->word_ofs+1);
+	x->pool=malloc((size_t)x->pool_len+1);
+	x->dels=malloc((size_t)x->nr_dels*sizeof *x->dels+1);
+	if(!x->word_ofs || !x->pool || !x->dels
+	|| fread(x->word_ofs, sizeof *x->word_ofs, x->nr_words, f)!=x->nr_words
+	|| fread(x->pool, 1, x->pool_len, f)!=x->pool_len
+	|| fread(x->dels, sizeof *x->dels, x->nr_dels, f)!=x->nr_dels) {
+		fprintf(stderr, "spell: %s is damaged, rebuilding\n", SPELL_CACHE);
+		free_index(x);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	fprintf(stderr, "spell: loaded %u words from %s\n", x->nr_words, SPELL_CACHE);
+	return 1;
+}
+
+/** write the index out. failure is not fatal, we just rebuild next time */
+static void save_cache(const struct spell_index *x) {
+	struct cache_header hdr;
+	struct stat st;
+	FILE *f;
+
+	if(stat(SPELL_DB, &st)) {
+		perror(SPELL_DB);
+		return;
+	}
+	f=fopen(SPELL_CACHE ".tmp", "wb");
+	if(!f) {
+		perror(SPELL_CACHE ".tmp");
+		return;
+	}
+	fill_header(&hdr, x, &st);
+	if(fwrite(&hdr, sizeof hdr, 1, f)!=1
+	|| fwrite(x->word_ofs, sizeof *x->word_ofs, x->nr_words, f)!=x->nr_words
+	|| fwrite(x->pool, 1, x->pool_len, f)!=x->pool_len
+	|| fwrite(x->dels, sizeof *x->dels, x->nr_dels, f)!=x->nr_dels) {
+		perror(SPELL_CACHE ".tmp");
+		fclose(f);
+		remove(SPELL_CACHE ".tmp");
+		return;
+	}
+	if(fclose(f) || rename(SPELL_CACHE ".tmp", SPELL_CACHE)) {
+		perror(SPELL_CACHE);
+		remove(SPELL_CACHE ".tmp");
+	}
+}
+
+/** make sure the index matches the dictionary currently loaded */
+static int need_index(void) {
+	if(ix.loaded && ix.generation==udb_generation(dict_h)) {
+		return 1; /* up to date */
+	}
+	free_index(&ix);
+	if(!load_cache(&ix)) {
+		if(!build_index(&ix)) {
+			return 0;
+		}
+		save_cache(&ix);
+	}
+	ix.loaded=1;
+	ix.generation=udb_generation(dict_h);
+	return 1;
+}
+
+/*** suggestions ***/
+
+/** optimal string alignment distance, case insensitive.
+ * gives up and returns MAX_DISTANCE+1 once it can't be within range */
+static int distance(const char *a, size_t alen, const char *b, size_t blen) {
+	int rows[3][WORD_MAX+1];
+	int *prev2=rows[0], *prev=rows[1], *curr=rows[2], *tmp;
+	size_t i, j;
+
+	if(alen>=WORD_MAX || blen>=WORD_MAX) return MAX_DISTANCE+1;
+	if((alen>blen?alen-blen:blen-alen)>MAX_DISTANCE) return MAX_DISTANCE+1;
+
+	for(j=0;j<=blen;j++) prev[j]=j;
+	for(i=1;i<=alen;i++) {
+		int best;
+		curr[0]=best=i;
+		for(j=1;j<=blen;j++) {
+			int ca=tolower((unsigned char)a[i-1]), cb=tolower((unsigned char)b[j-1]);
+			int d=prev[j-1]+(ca!=cb);
+			if(prev[j]+1<d) d=prev[j]+1;
+			if(curr[j-1]+1<d) d=curr[j-1]+1;
+			if(i>1 && j>1 && ca==tolower((unsigned char)b[j-2]) && tolower((unsigned char)a[i-2])==cb && prev2[j-2]+1<d) {
+				d=prev2[j-2]+1; /* transposition */
+			}
+			curr[j]=d;
+			if(d<best) best=d;
+		}
+		if(best>MAX_DISTANCE) return MAX_DISTANCE+1;
+		tmp=prev2; prev2=prev; prev=curr; curr=tmp;
+	}
+	return prev[blen];
+}
+
+/** return non-zero if b is a with two neighbouring letters swapped */
+static int is_swap(const char *a, size_t alen, const char *b) {
+	size_t i;
+
+	if(strlen(b)!=alen) return 0;
+	for(i=0;i<alen && tolower((unsigned char)a[i])==tolower((unsigned char)b[i]);i++) ;
+	if(i+1>=alen) return 0;
+	if(tolower((unsigned char)a[i])!=tolower((unsigned char)b[i+1]) || tolower((unsigned char)a[i+1])!=tolower((unsigned char)b[i])) return 0;
+	return !strcasecmp(a+i+2, b+i+2);
+}
+
+static int suggestion_cmp(const void *a, const void *b) {
+	const struct suggestion *x=a, *y=b;
+	const char *xw=ix.pool+ix.word_ofs[x->word], *yw=ix.pool+ix.word_ofs[y->word];
+
+	if(x->distance!=y->distance) return x->distance-y->distance;
+	/* the commonest typo of all, "teh" is "the" before "tea" */
+	if(x->swapped!=y->swapped) return y->swapped-x->swapped;
+	/* people rarely get the first letter wrong */
+	if((*xw==*spell_word)!=(*yw==*spell_word)) return *xw==*spell_word ? -1 : 1;
+	/* lower case words before proper nouns */
+	if(!islower((unsigned char)*xw)!=!islower((unsigned char)*yw)) return islower((unsigned char)*xw) ? -1 : 1;
+	return strcmp(xw, yw);
+}
+
+struct candidate_state {
+	const char *word;
+	size_t len;
+	struct suggestion res[MAX_RESULTS];
+	unsigned nr_res;
+};
+
+/** verify every word stored under one delete hash */
+static void check_delete(void *p, uint32_t hash) {
+	struct candidate_state *cs=p;
+	size_t lo=0, hi=ix.nr_dels, mid;
+
+	/* lower bound of hash */
+	while(lo<hi) {
+		mid=lo+(hi-lo)/2;
+		if(ix.dels[mid].hash<hash) lo=mid+1; else hi=mid;
+	}
+
+	for(;lo<ix.nr_dels && ix.dels[lo].hash==hash;lo++) {
+		const char *cand=ix.pool+ix.word_ofs[ix.dels[lo].word];
+		struct suggestion s;
+		unsigned i, worst;
+		int d;
+
+		for(i=0;i<cs->nr_res;i++) {
+			if(cs->res[i].word==ix.dels[lo].word) break;
+		}
+		if(i<cs->nr_res) continue; /* already have it */
+
+		d=distance(cs->word, cs->len, cand, strlen(cand));
+		if(d>MAX_DISTANCE) continue;
+		s.word=ix.dels[lo].word;
+		s.distance=d;
+		s.swapped=d==1 && is_swap(cs->word, cs->len, cand);
+		if(cs->nr_res<NR(cs->res)) {
+			cs->res[cs->nr_res++]=s;
+			continue;
+		}
+		/* full. candidates come in delete order, not rank order, so a
+		 * better one replaces the worst kept so far */
+		for(worst=0,i=1;i<cs->nr_res;i++) {
+			if(suggestion_cmp(&cs->res[i], &cs->res[worst])>0) worst=i;
+		}
+		if(suggestion_cmp(&s, &cs->res[worst])<0) {
+			cs->res[worst]=s;
+		}
+	}
+}
+
+/** write up to MAX_SUGGEST corrections for word into dest */
+static void suggest(char *dest, size_t max, const char *word) {
+	struct candidate_state cs;
+	unsigned i;
+	size_t len;
+
+	cs.word=word;
+	cs.len=strlen(word);
+	cs.nr_res=0;
+	spell_word=word;
+	word_deletes(word, check_delete, &cs);
+
+	if(!cs.nr_res) {
+		snprintf(dest, max, "%s: ?", word);
+		return;
+	}
+	qsort(cs.res, cs.nr_res, sizeof *cs.res, suggestion_cmp);
+
+	len=snprintf(dest, max, "%s:", word);
+	for(i=0;i<cs.nr_res && i<MAX_SUGGEST && len<max;i++) {
+		len+=snprintf(dest+len, max-len, "%s %s", i?",":"", ix.pool+ix.word_ofs[cs.res[i].word]);
+	}
+}
+
+/*** public interface ***/
+
+int spell_init(void) {
+	if(dict_h) {
+		fprintf(stderr, "spell_init() already called\n");
+		return 0;
+	}
+	dict_h=udb_open(SPELL_DB, 0);
+	if(!dict_h) {
+		return 0;
+	}
+	udb_set_background(dict_h, 1);
+	udb_set_bloom(dict_h, 10);
+	return 1;
+}
+
+void spell_shutdown(void) {
+	free_index(&ix);
+	udb_close(dict_h);
+	dict_h=0;
+}
+
+/** check every word of in. the dictionary lookups for the whole message are
+ * done in a single batch; words are accepted as written, in lower case or
+ * capitalized. returns the number of misspelled words */
+static int check_words(char *dest, size_t max, const char *in) {
+	char words[MAX_WORDS][3][WORD_MAX]; /* as written, lower, Capitalized */
+	const char *keys[MAX_WORDS*3];
+	struct udb_batch *batch;
+	unsigned nr_words, i;
+	size_t len;
+	int bad;
+
+	/* split into words of letters and apostrophes */
+	for(nr_words=0;*in && nr_words<MAX_WORDS;) {
+		size_t n, j;
+
+		while(*in && !isalpha((unsigned char)*in)) in++;
+		for(n=0;isalpha((unsigned char)in[n]) || in[n]=='\'';n++) ;
+		while(n && in[n-1]=='\'') n--;
+		if(!n) break;
+		if(n<WORD_MAX) {
+			memcpy(words[nr_words][0], in, n);
+			words[nr_words][0][n]=0;
+			for(j=0;j<=n;j++) {
+				words[nr_words][1][j]=tolower((unsigned char)in[j]);
+			}
+			words[nr_words][1][n]=0;
+			memcpy(words[nr_words][2], words[nr_words][1], n+1);
+			words[nr_words][2][0]=toupper((unsigned char)words[nr_words][2][0]);
+			for(j=0;j<3;j++) {
+				keys[nr_words*3+j]=words[nr_words][j];
+			}
+			nr_words++;
+		}
+		in+=n;
+		while(*in=='\'') in++;
+	}
+
+	if(!nr_words) {
+		snprintf(dest, max, "Nothing to check.");
+		return 0;
+	}
+
+	batch=udb_lookup_many(dict_h, keys, nr_words*3);
+	if(!batch) {
+		snprintf(dest, max, "Error reading the dictionary.");
+		return 0;
+	}
+
+	for(i=0,len=0,bad=0;i<nr_words && len<max;i++) {
+		if(batch->view[i*3].data || batch->view[i*3+1].data || batch->view[i*3+2].data) {
+			continue; /* spelled correctly */
+		}
+		if(!bad && !need_index()) {
+			snprintf(dest, max, "Error building the spelling index.");
+			udb_batch_free(batch);
+			return 0;
+		}
+		if(bad) {
+			len+=snprintf(dest+len, max-len, "; ");
+			if(len>=max) break;
+		}
+		suggest(dest+len, max-len, words[i][1]);
+		len+=strlen(dest+len);
+		bad++;
+	}
+	udb_batch_free(batch);
+
+	if(!bad) {
+		snprintf(dest, max, "%u word%s spelled correctly.", nr_words, nr_words==1?"":"s");
+	}
+	return bad;
+}
+
+/** spell_result() may be called from any thread, one runs at a time */
+int spell_result(char *dest, size_t max, const char *in) {
+	int ret;
+
+	pthread_mutex_lock(&spell_lock);
+	ret=check_words(dest, max, in);
+	pthread_mutex_unlock(&spell_lock);
+	return ret;
+}
+
+/*** UNIT TEST ***/
+#if 0
+int main(int argc, char **argv) {
+	char buf[512];
+	int i;
+
+	if(!spell_init()) {
+		return 0;
+	}
+
+	if(argc<=1) {
+		spell_result(buf, sizeof buf, "teh quikc brown fox");
+		printf("%s\n", buf);
+	} else for(i=1;i<argc;i++) {
+		spell_result(buf, sizeof buf, argv[i]);
+		printf("%s\n", buf);
+	}
+	spell_shutdown();
+	return 0;
+}
+#endif
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
@@ -0,0 +1,10 @@
+#ifndef SPELL_H
+#define SPELL_H
+#include <stddef.h>
+int spell_init(void);
+void spell_shutdown(void);
+int spell_result(char *dest, size_t max, const char *in);
+#endif
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
@@ -7,47 +7,288 @@
  * Last Updated: April 22, 2008
  */
 
+/*
+ * the strings are consumed 8 bytes at a time: each word is folded into a
+ * 64-bit state with a rotate, xor and multiply, and the state is mixed down
+ * to an unsigned at the end. strhash(s) is always the same as
+ * strnhash(s, strlen(s)), and strcasehash()/strncasehash() are the same as
+ * strhash() of the string in lower case, so tables can mix them freely.
+ *
+ * case folding is done on whole words with 64-bit arithmetic, and 16 bytes
+ * at a time with SSE2 when the length is known and the compiler has it.
+ * only 'A' to 'Z' are folded, the same as tolower() in the "C" locale.
+ *
+ * words are always read in little endian order, so a string hashes the same
+ * on every machine.
+ */
+
 #include <assert.h>
 #include <stddef.h>
-#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__SSE2__) && defined(__x86_64__)
+#include <emmintrin.h>
+#endif
 #include "strhash.h"
 
+#define HASH_K 0x9e3779b97f4a7c15ULL /* 2^64 / golden ratio */
+#define ONES 0x0101010101010101ULL
+
+/** 8 bytes as a little endian word. compilers turn this into one load on
+ * machines where that is the native order */
+static inline uint64_t load64(const char *p) {
+	const unsigned char *u=(const unsigned char*)p;
+	return (uint64_t)u[0] | (uint64_t)u[1]<<8 | (uint64_t)u[2]<<16
+		| (uint64_t)u[3]<<24 | (uint64_t)u[4]<<32 | (uint64_t)u[5]<<40
+		| (uint64_t)u[6]<<48 | (uint64_t)u[7]<<56;
+}
+
+static inline uint64_t load32(const char *p) {
+	const unsigned char *u=(const unsigned char*)p;
+	return (uint64_t)u[0] | (uint64_t)u[1]<<8 | (uint64_t)u[2]<<16 | (uint64_t)u[3]<<24;
+}
+
+/** the last 1 to 7 bytes, zero filled, in the same order as load64().
+ * overlapping loads put the same byte in the same place, so there is no
+ * need for a loop */
+static inline uint64_t load_tail(const char *p, size_t len) {
+	const unsigned char *u=(const unsigned char*)p;
+
+	if(len>=4) {
+		return load32(p) | load32(p+len-4)<<(8*(len-4));
+	}
+	return (uint64_t)u[0] | (uint64_t)u[len>>1]<<(8*(len>>1)) | (uint64_t)u[len-1]<<(8*(len-1));
+}
+
+static inline uint64_t step(uint64_t h, uint64_t w) {
+	return ((h<<23 | h>>41) ^ w) * HASH_K;
+}
+
+static inline unsigned finish(uint64_t h, size_t len) {
+	h^=len;
+	h^=h>>32;
+	h*=0xff51afd7ed558ccdULL; /* from murmur3's finalizer */
+	return (unsigned)(h>>32);
+}
+
+/** lower case every 'A' to 'Z' in 8 bytes at once */
+static inline uint64_t fold64(uint64_t w) {
+	uint64_t low7, ge_a, gt_z, upper;
+
+	low7=w & 0x7f*ONES;
+	ge_a=low7 + (0x80-'A')*ONES; /* high bit set where byte >= 'A' */
+	gt_z=low7 + (0x80-'Z'-1)*ONES; /* high bit set where byte > 'Z' */
+	upper=ge_a & ~gt_z & ~w & 0x80*ONES; /* bytes >= 0x80 are left alone */
+	return w | upper>>2; /* 0x80>>2 is the 0x20 case bit */
+}
+
+/** calculates a hash of a series of characters */
+unsigned strnhash(const char *str, size_t len) {
+	uint64_t h=0;
+	size_t n;
+
+	assert(str!=NULL);
+
+	for(n=len;n>=16;n-=16,str+=16) {
+		h=step(h, load64(str));
+		h=step(h, load64(str+8));
+	}
+	if(n>=8) {
+		h=step(h, load64(str));
+		n-=8;
+		str+=8;
+	}
+	if(n) {
+		h=step(h, load_tail(str, n));
+	}
+	return finish(h, len);
+}
+
 /** calculates a hash of a null terminated string */
 unsigned strhash(const char *str) {
-	unsigned h=0;
+	assert(str!=NULL);
+	/* the C library's strlen() looks at many bytes per step, this is
+	 * quicker than checking for the terminator in the loop */
+	return strnhash(str, strlen(str));
+}
+
+/** calculates a hash of a series of characters of any case */
+unsigned strncasehash(const char *str, size_t len) {
+	uint64_t h=0;
+	size_t n=len;
 
 	assert(str!=NULL);
 
-	while(*str) {
-		/* same as: h = h * 65599 + *str++; */
-		h=*str+++(h<<6)+(h<<16)-h;
+#if defined(__SSE2__) && defined(__x86_64__)
+	for(;n>=16;n-=16,str+=16) {
+		__m128i v, upper;
+
+		v=_mm_loadu_si128((const __m128i*)str);
+		/* signed compares, so bytes >= 0x80 are never in range */
+		upper=_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A'-1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z'+1)));
+		v=_mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+		/* x86 is little endian, so the lanes are what load64() would give */
+		h=step(h, (uint64_t)_mm_cvtsi128_si64(v));
+		h=step(h, (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
 	}
-	return h;
+#else
+	for(;n>=16;n-=16,str+=16) {
+		h=step(h, fold64(load64(str)));
+		h=step(h, fold64(load64(str+8)));
+	}
+#endif
+	if(n>=8) {
+		h=step(h, fold64(load64(str)));
+		n-=8;
+		str+=8;
+	}
+	if(n) {
+		h=step(h, fold64(load_tail(str, n)));
+	}
+	return finish(h, len);
 }
 
 /** calculates a hash of a null terminated string of any case */
 unsigned strcasehash(const char *str) {
-	unsigned h=0;
-
 	assert(str!=NULL);
+	return strncasehash(str, strlen(str));
+}
+
+/*
+ * keyed hashes for tables whose keys come from the IRC server or its users.
+ * the functions above are fixed, so anyone can work out a set of strings
+ * that all land in one bucket. SipHash-1-3 with a key chosen at startup
+ * makes that guesswork. the key is all zero until strhash_init() is called,
+ * so values are stable in programs that don't call it.
+ */
+
+static uint64_t sip_k0, sip_k1;
 
-	while(*str) {
-		/* same as: h = h * 65599 + *str++; */
-		h=tolower(*str++)+(h<<6)+(h<<16)-h;
+#define ROTL(x, b) ((x)<<(b) | (x)>>(64-(b)))
+
+#define SIPROUND do { \
+		v0+=v1; v1=ROTL(v1, 13); v1^=v0; v0=ROTL(v0, 32); \
+		v2+=v3; v3=ROTL(v3, 16); v3^=v2; \
+		v0+=v3; v3=ROTL(v3, 21); v3^=v0; \
+		v2+=v1; v1=ROTL(v1, 17); v1^=v2; v2=ROTL(v2, 32); \
+	} while(0)
+
+/** SipHash-1-3 of len bytes, lower cased first if fold is set */
+static uint64_t siphash13(const char *str, size_t len, int fold) {
+	uint64_t v0, v1, v2, v3, m;
+	size_t n;
+
+	v0=sip_k0 ^ 0x736f6d6570736575ULL;
+	v1=sip_k1 ^ 0x646f72616e646f6dULL;
+	v2=sip_k0 ^ 0x6c7967656e657261ULL;
+	v3=sip_k1 ^ 0x7465646279746573ULL;
+
+	for(n=len;n>=8;n-=8,str+=8) {
+		m=load64(str);
+		if(fold) m=fold64(m);
+		v3^=m;
+		SIPROUND;
+		v0^=m;
 	}
-	return h;
+
+	/* last block holds the remaining bytes and the length */
+	m=n ? load_tail(str, n) : 0;
+	if(fold) m=fold64(m);
+	m|=(uint64_t)len<<56;
+	v3^=m;
+	SIPROUND;
+	v0^=m;
+
+	v2^=0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return v0^v1^v2^v3;
 }
 
-/** calculates a hash of a series of characters */
-unsigned strnhash(const char *str, size_t len) {
-	unsigned h=0;
+/** pick a random key for the keyed hashes. must be called before any table
+ * using them is filled, and only once.
+ * return 0 if no good random source was found (a weaker key is used) */
+int strhash_init(void) {
+	unsigned char key[16];
+	FILE *f;
+	int ret=0;
+
+	f=fopen("/dev/urandom", "rb");
+	if(f) {
+		ret=fread(key, 1, sizeof key, f)==sizeof key;
+		fclose(f);
+	}
+	if(ret) {
+		sip_k0=load64((const char*)key);
+		sip_k1=load64((const char*)key+8);
+	} else {
+		fprintf(stderr, "strhash_init(): no /dev/urandom, using a weak hash key\n");
+		sip_k0=(uint64_t)time(0)*HASH_K;
+		sip_k1=((uint64_t)getpid()<<32 ^ (uint64_t)clock())*HASH_K;
+	}
+	return ret;
+}
+
+/** keyed hash of a series of characters */
+unsigned strnsiphash(const char *str, size_t len) {
+	uint64_t h;
 
 	assert(str!=NULL);
+	h=siphash13(str, len, 0);
+	return (unsigned)(h ^ h>>32);
+}
+
+/** keyed hash of a null terminated string */
+unsigned strsiphash(const char *str) {
+	assert(str!=NULL);
+	return strnsiphash(str, strlen(str));
+}
+
+/** keyed hash of a null terminated string of any case */
+unsigned strcasesiphash(const char *str) {
+	uint64_t h;
+
+	assert(str!=NULL);
+	h=siphash13(str, strlen(str), 1);
+	return (unsigned)(h ^ h>>32);
+}
+
+/** bucket for a nick or channel name in a table of nr_buckets.
+ * names are picked by whoever is on the other end, so they are hashed keyed
+ * and without case, as the server compares them */
+unsigned name_bucket(const char *name, unsigned nr_buckets) {
+	assert(nr_buckets>0);
+	return strcasesiphash(name)%nr_buckets;
+}
+
+/*** UNIT TEST ***/
+#if 0
+#include <ctype.h>
+#include <stdio.h>
+
+int main(int argc, char **argv) {
+	char lower[256];
+	int i, j, fail=0;
 
-	while(len) {
-		/* same as: h = h * 65599 + *str++; */
-		h=*str+++(h<<6)+(h<<16)-h;
-		len--;
+	for(i=1;i<argc;i++) {
+		for(j=0;argv[i][j] && j<255;j++) {
+			lower[j]=tolower((unsigned char)argv[i][j]);
+		}
+		lower[j]=0;
+		printf("%08x %s\n", strhash(argv[i]), argv[i]);
+		if(strhash(argv[i])!=strnhash(argv[i], strlen(argv[i]))) {
+			printf("strnhash mismatch: %s\n", argv[i]);
+			fail=1;
+		}
+		if(strcasehash(argv[i])!=strhash(lower) || strncasehash(argv[i], strlen(argv[i]))!=strhash(lower)) {
+			printf("strcasehash mismatch: %s\n", argv[i]);
+			fail=1;
+		}
 	}
-	return h;
+	return fail;
 }
+#endif
@@ -3,4 +3,11 @@
 unsigned strhash(const char *str);
 unsigned strcasehash(const char *str);
 unsigned strnhash(const char *str, size_t len);
+unsigned strncasehash(const char *str, size_t len);
+/* keyed, for keys that come from outside */
+int strhash_init(void);
+unsigned strsiphash(const char *str);
+unsigned strcasesiphash(const char *str);
+unsigned strnsiphash(const char *str, size_t len);
+unsigned name_bucket(const char *name, unsigned nr_buckets);
 #endif
@@ -0,0 +1,328 @@
+/* bench-hash.c : hash function and table benchmark on the bot's own data */
+/*
+ * usage: bench-hash kind:file ...
+ * kind says how to pull keys out of file:
+ *   calc  - first word of each line (calcdb.data)
+ *   user  - first word of each line (user.list)
+ *   udb   - first line of each record (dict.udb)
+ *   proto - function name on the first line of each record (proto.udb)
+ *
+ * for every hash function and table type it prints the bucket length
+ * histogram, the average number of keys compared per hit and per miss, and
+ * the time for one lookup. misses are the keys with a '~' appended.
+ */
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "keystore.h"
+#include "strhash.h"
+
+#define MAX_KEYS 400000
+#define HIST_MAX 8 /* the last histogram column is this many or more */
+#define REPEAT 5 /* timing runs, the best is reported */
+
+struct hash_func {
+	const char *name;
+	unsigned (*hash)(const char *str);
+	int nocase;
+};
+
+/** what the bot hashed with before strhash.c went word at a time */
+static unsigned hash65599(const char *str) {
+	unsigned h=0;
+	while(*str) {
+		h=*str+++(h<<6)+(h<<16)-h;
+	}
+	return h;
+}
+
+static const struct hash_func funcs[] = {
+	{ "65599", hash65599, 0 },
+	{ "strhash", strhash, 0 },
+	{ "strcasehash", strcasehash, 1 },
+	{ "strsiphash", strsiphash, 0 },
+	{ "strcasesiphash", strcasesiphash, 1 },
+};
+
+static char **keys, **misses;
+static unsigned nr_keys;
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+static int add_key(const char *key, size_t len) {
+	char *k, *m;
+	unsigned i;
+
+	if(!len || len>=KEYSTORE_KEY_MAX-1 || nr_keys>=MAX_KEYS) return 0;
+	/* skip duplicates the slow way, this is done once */
+	for(i=nr_keys;i>0 && nr_keys-i<64;i--) {
+		if(strlen(keys[i-1])==len && !memcmp(keys[i-1], key, len)) return 0;
+	}
+	k=malloc(len+1);
+	m=malloc(len+2);
+	memcpy(k, key, len);
+	k[len]=0;
+	memcpy(m, key, len);
+	m[len]='~';
+	m[len+1]=0;
+	keys[nr_keys]=k;
+	misses[nr_keys]=m;
+	nr_keys++;
+	return 1;
+}
+
+/** the identifier just before the first '(' */
+static void proto_key(const char *line) {
+	const char *start, *end;
+
+	end=strchr(line, '(');
+	if(!end) return;
+	while(end>line && end[-1]==' ') end--;
+	for(start=end;start>line && (start[-1]=='_' || isalnum((unsigned char)start[-1]));start--) ;
+	add_key(start, end-start);
+}
+
+static int load_keys(const char *kind, const char *filename) {
+	char line[16384];
+	int start=1;
+	FILE *f;
+
+	f=fopen(filename, "r");
+	if(!f) {
+		perror(filename);
+		return 0;
+	}
+	nr_keys=0;
+	while(fgets(line, sizeof line, f)) {
+		line[strcspn(line, "\r\n")]=0;
+		if(!strcmp(kind, "calc") || !strcmp(kind, "user")) {
+			add_key(line, strcspn(line, " \t"));
+		} else if(!strcmp(line, "%")) {
+			start=1;
+		} else if(start) {
+			start=0;
+			if(!strcmp(kind, "proto")) {
+				proto_key(line);
+			} else {
+				add_key(line, strlen(line));
+			}
+		}
+	}
+	fclose(f);
+	return 1;
+}
+
+/*** chained table, like notify.c ***/
+
+struct chain_ent {
+	const char *key;
+	struct chain_ent *next;
+};
+
+static void bench_chained(const struct hash_func *hf, unsigned size) {
+	struct chain_ent **table, *ents, *e;
+	unsigned long hist[HIST_MAX+1], hit_probes=0, miss_probes=0;
+	unsigned i, len, longest=0, r;
+	double best_hit=1e30, best_miss=1e30, t;
+	volatile unsigned found=0;
+	int (*cmp)(const char *, const char *)=hf->nocase ? strcasecmp : strcmp;
+
+	table=calloc(size, sizeof *table);
+	ents=calloc(nr_keys, sizeof *ents);
+	for(i=0;i<nr_keys;i++) {
+		struct chain_ent **tail=&table[hf->hash(keys[i])%size];
+		/* append, so the probe count is the position in the chain */
+		while(*tail) tail=&(*tail)->next;
+		ents[i].key=keys[i];
+		*tail=&ents[i];
+	}
+
+	memset(hist, 0, sizeof hist);
+	for(i=0;i<size;i++) {
+		for(len=0,e=table[i];e;e=e->next) len++;
+		hist[len>HIST_MAX ? HIST_MAX : len]++;
+		if(len>longest) longest=len;
+	}
+	for(i=0;i<nr_keys;i++) {
+		for(e=table[hf->hash(keys[i])%size];e;e=e->next) {
+			hit_probes++;
+			if(!cmp(e->key, keys[i])) break;
+		}
+		for(e=table[hf->hash(misses[i])%size];e;e=e->next) {
+			miss_probes++;
+		}
+	}
+
+	for(r=0;r<REPEAT;r++) {
+		t=now_ns();
+		for(i=0;i<nr_keys;i++) {
+			for(e=table[hf->hash(keys[i])%size];e && cmp(e->key, keys[i]);e=e->next) ;
+			found+=e!=0;
+		}
+		t=(now_ns()-t)/nr_keys;
+		if(t<best_hit) best_hit=t;
+		t=now_ns();
+		for(i=0;i<nr_keys;i++) {
+			for(e=table[hf->hash(misses[i])%size];e && cmp(e->key, misses[i]);e=e->next) ;
+			found+=e!=0;
+		}
+		t=(now_ns()-t)/nr_keys;
+		if(t<best_miss) best_miss=t;
+	}
+
+	printf("  %-14s chained %-6u load %5.2f probes hit %5.2f miss %5.2f max %3u  %6.1fns hit %6.1fns miss |",
+		hf->name, size, (double)nr_keys/size, (double)hit_probes/nr_keys, (double)miss_probes/nr_keys,
+		longest, best_hit, best_miss);
+	for(i=0;i<=HIST_MAX;i++) {
+		printf(" %lu", hist[i]);
+	}
+	printf("\n");
+
+	free(ents);
+	free(table);
+}
+
+/*** open addressing with linear probing, at most half full ***/
+
+static void bench_open(const struct hash_func *hf) {
+	const char **slot;
+	unsigned size, mask, i, j, r, run, longest=0;
+	unsigned long hit_probes=0, miss_probes=0;
+	double best_hit=1e30, best_miss=1e30, t;
+	volatile unsigned found=0;
+	int (*cmp)(const char *, const char *)=hf->nocase ? strcasecmp : strcmp;
+
+	for(size=16;size<nr_keys*2;size*=2) ;
+	mask=size-1;
+	slot=calloc(size, sizeof *slot);
+	for(i=0;i<nr_keys;i++) {
+		for(j=hf->hash(keys[i])&mask;slot[j];j=(j+1)&mask) ;
+		slot[j]=keys[i];
+	}
+	for(i=run=0;i<size;i++) {
+		run=slot[i] ? run+1 : 0;
+		if(run>longest) longest=run;
+	}
+	for(i=0;i<nr_keys;i++) {
+		for(j=hf->hash(keys[i])&mask;slot[j];j=(j+1)&mask) {
+			hit_probes++;
+			if(!cmp(slot[j], keys[i])) break;
+		}
+		for(j=hf->hash(misses[i])&mask;slot[j];j=(j+1)&mask) {
+			miss_probes++;
+		}
+	}
+
+	for(r=0;r<REPEAT;r++) {
+		t=now_ns();
+		for(i=0;i<nr_keys;i++) {
+			for(j=hf->hash(keys[i])&mask;slot[j] && cmp(slot[j], keys[i]);j=(j+1)&mask) ;
+			found+=slot[j]!=0;
+		}
+		t=(now_ns()-t)/nr_keys;
+		if(t<best_hit) best_hit=t;
+		t=now_ns();
+		for(i=0;i<nr_keys;i++) {
+			for(j=hf->hash(misses[i])&mask;slot[j] && cmp(slot[j], misses[i]);j=(j+1)&mask) ;
+			found+=slot[j]!=0;
+		}
+		t=(now_ns()-t)/nr_keys;
+		if(t<best_miss) best_miss=t;
+	}
+
+	printf("  %-14s open    %-6u load %5.2f probes hit %5.2f miss %5.2f run %3u  %6.1fns hit %6.1fns miss\n",
+		hf->name, size, (double)nr_keys/size, (double)hit_probes/nr_keys, (double)miss_probes/nr_keys,
+		longest, best_hit, best_miss);
+	free(slot);
+}
+
+/*** udb's sorted, front-coded keystore ***/
+
+static int key_cmp(const void *a, const void *b) {
+	return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+static void bench_keystore(void) {
+	struct keystore ks;
+	char **sorted;
+	unsigned i, r;
+	double best_hit=1e30, best_miss=1e30, t;
+	volatile unsigned found=0;
+
+	sorted=malloc(nr_keys * sizeof *sorted);
+	memcpy(sorted, keys, nr_keys * sizeof *sorted);
+	qsort(sorted, nr_keys, sizeof *sorted, key_cmp);
+	keystore_init(&ks);
+	for(i=0;i<nr_keys;i++) {
+		keystore_add(&ks, sorted[i], i);
+	}
+	keystore_finish(&ks);
+
+	for(r=0;r<REPEAT;r++) {
+		t=now_ns();
+		for(i=0;i<nr_keys;i++) {
+			found+=keystore_find(&ks, keys[i], 0);
+		}
+		t=(now_ns()-t)/nr_keys;
+		if(t<best_hit) best_hit=t;
+		t=now_ns();
+		for(i=0;i<nr_keys;i++) {
+			found+=keystore_find(&ks, misses[i], 0);
+		}
+		t=(now_ns()-t)/nr_keys;
+		if(t<best_miss) best_miss=t;
+	}
+	printf("  %-14s keystore %lu bytes %40s %6.1fns hit %6.1fns miss\n",
+		"-", (unsigned long)keystore_bytes(&ks), "", best_hit, best_miss);
+	keystore_free(&ks);
+	free(sorted);
+}
+
+int main(int argc, char **argv) {
+	static const unsigned sizes[] = { 256, 4096 };
+	unsigned f, s, i;
+	int a;
+
+	strhash_init();
+	keys=malloc(MAX_KEYS * sizeof *keys);
+	misses=malloc(MAX_KEYS * sizeof *misses);
+
+	if(argc<2) {
+		fprintf(stderr, "usage: %s kind:file ...\n", argv[0]);
+		return 1;
+	}
+
+	for(a=1;a<argc;a++) {
+		char *colon=strchr(argv[a], ':');
+		if(!colon) {
+			fprintf(stderr, "%s: expected kind:file\n", argv[a]);
+			return 1;
+		}
+		*colon=0;
+		if(!load_keys(argv[a], colon+1)) {
+			continue;
+		}
+		printf("%s (%s): %u keys\n", colon+1, argv[a], nr_keys);
+		printf("  histogram columns are buckets holding 0, 1, ... %d+ keys\n", HIST_MAX);
+		for(f=0;f<sizeof funcs/sizeof *funcs;f++) {
+			for(s=0;s<sizeof sizes/sizeof *sizes;s++) {
+				bench_chained(&funcs[f], sizes[s]);
+			}
+			bench_open(&funcs[f]);
+		}
+		bench_keystore();
+		for(i=0;i<nr_keys;i++) {
+			free(keys[i]);
+			free(misses[i]);
+		}
+	}
+	return 0;
+}
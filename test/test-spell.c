@@ -0,0 +1,144 @@
+/* test-spell.c : check spell's suggestions against a brute force search */
+/*
+ * run from the directory with dict.udb in it. for every word below the
+ * whole dictionary is searched for words within 2 edits, ranked the way
+ * spell ranks them, and the best 3 have to be what spell_result() said.
+ * exits non-zero if any word came out different.
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "spell.h"
+#include "udb.h"
+
+#define MAX_DISTANCE 2
+#define MAX_SUGGEST 3
+#define MAX_FOUND 4096
+
+static const char *words[] = {
+	"teh", "quikc", "recieve", "wierd", "xyzzyq",
+	/* more than 64 words within 2 edits, the delete walk finds plenty of
+	 * distance 2 words before the distance 1 ones */
+	"adn", "ot", "thn", "hwo",
+};
+
+struct found {
+	const char *word;
+	int distance;
+	int swapped;
+};
+
+static const char *want_word;
+static struct found found[MAX_FOUND];
+static unsigned nr_found;
+
+/** plain optimal string alignment distance, case insensitive */
+static int distance(const char *a, const char *b) {
+	size_t alen=strlen(a), blen=strlen(b), i, j;
+	int d[64][64];
+
+	if(alen>=64 || blen>=64) return MAX_DISTANCE+1;
+	for(i=0;i<=alen;i++) d[i][0]=i;
+	for(j=0;j<=blen;j++) d[0][j]=j;
+	for(i=1;i<=alen;i++) {
+		for(j=1;j<=blen;j++) {
+			int ca=tolower((unsigned char)a[i-1]), cb=tolower((unsigned char)b[j-1]);
+			int best=d[i-1][j-1]+(ca!=cb);
+			if(d[i-1][j]+1<best) best=d[i-1][j]+1;
+			if(d[i][j-1]+1<best) best=d[i][j-1]+1;
+			if(i>1 && j>1 && ca==tolower((unsigned char)b[j-2]) && tolower((unsigned char)a[i-2])==cb && d[i-2][j-2]+1<best) {
+				best=d[i-2][j-2]+1;
+			}
+			d[i][j]=best;
+		}
+	}
+	return d[alen][blen];
+}
+
+/** same length, and equal apart from two neighbouring letters swapped */
+static int is_swap(const char *a, const char *b) {
+	size_t len=strlen(a), i;
+
+	if(strlen(b)!=len) return 0;
+	for(i=0;i+1<len;i++) {
+		if(tolower((unsigned char)a[i])!=tolower((unsigned char)b[i])) {
+			return tolower((unsigned char)a[i])==tolower((unsigned char)b[i+1])
+				&& tolower((unsigned char)a[i+1])==tolower((unsigned char)b[i])
+				&& !strcasecmp(a+i+2, b+i+2);
+		}
+	}
+	return 0;
+}
+
+static int check_key(void *p, const char *key) {
+	int dist;
+
+	(void)p;
+	dist=distance(want_word, key);
+	if(dist<=MAX_DISTANCE && nr_found<MAX_FOUND) {
+		found[nr_found].word=strdup(key);
+		found[nr_found].distance=dist;
+		found[nr_found].swapped=is_swap(want_word, key);
+		nr_found++;
+	}
+	return 1;
+}
+
+/** spell's order: distance, swapped letters, same first letter, lower case,
+ * strcmp() */
+static int found_cmp(const void *a, const void *b) {
+	const struct found *x=a, *y=b;
+	const char *xw=x->word, *yw=y->word;
+
+	if(x->distance!=y->distance) return x->distance-y->distance;
+	if(x->swapped!=y->swapped) return y->swapped-x->swapped;
+	if((*xw==*want_word)!=(*yw==*want_word)) return *xw==*want_word ? -1 : 1;
+	if(!islower((unsigned char)*xw)!=!islower((unsigned char)*yw)) return islower((unsigned char)*xw) ? -1 : 1;
+	return strcmp(xw, yw);
+}
+
+int main(void) {
+	char got[512], want[512];
+	struct udb_handle *dict;
+	unsigned i, j;
+	size_t len;
+	int failed=0;
+
+	dict=udb_open("dict.udb", 0);
+	if(!dict || !spell_init()) {
+		fprintf(stderr, "could not open dict.udb\n");
+		return 1;
+	}
+
+	for(i=0;i<sizeof words/sizeof *words;i++) {
+		want_word=words[i];
+		nr_found=0;
+		udb_foreach(dict, check_key, 0);
+		qsort(found, nr_found, sizeof *found, found_cmp);
+
+		len=snprintf(want, sizeof want, "%s:", words[i]);
+		for(j=0;j<nr_found && j<MAX_SUGGEST;j++) {
+			len+=snprintf(want+len, sizeof want-len, "%s %s", j?",":"", found[j].word);
+		}
+		if(!nr_found) {
+			snprintf(want, sizeof want, "%s: ?", words[i]);
+		}
+		for(j=0;j<nr_found;j++) {
+			free((char*)found[j].word);
+		}
+
+		spell_result(got, sizeof got, words[i]);
+		if(strcmp(got, want)) {
+			printf("FAIL %s (%u candidates) wanted %s\n", got, nr_found, want);
+			failed=1;
+		} else {
+			printf("ok   %s (%u candidates)\n", got, nr_found);
+		}
+	}
+
+	spell_shutdown();
+	udb_close(dict);
+	return failed;
+}
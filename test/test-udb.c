@@ -0,0 +1,215 @@
+/* test-udb.c : check the multi-threaded udb build against a single thread */
+/*
+ * usage: test-udb file.udb ...
+ *
+ * each file is copied, a few of its records are replaced and one deleted so
+ * the copy has duplicates and tombstones, then it is indexed by 1 thread
+ * and by 2, 4 and 8 threads with chunks small enough that every thread gets
+ * one. every build has to give the same keys, the same record for each key
+ * and the same record counts. the build time for each thread count is
+ * printed, the best of a few runs. exits non-zero on a mismatch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "strhash.h"
+#include "udb.h"
+
+#define COPY "test-udb.tmp"
+#define REPEAT 3 /* timing runs, the best is reported */
+
+struct key_list {
+	char **keys;
+	unsigned nr, max;
+};
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e3+ts.tv_nsec/1e6;
+}
+
+static int copy_file(const char *src, const char *dst) {
+	char buf[65536];
+	FILE *in, *out;
+	size_t n;
+
+	in=fopen(src, "r");
+	if(!in) {
+		perror(src);
+		return 0;
+	}
+	out=fopen(dst, "w");
+	if(!out) {
+		perror(dst);
+		fclose(in);
+		return 0;
+	}
+	while((n=fread(buf, 1, sizeof buf, in))>0) {
+		fwrite(buf, 1, n, out);
+	}
+	fclose(in);
+	return !fclose(out);
+}
+
+static int add_key(void *p, const char *key) {
+	struct key_list *l=p;
+
+	if(l->nr>=l->max) {
+		l->max=l->max ? l->max*2 : 1024;
+		l->keys=realloc(l->keys, l->max * sizeof *l->keys);
+	}
+	l->keys[l->nr++]=strdup(key);
+	return 1;
+}
+
+static void free_keys(struct key_list *l) {
+	while(l->nr) free(l->keys[--l->nr]);
+	free(l->keys);
+	memset(l, 0, sizeof *l);
+}
+
+/** replace the first, middle and last records and delete the second, so
+ * the copy has newer versions of keys from every part of the file */
+static int scribble(void) {
+	struct udb_handle *h;
+	struct key_list l={0, 0, 0};
+	const char *fields[2];
+	unsigned i, which[3];
+	int ok=1;
+
+	h=udb_open(COPY, 0);
+	if(!h) return 0;
+	udb_foreach(h, add_key, &l);
+	if(l.nr<4) {
+		fprintf(stderr, "%s: too few records to test with\n", COPY);
+		ok=0;
+	}
+	which[0]=0;
+	which[1]=l.nr/2;
+	which[2]=l.nr-1;
+	for(i=0;ok && i<3;i++) {
+		fields[0]=l.keys[which[i]];
+		fields[1]="replaced by test-udb";
+		ok=udb_put(h, fields, 2);
+	}
+	if(ok) {
+		ok=udb_delete(h, l.keys[1]);
+	}
+	udb_close(h);
+	free_keys(&l);
+	return ok;
+}
+
+/** open the copy and index it with up to threads threads.
+ * ms is set to the best time */
+static struct udb_handle *build(unsigned threads, double *ms) {
+	struct udb_handle *h;
+	double start, t;
+	int i;
+
+	h=udb_open(COPY, 0);
+	if(!h) return 0;
+	/* 1 byte chunks, so the file is split however small it is */
+	udb_set_build_threads(h, threads, threads>1 ? 1 : 0);
+	for(i=0;i<REPEAT;i++) {
+		start=now_ms();
+		udb_refresh(h);
+		t=now_ms()-start;
+		if(!i || t<*ms) *ms=t;
+	}
+	return h;
+}
+
+/** return non-zero if a and b have the same keys and records */
+static int same_index(struct udb_handle *a, struct udb_handle *b) {
+	struct key_list ka={0, 0, 0}, kb={0, 0, 0};
+	struct udb_batch *ba=0, *bb=0;
+	struct udb_stats sa, sb;
+	unsigned i;
+	int ok=1;
+
+	udb_get_stats(a, &sa);
+	udb_get_stats(b, &sb);
+	if(sa.records!=sb.records || sa.dead_records!=sb.dead_records) {
+		printf("  records %d/%d dead, wanted %d/%d\n", sb.records, sb.dead_records, sa.records, sa.dead_records);
+		ok=0;
+	}
+
+	udb_foreach(a, add_key, &ka);
+	udb_foreach(b, add_key, &kb);
+	if(ka.nr!=kb.nr) {
+		printf("  %u keys, wanted %u\n", kb.nr, ka.nr);
+		ok=0;
+	}
+	for(i=0;ok && i<ka.nr;i++) {
+		if(strcmp(ka.keys[i], kb.keys[i])) {
+			printf("  key %u is %s, wanted %s\n", i, kb.keys[i], ka.keys[i]);
+			ok=0;
+		}
+	}
+
+	if(ok) {
+		ba=udb_lookup_many(a, (const char *const*)ka.keys, ka.nr);
+		bb=udb_lookup_many(b, (const char *const*)ka.keys, ka.nr);
+		ok=ba && bb;
+	}
+	for(i=0;ok && i<ka.nr;i++) {
+		struct udb_view *va=&ba->view[i], *vb=&bb->view[i];
+
+		if(!va->data || !vb->data || va->len!=vb->len || memcmp(va->data, vb->data, va->len)) {
+			printf("  record for %s differs\n", ka.keys[i]);
+			ok=0;
+		}
+	}
+	udb_batch_free(ba);
+	udb_batch_free(bb);
+	free_keys(&ka);
+	free_keys(&kb);
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	static const unsigned threads[] = { 2, 4, 8 };
+	struct udb_handle *single, *multi;
+	double ms1, ms;
+	unsigned i;
+	int a, failed=0;
+
+	if(argc<2) {
+		fprintf(stderr, "usage: %s file.udb ...\n", argv[0]);
+		return 1;
+	}
+	strhash_init();
+
+	for(a=1;a<argc;a++) {
+		if(!copy_file(argv[a], COPY) || !scribble()) {
+			failed=1;
+			continue;
+		}
+		single=build(1, &ms1);
+		if(!single) {
+			failed=1;
+			continue;
+		}
+		printf("%s: 1 thread %.1fms\n", argv[a], ms1);
+		for(i=0;i<sizeof threads/sizeof *threads;i++) {
+			multi=build(threads[i], &ms);
+			if(!multi) {
+				failed=1;
+				continue;
+			}
+			if(same_index(single, multi)) {
+				printf("ok   %u threads %.1fms (%.2fx)\n", threads[i], ms, ms1/ms);
+			} else {
+				printf("FAIL %u threads\n", threads[i]);
+				failed=1;
+			}
+			udb_close(multi);
+		}
+		udb_close(single);
+	}
+	remove(COPY);
+	return failed;
+}
@@ -3,35 +3,85 @@
  */
 #include <assert.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include "bloom.h"
+#include "keystore.h"
 #include "strhash.h"
 #include "udb.h"
 
-#define HASH_SZ 4096 /* hash table size - does not have to be power of 2 */
-#define KEY_MAX 256 /* maximum keysize we support */
+#define KEY_MAX KEYSTORE_KEY_MAX /* maximum keysize we support */
 #define LINE_MAX 16384 /* maximum line length */
-
-/** test if a udb_ent is empty */
-#define UDB_IS_EMPTY(ent) (!(ent) || (ent)->key==NULL)
-
-struct udb_ent {
-	char *key;
-	fpos_t ofs;
-	struct udb_ent *next; /* linked list for hash collisions */
+#define MAX_BUILD_THREADS 8 /* most threads used to build one index */
+#define CHUNK_MIN (4<<20) /* default smallest slice of a file worth its own thread */
+#define DELTA_SZ 64 /* buckets for keys written since the last reload */
+#define DELTA_MAX 1024 /* reload once this many keys have been written */
+#define TOMBSTONE "%delete " /* first line of a record that deletes a key */
+
+/** one generation of the index. a reload builds a new one off to the side
+ * and swaps it in only when it is complete, so lookups never see a
+ * half-built table. */
+struct udb_index {
+	FILE *f; /* stream the offsets in keys refer to */
+	struct stat last_stat; /* result of fstat() when this index was built */
+	unsigned generation;
+	int record_count;
+	int dead_count; /* records in the file that were replaced or deleted */
+	off_t indexed_end; /* records starting before this are in keys */
+	struct bloom bloom; /* rejects most misses before the key search */
+	struct keystore keys; /* every key in sorted order, with its offset */
 };
 
 struct udb_handle {
-	FILE *f;
 	char *filename;
 	/* callback is used in udb_refresh() to turn the first line into a key */
 	int (*parse_key_cb)(const char *line, char *key_out, size_t max);
-	struct stat last_stat; /* result of last stat() call */
-	struct udb_ent hash[HASH_SZ]; /* note: first level are not pointers */
+	struct udb_index *idx; /* current generation, all lookups use this */
+	unsigned generation; /* last generation number handed out */
+	int background; /* non-zero to rebuild on a worker thread */
+	unsigned bloom_bits; /* bits per key for the bloom filter, 0 disables */
+	unsigned build_threads; /* most threads for a build, 0 is one per cpu */
+	off_t chunk_min; /* smallest slice of the file given its own thread */
+	/* counters for udb_get_stats() */
+	unsigned long nr_lookups, nr_hits, nr_bloom_rejects, nr_bloom_fp;
+	/* state for background rebuilds. pending is filled in by the worker and
+	 * picked up by the next lookup */
+	pthread_mutex_t lock;
+	pthread_t worker;
+	int building; /* a worker thread is running */
+	int build_done; /* worker finished, pending holds the result (may be 0) */
+	struct udb_index *pending;
+	/* the file as it was when the last reload failed. it isn't tried again
+	 * until the file changes */
+	int build_failed;
+	struct stat failed_stat;
+	/* writes. records are appended to the file and remembered in delta
+	 * until a reload has indexed them */
+	int wfd; /* opened by the first write, -1 until then */
+	struct udb_delta *delta[DELTA_SZ];
+	unsigned nr_delta;
+	int nr_dead; /* records made dead by writes since the last reload */
+	/* background compaction, see udb_compact() */
+	pthread_t compactor;
+	int compacting, compact_done, compact_failed;
+	off_t compact_end; /* file size the compactor was given */
+	off_t *compact_ofs; /* live records to copy, in file order */
+	unsigned compact_nr;
+	char *compact_tmp;
+};
+
+/** a key written since the last reload. overrides the index */
+struct udb_delta {
+	char *key;
+	off_t ofs;
+	int deleted;
+	struct udb_delta *next;
 };
 
 /** removed newline from end of a string
@@ -47,63 +97,61 @@ static int scrubnl(char *s) {
 	}
 }
 
-static void update_stat(struct udb_handle *h) {
-	assert(h!=NULL);
-
-	if(fstat(fileno(h->f), &h->last_stat)) {
-		perror(h->filename);
-		/* ignore the error */
-	}
-}
-
-/** return non-zero if file stat has changed
+/** return non-zero if file stat has changed since idx was built
  */
-static int file_has_changed(struct udb_handle *h) {
+static int file_has_changed(const char *filename, const struct udb_index *idx) {
 	struct stat st;
 
-	assert(h!=NULL);
+	assert(filename!=NULL);
+	assert(idx!=NULL);
 
-	if(stat(h->filename, &st)) {
-		perror(h->filename);
+	if(stat(filename, &st)) {
+		perror(filename);
 		return 1; /* treat error as if the file has changed */
 	}
 
-	if(st.st_ino!=h->last_stat.st_ino || st.st_mtime!=h->last_stat.st_mtime) {
+	if(st.st_ino!=idx->last_stat.st_ino || st.st_mtime!=idx->last_stat.st_mtime) {
 		return 1; /* something has changed */
 	}
 	return 0; /* no change */
 }
 
-/** checks if the DB file has been altered since we last loaded,
- * then reloads the database. */
-static void refresh_if_changed(struct udb_handle *h) {
-	assert(h!=NULL);
-
-	if(file_has_changed(h)) {
-		fprintf(stderr, "Refreshing DB for %s\n", h->filename);
-		udb_refresh(h);
+/** remember what the file looked like when a reload failed. a file that
+ * can't be stat()ed is remembered as all zeroes */
+static void note_failed_build(struct udb_handle *h) {
+	if(stat(h->filename, &h->failed_stat)) {
+		memset(&h->failed_stat, 0, sizeof h->failed_stat);
 	}
+	h->build_failed=1;
+	fprintf(stderr, "Fatal error in DB for %s! (keeping generation %u)\n", h->filename, h->generation);
 }
 
-/** free and clear hash table */
-static void free_hash(struct udb_handle *h) {
-	int i;
+/** return non-zero if the file is still the one the last reload failed on */
+static int same_failed_file(struct udb_handle *h) {
+	struct stat st;
 
-	assert(h!=NULL);
+	if(!h->build_failed) {
+		return 0;
+	}
+	if(stat(h->filename, &st)) {
+		memset(&st, 0, sizeof st);
+	}
+	if(st.st_ino==h->failed_stat.st_ino && st.st_mtime==h->failed_stat.st_mtime && st.st_size==h->failed_stat.st_size) {
+		return 1;
+	}
+	h->build_failed=0; /* something changed, worth another try */
+	return 0;
+}
 
-	for(i=0;i<HASH_SZ;i++) {
-		struct udb_ent *curr, *next;
-		/* first level of hash entries are not pointers */
-		free(h->hash[i].key);
-		/* the chained collision entries are just a linked list */
-		for(curr=h->hash[i].next;curr;curr=next) {
-			next=curr->next;
-			free(curr->key);
-			free(curr);
-		}
-		/* clear out entry */
-		memset(&h->hash[i], 0, sizeof h->hash[i]);
+/** free an index generation and close its stream */
+static void free_index(struct udb_index *idx) {
+	if(!idx) return;
+	keystore_free(&idx->keys);
+	bloom_free(&idx->bloom);
+	if(idx->f) {
+		fclose(idx->f);
 	}
+	free(idx);
 }
 
 /** generic parser function. just take the first word in the line */
@@ -123,54 +171,634 @@ static int generic_parse_key(const char *line, char *key_out, size_t max) {
 	return 0; /* failure */
 }
 
-static int find_dup(struct udb_ent *head, const char *key) {
-	struct udb_ent *curr;
+/** read next line of a record from f.
+ * return 0 when end of record is reached */
+static int read_field(FILE *f, const char *filename, char *buf, size_t len) {
+	assert(f!=NULL);
+	assert(len>2);
+	if(!fgets(buf, len, f)) {
+		if(ferror(f)) {
+			perror(filename);
+		}
+		return 0; /* EOF or Error */
+	}
 
-	assert(key!=NULL);
+	if(!scrubnl(buf)) {
+		int ch;
+		fprintf(stderr, "Truncated record in %s\n", filename);
+		/* eat the remaining line */
+		do {
+			ch=fgetc(f);
+		} while(ch!=EOF && ch!='\n');
+	}
 
-	/* search for duplicate */
-	for(curr=head;!UDB_IS_EMPTY(curr);curr=curr->next) {
-		assert(curr!=NULL);
-		assert(curr->key!=NULL);
-		if(strcmp(key, curr->key)==0) {
-			return 1; /* found duplicate */
+	if(buf[0]=='%' && buf[1]==0) {
+		return 0; /* end of record */
+	}
+
+	return 1; /* success */
+}
+
+/** a key found by a build_chunk, waiting to be merged into the index */
+struct parsed_key {
+	char *key;
+	unsigned hash;
+	off_t ofs;
+	int deleted; /* a tombstone, the key is removed from here on */
+};
+
+/** one slice of the file, parsed by one thread. every record that starts
+ * at or after start and before end belongs to this chunk. */
+struct build_chunk {
+	const char *filename;
+	int (*parse_key_cb)(const char *line, char *key_out, size_t max);
+	off_t start, end;
+	struct parsed_key *keys;
+	unsigned nr_keys, max_keys;
+	int failed;
+	pthread_t thread;
+};
+
+static int chunk_push(struct build_chunk *c, const char *key, off_t ofs, int deleted) {
+	if(c->nr_keys>=c->max_keys) {
+		struct parsed_key *tmp;
+		unsigned newmax=c->max_keys?c->max_keys*2:1024;
+		tmp=realloc(c->keys, newmax * sizeof *tmp);
+		if(!tmp) {
+			perror("realloc()");
+			return 0;
 		}
+		c->keys=tmp;
+		c->max_keys=newmax;
 	}
-	return 0; /* no duplicate found */
+	c->keys[c->nr_keys].key=strdup(key);
+	if(!c->keys[c->nr_keys].key) {
+		perror("strdup()");
+		return 0;
+	}
+	c->keys[c->nr_keys].hash=strsiphash(key);
+	c->keys[c->nr_keys].ofs=ofs;
+	c->keys[c->nr_keys].deleted=deleted;
+	c->nr_keys++;
+	return 1;
 }
 
-static int add_hash_entry(struct udb_handle *h, const char *key, fpos_t ofs) {
-	struct udb_ent *ent;
-	unsigned new_hash;
+/** key order, then file order for duplicates */
+static int parsed_key_cmp(const void *a, const void *b) {
+	const struct parsed_key *x=a, *y=b;
+	int ret;
+
+	ret=strcmp(x->key, y->key);
+	if(ret) return ret;
+	return x->ofs<y->ofs ? -1 : x->ofs>y->ofs;
+}
+
+/** parse the keys of every record in a chunk. runs on a build thread, with
+ * its own stream so the chunks don't fight over a file position. */
+static void *parse_chunk(void *p) {
+	struct build_chunk *c=p;
+	char line[LINE_MAX];
+	char key[KEY_MAX];
+	FILE *f;
+
+	f=fopen(c->filename, "r");
+	if(!f) {
+		perror(c->filename);
+		c->failed=1;
+		return 0;
+	}
+	if(fseeko(f, c->start, SEEK_SET)) {
+		perror(c->filename);
+		fclose(f);
+		c->failed=1;
+		return 0;
+	}
+
+	do{
+		off_t tmp_ofs;
+
+		/* save the record's start position */
+		if((tmp_ofs=ftello(f))==-1) {
+			perror(c->filename);
+			c->failed=1;
+			break;
+		}
+		if(tmp_ofs>=c->end) {
+			break; /* the next chunk starts here */
+		}
+
+		/* read first line. this has the key */
+		if(read_field(f, c->filename, line, LINE_MAX)) {
+
+			/* parse the first line */
+			if(!strncmp(line, TOMBSTONE, strlen(TOMBSTONE))) {
+				if(!chunk_push(c, line+strlen(TOMBSTONE), tmp_ofs, 1)) {
+					c->failed=1;
+					break;
+				}
+			} else if(c->parse_key_cb(line, key, KEY_MAX)) {
+				if(!chunk_push(c, key, tmp_ofs, 0)) {
+					c->failed=1;
+					break;
+				}
+			} else {
+				fprintf(stderr, "Key parse error in DB file %s (ignoring record)\n", c->filename);
+			}
+
+			/* swallow remaining records, looking for next record */
+			while(read_field(f, c->filename, line, LINE_MAX)) {
+				/* do nothing */
+			}
+		}
+	/* repeat until there is an error or EOF */
+	} while(!feof(f) && !ferror(f));
+
+	if(ferror(f)) {
+		c->failed=1;
+	}
+	fclose(f);
+
+	/* sort here so the merge only has to interleave the chunks */
+	qsort(c->keys, c->nr_keys, sizeof *c->keys, parsed_key_cmp);
+	return 0;
+}
+
+/** find the first record that starts at or after ofs.
+ * a record starts the line after a line holding just "%" */
+static off_t next_record(FILE *f, off_t ofs, off_t size) {
+	char line[LINE_MAX];
+	int at_bol;
+	size_t n;
+
+	if(ofs<=0) return 0;
+
+	/* the line containing ofs-1 belongs to the previous chunk */
+	if(fseeko(f, ofs-1, SEEK_SET)) {
+		return -1;
+	}
+	at_bol=0;
+	while(fgets(line, sizeof line, f)) {
+		n=strlen(line);
+		if(at_bol && n==2 && line[0]=='%' && line[1]=='\n') {
+			return ftello(f);
+		}
+		at_bol=n>0 && line[n-1]=='\n';
+	}
+	return ferror(f) ? -1 : size;
+}
+
+/** how many threads to use for building an index of a size byte file.
+ * max_threads of 0 means one per processor. chunk_min is the smallest slice
+ * worth its own thread */
+static unsigned build_threads(off_t size, unsigned max_threads, off_t chunk_min) {
+	long cpus;
+	unsigned n;
+
+	if(!max_threads) {
+		cpus=sysconf(_SC_NPROCESSORS_ONLN);
+		max_threads=cpus<1 ? 1 : cpus;
+	}
+	n=max_threads>MAX_BUILD_THREADS ? MAX_BUILD_THREADS : max_threads;
+	/* don't bother splitting small files */
+	if(size/chunk_min<(off_t)n) n=size/chunk_min;
+	return n ? n : 1;
+}
+
+/** build a complete index for filename.
+ * the file is split into chunks at record separators and the keys of each
+ * chunk are parsed and sorted on their own thread, so parse_key_cb must be
+ * thread safe. the sorted chunks are then merged into the keystore. when a
+ * key appears more than once the last record wins, which is how udb_put()
+ * and udb_delete() replace records. two versions of a key without a
+ * tombstone between them get a warning, only an edit by hand does that.
+ * the handle is not touched, so this is safe to run while lookups continue
+ * against the current generation.
+ * returns NULL on failure */
+static struct udb_index *build_index(const char *filename, int (*parse_key_cb)(const char *line, char *key_out, size_t max), unsigned bloom_bits, unsigned max_threads, off_t chunk_min) {
+	struct build_chunk chunks[MAX_BUILD_THREADS];
+	unsigned nr_chunks, i, j, total;
+	struct udb_index *idx;
+	int failed=0;
+
+	assert(filename!=NULL);
+	assert(parse_key_cb!=NULL);
+
+	idx=calloc(1, sizeof *idx);
+	if(!idx) {
+		perror("calloc()");
+		return 0;
+	}
+
+	idx->f=fopen(filename, "r");
+	if(!idx->f) {
+		perror(filename);
+		free(idx);
+		return 0;
+	}
+
+	if(fstat(fileno(idx->f), &idx->last_stat)) {
+		perror(filename);
+		/* ignore the error */
+	}
+
+	/* TODO: lock the file before we read it in */
+
+	/* split the file at record boundaries */
+	memset(chunks, 0, sizeof chunks);
+	nr_chunks=build_threads(idx->last_stat.st_size, max_threads, chunk_min);
+	for(i=0;i<nr_chunks;i++) {
+		chunks[i].filename=filename;
+		chunks[i].parse_key_cb=parse_key_cb;
+		chunks[i].start=i ? chunks[i-1].end : 0;
+		chunks[i].end=i+1<nr_chunks ? next_record(idx->f, idx->last_stat.st_size/nr_chunks*(i+1), idx->last_stat.st_size) : idx->last_stat.st_size;
+		if(chunks[i].end<0) {
+			perror(filename);
+			free_index(idx);
+			return 0;
+		}
+		if(chunks[i].end<chunks[i].start) {
+			chunks[i].end=chunks[i].start; /* the previous chunk ate this one */
+		}
+	}
+	/* records appended after fstat() are left for the delta */
+	idx->indexed_end=idx->last_stat.st_size;
+
+	/* the first chunk is parsed on this thread */
+	for(i=1;i<nr_chunks;i++) {
+		if(pthread_create(&chunks[i].thread, 0, parse_chunk, &chunks[i])) {
+			perror("pthread_create()");
+			parse_chunk(&chunks[i]); /* do it ourselves */
+			chunks[i].thread=pthread_self();
+		}
+	}
+	parse_chunk(&chunks[0]);
+	for(i=1;i<nr_chunks;i++) {
+		if(!pthread_equal(chunks[i].thread, pthread_self())) {
+			pthread_join(chunks[i].thread, 0);
+		}
+	}
+
+	for(i=total=0;i<nr_chunks;i++) {
+		failed|=chunks[i].failed;
+		total+=chunks[i].nr_keys;
+	}
+
+	if(!failed) {
+		unsigned next[MAX_BUILD_THREADS];
+		struct parsed_key *live;
+
+		bloom_init(&idx->bloom, total, bloom_bits);
+		keystore_init(&idx->keys);
+
+		/* merge the sorted chunks. equal keys come out in file order, and
+		 * the last of them is the live one. */
+		memset(next, 0, sizeof next);
+		for(live=0;;) {
+			struct parsed_key *pk=0;
+			unsigned best=0;
+
+			for(i=0;i<nr_chunks;i++) {
+				if(next[i]<chunks[i].nr_keys && (!pk || strcmp(chunks[i].keys[next[i]].key, pk->key)<0)) {
+					pk=&chunks[i].keys[next[i]];
+					best=i;
+				}
+			}
+
+			if(live && pk && !live->deleted && !pk->deleted && !strcmp(live->key, pk->key)) {
+				/* udb_put() deletes the old version before writing a new
+				 * one, so this was put there by hand */
+				fprintf(stderr, "Duplicate key '%s' found in DB file %s (using the last one)\n", pk->key, filename);
+			}
+			if(live && (!pk || strcmp(live->key, pk->key))) {
+				/* no newer version of live, add it */
+				if(live->deleted) {
+					idx->dead_count++; /* the tombstone itself */
+				} else if(!keystore_add(&idx->keys, live->key, live->ofs)) {
+					fprintf(stderr, "Could not index key '%s' in DB file %s\n", live->key, filename);
+					failed=1;
+					break;
+				} else {
+					bloom_add(&idx->bloom, live->hash);
+				}
+			} else if(live) {
+				idx->dead_count++; /* replaced by pk */
+			}
+			if(!pk) break;
+			next[best]++;
+			live=pk;
+		}
+		keystore_finish(&idx->keys);
+		idx->record_count=idx->keys.nr_keys;
+	}
+
+	/* the keystore has its own copy of the keys */
+	for(i=0;i<nr_chunks;i++) {
+		for(j=0;j<chunks[i].nr_keys;j++) {
+			free(chunks[i].keys[j].key);
+		}
+		free(chunks[i].keys);
+	}
+
+	if(failed) {
+		free_index(idx);
+		return 0;
+	}
+
+	return idx;
+}
+
+/** hash bucket in the delta for key */
+static struct udb_delta **delta_bucket(struct udb_handle *h, const char *key) {
+	return &h->delta[strsiphash(key)%DELTA_SZ];
+}
+
+static struct udb_delta *delta_find(struct udb_handle *h, const char *key) {
+	struct udb_delta *curr;
+
+	for(curr=*delta_bucket(h, key);curr;curr=curr->next) {
+		if(!strcmp(curr->key, key)) {
+			return curr;
+		}
+	}
+	return 0; /* not written since the last reload */
+}
+
+/** remember the newest version of key.
+ * return 0 on out of memory */
+static int delta_set(struct udb_handle *h, const char *key, off_t ofs, int deleted) {
+	struct udb_delta *d, **head;
+
+	d=delta_find(h, key);
+	if(!d) {
+		d=calloc(1, sizeof *d);
+		if(!d || !(d->key=strdup(key))) {
+			perror("malloc()");
+			free(d);
+			return 0;
+		}
+		head=delta_bucket(h, key);
+		d->next=*head;
+		*head=d;
+		h->nr_delta++;
+	}
+	d->ofs=ofs;
+	d->deleted=deleted;
+	return 1;
+}
+
+/** forget writes at offsets before end, they are in the index now.
+ * 0 forgets everything */
+static void delta_prune(struct udb_handle *h, off_t end) {
+	struct udb_delta **prev, *curr;
+	unsigned i;
+
+	for(i=0;i<DELTA_SZ;i++) {
+		for(prev=&h->delta[i];(curr=*prev);) {
+			if(end && curr->ofs>=end) {
+				prev=&curr->next;
+				continue;
+			}
+			*prev=curr->next;
+			free(curr->key);
+			free(curr);
+			h->nr_delta--;
+		}
+	}
+	if(!h->nr_delta) {
+		h->nr_dead=0; /* all counted by the index now */
+	}
+}
+
+/** make idx the current generation and throw out the old one */
+static void swap_index(struct udb_handle *h, struct udb_index *idx) {
+	struct udb_index *old;
 
 	assert(h!=NULL);
-	assert(key!=NULL);
+	assert(idx!=NULL);
+
+	idx->generation=++h->generation;
+	h->build_failed=0;
+	old=h->idx;
+	h->idx=idx;
+	if(old->last_stat.st_ino!=idx->last_stat.st_ino) {
+		delta_prune(h, 0); /* a different file, the offsets mean nothing */
+	} else {
+		delta_prune(h, idx->indexed_end);
+	}
+	free_index(old);
 
-	/* add new record */
-	new_hash=strhash(key)%HASH_SZ;
-	ent=&h->hash[new_hash];
+	fprintf(stderr, "Loaded %d records from DB %s\n", idx->record_count, h->filename);
+}
 
-	if(find_dup(ent, key)) {
-		fprintf(stderr, "Duplicate key '%s' found in DB file %s\n", key, h->filename);
-		return 0; /* failure */
+static void *build_worker(void *p) {
+	struct udb_handle *h=p;
+	struct udb_index *idx;
+
+	idx=build_index(h->filename, h->parse_key_cb, h->bloom_bits, h->build_threads, h->chunk_min);
+
+	pthread_mutex_lock(&h->lock);
+	h->pending=idx;
+	h->build_done=1;
+	pthread_mutex_unlock(&h->lock);
+	return 0;
+}
+
+/** wait for a background build to finish and install its result */
+static void finish_build(struct udb_handle *h) {
+	struct udb_index *idx;
+
+	assert(h!=NULL);
+	assert(h->building);
+
+	pthread_join(h->worker, 0);
+	h->building=0;
+	h->build_done=0;
+	idx=h->pending;
+	h->pending=0;
+
+	if(idx) {
+		swap_index(h, idx);
+	} else {
+		note_failed_build(h);
 	}
+}
 
-	/* at the end of this bit, ent points to the entry to fill in */
-	/* right now ent points to the h->hash[new_hash] */
-	if(!UDB_IS_EMPTY(ent)) { /* detected collision, create linked list entry */
-		struct udb_ent *new_ent;
-		new_ent=malloc(sizeof *new_ent);
-		/* push onto the list */
-		new_ent->next=ent->next; /* save start of linked list */
-		ent->next=new_ent; /* push as the new start */
-		ent=new_ent; /* now ent is the entry to fill in below */
+/** copy the live records listed in compact_ofs to compact_tmp.
+ * runs on the compactor thread, with its own stream */
+static void *compact_worker(void *p) {
+	struct udb_handle *h=p;
+	char line[LINE_MAX];
+	FILE *in, *out;
+	unsigned i;
+	int failed=0;
+
+	in=fopen(h->filename, "r");
+	out=fopen(h->compact_tmp, "w");
+	if(!in || !out) {
+		perror(!in ? h->filename : h->compact_tmp);
+		failed=1;
+	}
+
+	for(i=0;!failed && i<h->compact_nr;i++) {
+		if(fseeko(in, h->compact_ofs[i], SEEK_SET)) {
+			perror(h->filename);
+			failed=1;
+			break;
+		}
+		while(read_field(in, h->filename, line, LINE_MAX)) {
+			fprintf(out, "%s\n", line);
+		}
+		fputs("%\n", out);
+		failed|=ferror(in) || ferror(out);
 	}
 
-	/* fill in ent */
-	ent->key=strdup(key);
-	ent->ofs=ofs;
+	if(out) {
+		if(fflush(out) || fsync(fileno(out))) {
+			perror(h->compact_tmp);
+			failed=1;
+		}
+		fclose(out);
+	}
+	if(in) {
+		fclose(in);
+	}
 
-	return 1; /* success */
+	pthread_mutex_lock(&h->lock);
+	h->compact_failed=failed;
+	h->compact_done=1;
+	pthread_mutex_unlock(&h->lock);
+	return 0;
+}
+
+/** append src from ofs to the end onto dst */
+static int copy_tail(const char *src, off_t ofs, const char *dst) {
+	char buf[LINE_MAX];
+	FILE *in, *out;
+	size_t n;
+	int ret=1;
+
+	in=fopen(src, "r");
+	out=fopen(dst, "a");
+	if(!in) {
+		perror(src);
+		ret=0;
+	} else if(!out) {
+		perror(dst);
+		ret=0;
+	} else if(fseeko(in, ofs, SEEK_SET)) {
+		perror(src);
+		ret=0;
+	}
+	/* the first write after the snapshot starts with a separator, which
+	 * the compacted file already ends in */
+	if(ret && fgets(buf, sizeof buf, in)) {
+		if(strcmp(buf, "\n") && strcmp(buf, "%\n")) {
+			fputs(buf, out);
+		} else if(!strcmp(buf, "\n") && fgets(buf, sizeof buf, in) && strcmp(buf, "%\n")) {
+			fputs(buf, out);
+		}
+	}
+	while(ret && (n=fread(buf, 1, sizeof buf, in))>0) {
+		if(fwrite(buf, 1, n, out)!=n) {
+			perror(dst);
+			ret=0;
+		}
+	}
+	if(in) {
+		ret&=!ferror(in);
+		fclose(in);
+	}
+	if(out) {
+		if(fflush(out) || fsync(fileno(out))) {
+			perror(dst);
+			ret=0;
+		}
+		fclose(out);
+	}
+	return ret;
+}
+
+/** install the compacted file.
+ * anything written while the compactor ran is copied over first, so
+ * writes never have to wait for a compaction. */
+static void finish_compact(struct udb_handle *h) {
+	assert(h!=NULL);
+	assert(h->compacting);
+
+	pthread_join(h->compactor, 0);
+	h->compacting=0;
+	h->compact_done=0;
+	free(h->compact_ofs);
+	h->compact_ofs=0;
+
+	if(h->compact_failed || !copy_tail(h->filename, h->compact_end, h->compact_tmp)
+		|| rename(h->compact_tmp, h->filename)) {
+		fprintf(stderr, "Compacting DB %s failed\n", h->filename);
+		unlink(h->compact_tmp);
+	} else {
+		/* the write descriptor and the delta belong to the old file */
+		if(h->wfd!=-1) {
+			close(h->wfd);
+			h->wfd=-1;
+		}
+		delta_prune(h, 0);
+		udb_refresh(h);
+	}
+	free(h->compact_tmp);
+	h->compact_tmp=0;
+}
+
+/** checks if the DB file has been altered since we last loaded,
+ * then reloads the database. */
+static void refresh_if_changed(struct udb_handle *h) {
+	int done;
+
+	assert(h!=NULL);
+
+	if(h->building) {
+		pthread_mutex_lock(&h->lock);
+		done=h->build_done;
+		pthread_mutex_unlock(&h->lock);
+		if(!done) {
+			return; /* keep serving the current generation */
+		}
+		finish_build(h);
+	}
+
+	if(h->compacting) {
+		pthread_mutex_lock(&h->lock);
+		done=h->compact_done;
+		pthread_mutex_unlock(&h->lock);
+		if(done) {
+			finish_compact(h);
+			return;
+		}
+	}
+
+	/* a file that couldn't be loaded stays unloaded until someone fixes it */
+	if(same_failed_file(h)) {
+		return;
+	}
+
+	/* our own writes don't count as changes, but the delta shouldn't grow
+	 * without limit */
+	if(!file_has_changed(h->filename, h->idx) && h->nr_delta<DELTA_MAX) {
+		return;
+	}
+
+	fprintf(stderr, "Refreshing DB for %s\n", h->filename);
+
+	/* the very first load has nothing to serve in the mean time */
+	if(h->background && h->generation>0) {
+		h->build_done=0;
+		if(!pthread_create(&h->worker, 0, build_worker, h)) {
+			h->building=1;
+			return;
+		}
+		perror("pthread_create()");
+		/* fall through and do it the slow way */
+	}
+	udb_refresh(h);
 }
 
 /** uses filename for backing of a database, and parse_key() call back is
@@ -178,6 +806,9 @@ static int add_hash_entry(struct udb_handle *h, const char *key, fpos_t ofs) {
  *
  * parse_key_cb callback takes in line, and writes to key_out (up to max
  * characters) as the unique key for this record in the database.
+ * large files are indexed by several threads at once, so parse_key_cb may
+ * be called concurrently from threads other than the caller's. it must
+ * only use its arguments and locals (no static buffers, no strtok()).
  *
  * if parse_key_cb is NULL then use generic_parse_key() function.
  */
@@ -186,144 +817,687 @@ struct udb_handle *udb_open(const char *filename, int (*parse_key_cb)(const char
 
 	assert(filename!=NULL);
 
-	ret=malloc(sizeof *ret);
+	ret=calloc(1, sizeof *ret);
 	if(!ret) {
-		perror("malloc()");
+		perror("calloc()");
 		return 0;
 	}
-	ret->f=fopen(filename, "r");
-	if(!ret->f) {
+	/* generation 0 is an empty index. its zeroed stat forces a load on the
+	 * first lookup */
+	ret->idx=calloc(1, sizeof *ret->idx);
+	if(!ret->idx) {
+		perror("calloc()");
+		free(ret);
+		return 0;
+	}
+	ret->idx->f=fopen(filename, "r");
+	if(!ret->idx->f) {
 		perror(filename);
+		free(ret->idx);
 		free(ret);
 		return 0; /* failed */
 	}
 	ret->filename=strdup(filename);
 	ret->parse_key_cb=parse_key_cb?parse_key_cb:generic_parse_key;
-	memset(ret->hash, 0, sizeof ret->hash);
-	memset(&ret->last_stat, 0, sizeof ret->last_stat);
+	ret->wfd=-1;
+	ret->chunk_min=CHUNK_MIN;
+	pthread_mutex_init(&ret->lock, 0);
 	/* (uncomment to force refresh on load)
-	update_stat(ret);
 	udb_refresh(ret);
 	*/
 	return ret;
 }
 
-/** force a refresh */
+/** rebuild changed files on a worker thread instead of inside udb_lookup().
+ * lookups are served from the previous generation until the new one is
+ * ready. parse_key_cb is then called from the worker thread.
+ */
+void udb_set_background(struct udb_handle *h, int enable) {
+	assert(h!=NULL);
+	h->background=enable;
+}
+
+/** use up to max_threads threads (0 for one per processor) to build an
+ * index, giving each at least chunk_min bytes of the file (0 for the
+ * default of 4MB). smaller chunks make even small files take the
+ * multi-threaded path, test/test-udb.c uses that. takes effect on the next
+ * reload.
+ */
+void udb_set_build_threads(struct udb_handle *h, unsigned max_threads, off_t chunk_min) {
+	assert(h!=NULL);
+	h->build_threads=max_threads;
+	h->chunk_min=chunk_min>0 ? chunk_min : CHUNK_MIN;
+}
+
+/** put a bloom filter with bits_per_key bits for each record in front of
+ * the key search. 10 bits per key gives about 1% false positives, 0 turns
+ * the filter off. takes effect on the next reload.
+ */
+void udb_set_bloom(struct udb_handle *h, unsigned bits_per_key) {
+	assert(h!=NULL);
+	h->bloom_bits=bits_per_key;
+}
+
+/** fill in st with counters for the handle and its current generation */
+void udb_get_stats(struct udb_handle *h, struct udb_stats *st) {
+	unsigned long negatives;
+
+	assert(h!=NULL);
+	assert(st!=NULL);
+
+	memset(st, 0, sizeof *st);
+	st->generation=h->generation;
+	st->records=h->idx->record_count;
+	st->dead_records=h->idx->dead_count+h->nr_dead;
+	st->pending_writes=h->nr_delta;
+	st->index_bytes=keystore_bytes(&h->idx->keys);
+	st->lookups=h->nr_lookups;
+	st->hits=h->nr_hits;
+	st->bloom_bytes=(h->idx->bloom.nbits+7)/8;
+	st->bloom_rejects=h->nr_bloom_rejects;
+	st->bloom_false_positives=h->nr_bloom_fp;
+	st->bloom_fp_expected=bloom_fp_rate(&h->idx->bloom);
+	negatives=h->nr_bloom_rejects+h->nr_bloom_fp;
+	if(negatives) {
+		st->bloom_fp_measured=(double)h->nr_bloom_fp/negatives;
+	}
+}
+
+/** current generation number. it changes every time a reload completes or
+ * a record is written. a change to the file is looked for first, so
+ * something cached against the number is dropped as soon as it can be */
+unsigned udb_generation(struct udb_handle *h) {
+	assert(h!=NULL);
+	refresh_if_changed(h);
+	return h->generation;
+}
+
+/** force a refresh.
+ * the new index is built before the old one is released. if the build
+ * fails the current generation stays in place.
+ */
 void udb_refresh(struct udb_handle *h) {
-	char line[LINE_MAX];
-	char key[KEY_MAX];
-	int record_count=0;
+	struct udb_index *idx;
 
 	assert(h!=NULL);
-	assert(h->f!=NULL);
 
-	fclose(h->f);
-	free_hash(h); /* throw out old hash table */
-	/* reopen the file */
-	h->f=fopen(h->filename, "r");
-	if(!h->f) {
-		perror(h->filename);
-		fprintf(stderr, "Fatal error in DB for %s!\n", h->filename);
+	if(h->building) {
+		finish_build(h); /* don't race the worker */
+	}
+
+	idx=build_index(h->filename, h->parse_key_cb, h->bloom_bits, h->build_threads, h->chunk_min);
+	if(!idx) {
+		note_failed_build(h);
 		return;
 	}
+	swap_index(h, idx);
+}
 
-	update_stat(h);
+/** find the first live key starting with prefix, in the index or the delta.
+ * return 0 if there is none */
+static int find_prefix(struct udb_handle *h, const char *prefix, off_t *ofs) {
+	struct keystore_iter it;
+	struct udb_delta *d, *curr;
+	const char *best=0;
+	size_t len;
+	unsigned i;
+
+	len=strlen(prefix);
+	if(keystore_seek(&it, &h->idx->keys, prefix)) do {
+		if(strncmp(it.key, prefix, len)) {
+			break; /* past the keys that start with prefix */
+		}
+		d=h->nr_delta ? delta_find(h, it.key) : 0;
+		if(!d) {
+			best=it.key;
+			*ofs=h->idx->keys.ofs[it.i];
+			break;
+		} else if(!d->deleted) {
+			best=it.key;
+			*ofs=d->ofs;
+			break;
+		}
+	} while(keystore_next(&it));
+
+	/* keys that are only in the delta */
+	for(i=0;h->nr_delta && i<DELTA_SZ;i++) {
+		for(curr=h->delta[i];curr;curr=curr->next) {
+			if(!curr->deleted && !strncmp(curr->key, prefix, len) && (!best || strcmp(curr->key, best)<0)) {
+				best=curr->key;
+				*ofs=curr->ofs;
+			}
+		}
+	}
+	return best!=0;
+}
 
-	/* TODO: lock the file before we read it in */
+/** find the record for key in the current generation, updating the
+ * counters. a key ending in '*' matches the first key that starts with the
+ * rest of it.
+ * return 0 if not found */
+static int find_entry(struct udb_handle *h, const char *key, off_t *ofs) {
+	struct udb_delta *d;
+	unsigned key_hash;
+	size_t len;
 
-	do{
-		fpos_t tmp_ofs;
+	assert(h!=NULL);
+	assert(key!=NULL);
 
-		/* save the record's start position */
-		if(fgetpos(h->f, &tmp_ofs)) {
-			perror(h->filename);
-			fprintf(stderr, "Fatal error in DB for %s!\n", h->filename);
-			return;
-		}
+	h->nr_lookups++;
 
-		/* read first line. this has the key */
-		if(udb_read_field(h, line, LINE_MAX)) {
+	len=strlen(key);
+	if(len>0 && key[len-1]=='*') {
+		char prefix[KEY_MAX];
 
-			/* parse the first line */
-			if(h->parse_key_cb(line, key, KEY_MAX)) {
-				add_hash_entry(h, key, tmp_ofs);
-				record_count++;
-			} else {
-				fprintf(stderr, "Key parse error in DB file %s (ignoring record)\n", h->filename);
-			}
+		if(len>KEY_MAX) {
+			return 0; /* can't be in here */
+		}
+		memcpy(prefix, key, len-1);
+		prefix[len-1]=0;
+		if(!find_prefix(h, prefix, ofs)) {
+			return 0; /* nothing starts with prefix */
+		}
+		h->nr_hits++;
+		return 1; /* found */
+	}
 
-			/* swallow remaining records, looking for next record */
-			while(udb_ignore_field(h)) {
-				/* do nothing */
-			}
+	if(h->nr_delta && (d=delta_find(h, key))) {
+		if(d->deleted) {
+			return 0; /* deleted since the last reload */
 		}
-	/* repeat until there is an error or EOF */
-	} while(!feof(h->f) && !ferror(h->f));
+		h->nr_hits++;
+		*ofs=d->ofs;
+		return 1; /* written since the last reload */
+	}
 
-	fprintf(stderr, "Loaded %d records from DB %s\n", record_count, h->filename);
+	key_hash=strsiphash(key);
+	if(!bloom_check(&h->idx->bloom, key_hash)) {
+		h->nr_bloom_rejects++;
+		return 0; /* definitely not in the database */
+	}
+
+	if(keystore_find(&h->idx->keys, key, ofs)) {
+		h->nr_hits++;
+		return 1; /* found the entry */
+	}
+	if(h->idx->bloom.bits) {
+		h->nr_bloom_fp++; /* filter let a miss through */
+	}
+	return 0; /* not found */
 }
 
-/** look up an entry in the hash and position the database cursor to it.
+/** look up an entry and position the database cursor to it.
+ * if key ends in '*' the first record whose key starts with the rest of
+ * key is used.
  * return 0 on failure (cursor is not repositioned)
  * return non-zero on success (cursor points to start of record)
  */
 int udb_lookup(struct udb_handle *h, const char *key) {
-	struct udb_ent *curr;
-	unsigned new_hash;
+	off_t ofs;
+
+	assert(h!=NULL);
+	assert(key!=NULL);
+
+	refresh_if_changed(h);
+
+	if(!find_entry(h, key, &ofs)) {
+		return 0; /* failure */
+	}
+	if(fseeko(h->idx->f, ofs, SEEK_SET)) {
+		perror(h->filename);
+		fprintf(stderr, "Fatal error in DB for %s!\n", h->filename);
+		return 0; /* failure */
+	}
+	return 1; /* success */
+}
+
+/** return non-zero if key has a live record, without touching the counters */
+static int is_live(struct udb_handle *h, const char *key) {
+	struct udb_delta *d;
+
+	if(h->nr_delta && (d=delta_find(h, key))) {
+		return !d->deleted;
+	}
+	return keystore_find(&h->idx->keys, key, 0);
+}
+
+/** append a complete record to the end of the file, after a separator if
+ * the file doesn't already end in one. the record is written with a single
+ * write() so a concurrent reload never sees half of it.
+ * return 0 on failure, else ofs is where the record starts */
+static int append_record(struct udb_handle *h, const char *rec, size_t len, off_t *ofs) {
+	struct stat st, wst;
+	char tail[3];
+	const char *sep;
+	size_t sep_len, n;
+	char *buf;
+	ssize_t res;
+
+	/* (re)open if the file was replaced behind our back */
+	if(h->wfd!=-1 && (stat(h->filename, &st) || fstat(h->wfd, &wst) || st.st_ino!=wst.st_ino)) {
+		close(h->wfd);
+		h->wfd=-1;
+	}
+	if(h->wfd==-1) {
+		h->wfd=open(h->filename, O_RDWR|O_APPEND);
+		if(h->wfd==-1) {
+			perror(h->filename);
+			return 0;
+		}
+	}
+	if(fstat(h->wfd, &st)) {
+		perror(h->filename);
+		return 0;
+	}
+
+	sep="";
+	if(st.st_size>0) {
+		n=st.st_size<3 ? st.st_size : 3;
+		if(pread(h->wfd, tail, n, st.st_size-n)!=(ssize_t)n) {
+			perror(h->filename);
+			return 0;
+		}
+		if(n>=2 && tail[n-2]=='%' && tail[n-1]=='\n' && (n==2 || tail[0]=='\n')) {
+			sep=""; /* already ends with a separator */
+		} else if(tail[n-1]=='\n') {
+			sep="%\n";
+		} else {
+			sep="\n%\n";
+		}
+	}
+	sep_len=strlen(sep);
+
+	buf=malloc(sep_len+len);
+	if(!buf) {
+		perror("malloc()");
+		return 0;
+	}
+	memcpy(buf, sep, sep_len);
+	memcpy(buf+sep_len, rec, len);
+	res=write(h->wfd, buf, sep_len+len);
+	free(buf);
+	if(res!=(ssize_t)(sep_len+len)) {
+		if(res<0) {
+			perror(h->filename);
+		} else {
+			fprintf(stderr, "Short write to DB file %s\n", h->filename);
+		}
+		return 0;
+	}
+	*ofs=st.st_size+sep_len;
+
+	/* our own write doesn't need a reload, the delta covers it */
+	if(!fstat(h->wfd, &wst) && wst.st_ino==h->idx->last_stat.st_ino) {
+		h->idx->last_stat.st_mtime=wst.st_mtime;
+	}
+	return 1;
+}
+
+/** add or replace a record. fields[0] is the first line and is passed to
+ * parse_key_cb for the key. the record is appended to the file and the old
+ * version, if any, becomes dead space until udb_compact(). a replacement is
+ * written after a tombstone for the old version, so a reload can tell it
+ * from a duplicate key.
+ * fields may not contain newlines, or be a lone "%".
+ * return 0 on failure */
+int udb_put(struct udb_handle *h, const char *const *fields, unsigned nr_fields) {
+	char key[KEY_MAX];
+	char *rec;
+	size_t len, tomb_len;
+	unsigned i;
+	off_t ofs;
+	int existed, ret;
+
+	assert(h!=NULL);
+	assert(fields!=NULL);
+
+	if(!nr_fields) {
+		return 0; /* an empty record can't have a key */
+	}
+
+	refresh_if_changed(h);
+
+	for(i=len=0;i<nr_fields;i++) {
+		if(strchr(fields[i], '\n') || !strcmp(fields[i], "%")) {
+			fprintf(stderr, "Bad field for DB file %s\n", h->filename);
+			return 0;
+		}
+		len+=strlen(fields[i])+1;
+	}
+	if(!strncmp(fields[0], TOMBSTONE, strlen(TOMBSTONE)) || !h->parse_key_cb(fields[0], key, KEY_MAX)) {
+		fprintf(stderr, "Key parse error for DB file %s\n", h->filename);
+		return 0;
+	}
+
+	existed=is_live(h, key);
+	tomb_len=existed ? strlen(TOMBSTONE)+strlen(key)+3 : 0;
+
+	rec=malloc(tomb_len+len+3);
+	if(!rec) {
+		perror("malloc()");
+		return 0;
+	}
+	if(existed) {
+		sprintf(rec, "%s%s\n%%\n", TOMBSTONE, key);
+	}
+	for(i=0,len=tomb_len;i<nr_fields;i++) {
+		len+=sprintf(rec+len, "%s\n", fields[i]);
+	}
+	memcpy(rec+len, "%\n", 2);
+	len+=2;
+
+	/* the tombstone and the record go out in the same write() */
+	ret=append_record(h, rec, len, &ofs) && delta_set(h, key, ofs+tomb_len, 0);
+	free(rec);
+	if(!ret) {
+		return 0;
+	}
+	if(existed) {
+		h->nr_dead+=2; /* the old record and the tombstone */
+	}
+	h->generation++;
+	return 1;
+}
+
+/** remove key by appending a tombstone record.
+ * return 0 if key was not found or on failure */
+int udb_delete(struct udb_handle *h, const char *key) {
+	char rec[KEY_MAX+16];
+	off_t ofs;
+	int len;
 
 	assert(h!=NULL);
 	assert(key!=NULL);
 
 	refresh_if_changed(h);
 
-	/* TODO: if key ends in '*' use a partial string lookup method */
+	if(strchr(key, '\n') || !is_live(h, key)) {
+		return 0; /* not found */
+	}
 
-	new_hash=strhash(key)%HASH_SZ;
+	len=snprintf(rec, sizeof rec, "%s%s\n%%\n", TOMBSTONE, key);
+	if(len<0 || (size_t)len>=sizeof rec) {
+		return 0; /* too long to be a key */
+	}
+	if(!append_record(h, rec, len, &ofs) || !delta_set(h, key, ofs, 1)) {
+		return 0;
+	}
+	h->nr_dead+=2; /* the old record and the tombstone */
+	h->generation++;
+	return 1;
+}
+
+static int ofs_cmp(const void *a, const void *b) {
+	const off_t *x=a, *y=b;
+	return *x<*y ? -1 : *x>*y;
+}
+
+/** rewrite the file without dead records, on a background thread.
+ * the compacted copy is put in place by a later udb_lookup() or write,
+ * along with anything written in the mean time.
+ * return 0 if a compaction could not be started */
+int udb_compact(struct udb_handle *h) {
+	struct keystore_iter it;
+	struct udb_delta *d;
+	struct stat st;
+	unsigned i, max;
 
-	for(curr=&h->hash[new_hash];!UDB_IS_EMPTY(curr);curr=curr->next) {
-		assert(curr!=NULL);
-		assert(curr->key!=NULL);
-		if(strcmp(curr->key, key)==0) {
-			/* found the entry */
-			if(fsetpos(h->f, &curr->ofs)) {
-				perror(h->filename);
-				fprintf(stderr, "Fatal error in DB for %s!\n", h->filename);
-				return 0; /* failure */
+	assert(h!=NULL);
+
+	if(h->compacting) {
+		return 1; /* already on it */
+	}
+	refresh_if_changed(h);
+	/* the index has to describe the whole file, or records would be lost */
+	if(h->building || file_has_changed(h->filename, h->idx) || stat(h->filename, &st)) {
+		return 0;
+	}
+
+	/* list the live records */
+	max=h->idx->keys.nr_keys+h->nr_delta;
+	h->compact_ofs=malloc((max?max:1) * sizeof *h->compact_ofs);
+	h->compact_tmp=malloc(strlen(h->filename)+sizeof ".compact");
+	if(!h->compact_ofs || !h->compact_tmp) {
+		perror("malloc()");
+		free(h->compact_ofs);
+		free(h->compact_tmp);
+		h->compact_ofs=0;
+		h->compact_tmp=0;
+		return 0;
+	}
+	sprintf(h->compact_tmp, "%s.compact", h->filename);
+
+	h->compact_nr=0;
+	if(keystore_seek(&it, &h->idx->keys, "")) do {
+		d=h->nr_delta ? delta_find(h, it.key) : 0;
+		if(!d) {
+			h->compact_ofs[h->compact_nr++]=h->idx->keys.ofs[it.i];
+		}
+	} while(keystore_next(&it));
+	for(i=0;i<DELTA_SZ;i++) {
+		for(d=h->delta[i];d;d=d->next) {
+			if(!d->deleted) {
+				h->compact_ofs[h->compact_nr++]=d->ofs;
 			}
-			return 1; /* success */
 		}
 	}
-	return 0; /* failure */
+	/* keep the file order, and read it front to back */
+	qsort(h->compact_ofs, h->compact_nr, sizeof *h->compact_ofs, ofs_cmp);
+	h->compact_end=st.st_size;
+
+	h->compact_done=0;
+	h->compact_failed=0;
+	if(pthread_create(&h->compactor, 0, compact_worker, h)) {
+		perror("pthread_create()");
+		free(h->compact_ofs);
+		free(h->compact_tmp);
+		h->compact_ofs=0;
+		h->compact_tmp=0;
+		return 0;
+	}
+	h->compacting=1;
+	return 1;
 }
 
-/** read next field in the current record
- * return 0 when end of record is reached */
-int udb_read_field(struct udb_handle *h, char *buf, size_t len) {
+struct batch_ref {
+	off_t ofs;
+	unsigned i; /* index into the views */
+};
+
+static int batch_ref_cmp(const void *a, const void *b) {
+	const struct batch_ref *x=a, *y=b;
+
+	if(x->ofs!=y->ofs) return x->ofs<y->ofs ? -1 : 1;
+	return x->i<y->i ? -1 : x->i>y->i;
+}
+
+/** append a line and a newline to a growing buffer.
+ * return 0 on out of memory */
+static int batch_append(char **text, size_t *len, size_t *max, const char *line) {
+	size_t n;
+
+	n=strlen(line);
+	if(*len+n+1>*max) {
+		char *tmp;
+		size_t newmax=*max?*max*2:4096;
+		while(newmax<*len+n+1) newmax*=2;
+		tmp=realloc(*text, newmax);
+		if(!tmp) {
+			perror("realloc()");
+			return 0;
+		}
+		*text=tmp;
+		*max=newmax;
+	}
+	memcpy(*text+*len, line, n);
+	(*text)[*len+n]='\n';
+	*len+=n+1;
+	return 1;
+}
+
+/** look up many keys at once.
+ * the records are read in file order in a single forward pass rather than
+ * one seek per key. every view of the result points into one buffer owned
+ * by the batch; the key pointers are the caller's. a key that was not found
+ * gets a view with data==NULL. the udb_lookup() cursor is not preserved.
+ * free the result with udb_batch_free(). returns NULL on failure.
+ */
+struct udb_batch *udb_lookup_many(struct udb_handle *h, const char *const *keys, unsigned nr_keys) {
+	struct udb_batch *ret;
+	struct batch_ref *refs;
+	unsigned i, nr_refs;
+	size_t *starts;
+	size_t text_len=0, text_max=0;
+	char line[LINE_MAX];
+	FILE *f;
+
 	assert(h!=NULL);
-	assert(len>2);
-	if(!fgets(buf, len, h->f)) {
-		if(ferror(h->f)) {
+	assert(keys!=NULL || nr_keys==0);
+
+	refresh_if_changed(h);
+	f=h->idx->f;
+
+	ret=calloc(1, sizeof *ret + nr_keys * sizeof *ret->view);
+	refs=malloc((nr_keys?nr_keys:1) * sizeof *refs);
+	starts=malloc((nr_keys?nr_keys:1) * sizeof *starts);
+	if(!ret || !refs || !starts) {
+		perror("malloc()");
+		free(ret);
+		free(refs);
+		free(starts);
+		return 0;
+	}
+	ret->nr_views=nr_keys;
+
+	/* resolve keys to offsets */
+	for(i=nr_refs=0;i<nr_keys;i++) {
+		ret->view[i].key=keys[i];
+		if(find_entry(h, keys[i], &refs[nr_refs].ofs)) {
+			refs[nr_refs].i=i;
+			nr_refs++;
+		}
+	}
+
+	qsort(refs, nr_refs, sizeof *refs, batch_ref_cmp);
+
+	/* one pass over the file in offset order */
+	for(i=0;i<nr_refs;i++) {
+		struct udb_view *v=&ret->view[refs[i].i];
+
+		if(i>0 && refs[i].ofs==refs[i-1].ofs) {
+			/* same key asked for twice */
+			starts[refs[i].i]=starts[refs[i-1].i];
+			v->len=ret->view[refs[i-1].i].len;
+			continue;
+		}
+
+		/* adjacent records need no seek, which keeps stdio's buffer */
+		if(ftello(f)!=refs[i].ofs && fseeko(f, refs[i].ofs, SEEK_SET)) {
 			perror(h->filename);
+			fprintf(stderr, "Fatal error in DB for %s!\n", h->filename);
+			free(refs);
+			free(starts);
+			udb_batch_free(ret);
+			return 0;
 		}
-		return 0; /* EOF or Error */
+
+		starts[refs[i].i]=text_len;
+		while(read_field(f, h->filename, line, LINE_MAX)) {
+			if(!batch_append(&ret->text, &text_len, &text_max, line)) {
+				free(refs);
+				free(starts);
+				udb_batch_free(ret);
+				return 0;
+			}
+		}
+		v->len=text_len-starts[refs[i].i];
 	}
 
-	if(!scrubnl(buf)) {
-		int ch;
-		fprintf(stderr, "Truncated record in %s\n", h->filename);
-		/* eat the remaining line */
-		do {
-			ch=fgetc(h->f);
-		} while(ch!=EOF && ch!='\n');
+	/* the buffer has stopped moving, point the views into it */
+	for(i=0;i<nr_refs;i++) {
+		ret->view[refs[i].i].data=ret->text+starts[refs[i].i];
 	}
 
-	if(buf[0]=='%' && buf[1]==0) {
-		return 0; /* end of record */
+	free(refs);
+	free(starts);
+	return ret;
+}
+
+void udb_batch_free(struct udb_batch *b) {
+	if(!b) return;
+	free(b->text);
+	free(b);
+}
+
+/** find field n (0 is the first line of the record) in a view.
+ * return 0 if the record has fewer fields */
+int udb_view_field(const struct udb_view *v, unsigned n, const char **field, size_t *len) {
+	const char *p, *end, *nl;
+
+	assert(v!=NULL);
+	if(!v->data) return 0;
+
+	p=v->data;
+	end=v->data+v->len;
+	for(;p<end;p=nl+1) {
+		nl=memchr(p, '\n', end-p);
+		if(!nl) return 0; /* weirdness - every field ends in a newline */
+		if(!n--) {
+			*field=p;
+			*len=nl-p;
+			return 1; /* found */
+		}
 	}
+	return 0; /* not enough fields */
+}
+
+/** call cb for every key in the current generation, in strcmp() order.
+ * keys added since the last reload come after the others.
+ * stops early if cb returns 0.
+ * returns the number of keys visited */
+int udb_foreach(struct udb_handle *h, int (*cb)(void *p, const char *key), void *p) {
+	struct keystore_iter it;
+	struct udb_delta *d;
+	unsigned i;
+	int count=0;
+
+	assert(h!=NULL);
+	assert(cb!=NULL);
+
+	refresh_if_changed(h);
+
+	if(keystore_seek(&it, &h->idx->keys, "")) do {
+		d=h->nr_delta ? delta_find(h, it.key) : 0;
+		if(d && d->deleted) {
+			continue;
+		}
+		count++;
+		if(!cb(p, it.key)) {
+			return count;
+		}
+	} while(keystore_next(&it));
 
+	for(i=0;h->nr_delta && i<DELTA_SZ;i++) {
+		for(d=h->delta[i];d;d=d->next) {
+			if(d->deleted || keystore_find(&h->idx->keys, d->key, 0)) {
+				continue;
+			}
+			count++;
+			if(!cb(p, d->key)) {
+				return count;
+			}
+		}
+	}
+	return count;
+}
+
+/** read next field in the current record
+ * return 0 when end of record is reached */
+int udb_read_field(struct udb_handle *h, char *buf, size_t len) {
+	assert(h!=NULL);
 	/* TODO: lock while reading records. need an api to report when finished
 	 * with a record, or require that records always be fully read(bad idea) */
-	return 1; /* success */
+	return read_field(h->idx->f, h->filename, buf, len);
 }
 
 /** like udb_read_field, but don't save the data */
@@ -335,9 +1509,22 @@ int udb_ignore_field(struct udb_handle *h) {
 
 /** close and free all data */
 void udb_close(struct udb_handle *h) {
-	free_hash(h);
-	fclose(h->f);
-	h->f=0;
+	if(h->building) {
+		pthread_join(h->worker, 0);
+		free_index(h->pending);
+		h->pending=0;
+		h->building=0;
+	}
+	if(h->compacting) {
+		finish_compact(h); /* don't throw the work away */
+	}
+	if(h->wfd!=-1) {
+		close(h->wfd);
+	}
+	delta_prune(h, 0);
+	free_index(h->idx);
+	h->idx=0;
+	pthread_mutex_destroy(&h->lock);
 	free(h->filename);
 	h->filename=0;
 	free(h);
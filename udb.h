@@ -1,12 +1,50 @@
 #ifndef UDB_H
 #define UDB_H
 #include <stddef.h>
+#include <sys/types.h>
 struct udb_handle;
+/* a record returned by udb_lookup_many(). data holds every field of the
+ * record, each ended by a newline. data is NULL if the key was not found */
+struct udb_view {
+	const char *key;
+	const char *data;
+	size_t len;
+};
+struct udb_batch {
+	unsigned nr_views;
+	char *text; /* backing store for the views */
+	struct udb_view view[]; /* one per key, in the order they were asked */
+};
+struct udb_stats {
+	unsigned generation;
+	int records;
+	int dead_records; /* replaced or deleted, reclaimed by udb_compact() */
+	unsigned pending_writes; /* keys written since the last reload */
+	unsigned long index_bytes; /* memory used by the keys and offsets */
+	unsigned long lookups, hits;
+	unsigned long bloom_bytes; /* size of the filter, 0 if disabled */
+	unsigned long bloom_rejects; /* misses answered by the filter alone */
+	unsigned long bloom_false_positives; /* misses the filter let through */
+	double bloom_fp_measured, bloom_fp_expected;
+};
+/* parse_key_cb may run on several threads at once, see udb_open() */
 struct udb_handle *udb_open(const char *filename, int (*parse_key_cb)(const char *line, char *key_out, size_t max));
 void udb_refresh(struct udb_handle *h);
+void udb_set_background(struct udb_handle *h, int enable);
+void udb_set_build_threads(struct udb_handle *h, unsigned max_threads, off_t chunk_min);
+unsigned udb_generation(struct udb_handle *h);
+void udb_set_bloom(struct udb_handle *h, unsigned bits_per_key);
+void udb_get_stats(struct udb_handle *h, struct udb_stats *st);
 int udb_lookup(struct udb_handle *h, const char *key);
 int udb_read_field(struct udb_handle *h, char *buf, size_t len);
+struct udb_batch *udb_lookup_many(struct udb_handle *h, const char *const *keys, unsigned nr_keys);
+void udb_batch_free(struct udb_batch *b);
+int udb_foreach(struct udb_handle *h, int (*cb)(void *p, const char *key), void *p);
+int udb_view_field(const struct udb_view *v, unsigned n, const char **field, size_t *len);
 int udb_ignore_field(struct udb_handle *h);
+int udb_put(struct udb_handle *h, const char *const *fields, unsigned nr_fields);
+int udb_delete(struct udb_handle *h, const char *key);
+int udb_compact(struct udb_handle *h);
 void udb_close(struct udb_handle *h);
 #endif
 
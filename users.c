@@ -50,9 +50,14 @@
  */
 
 #include <stdlib.h>
+#include <pthread.h>
+#ifdef __GLIBC__
+#include <crypt.h>
+#endif
 
 #include "users.h"
 #include "bot.h"
+#include "mode.h"
 
 static struct user *usr;
 static struct user *trv;
@@ -60,6 +65,44 @@ static struct user *lag;
 static FILE *fp;
 static long int total_users = 0;
 
+/* a login that was already checked on a worker thread, see login_verified() */
+static struct {
+	int set;
+	int ok;
+	char name[USERINFO];
+	char passwd[MAXDATASIZE];
+	char hash[MAXDATASIZE];
+} verified;
+
+#ifndef __GLIBC__
+static pthread_mutex_t crypt_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/* crypt() keeps its answer in one static buffer, and passwords are also
+ * checked on the worker threads. this copies the answer out, using
+ * crypt_r() where there is one and taking turns where there isn't.
+ */
+
+static void crypt_copy( const char *key, const char *salt, char *hash, size_t max )
+{
+#ifdef __GLIBC__
+	struct crypt_data data;
+	const char *res;
+
+	data.initialized = 0;
+	res = crypt_r( key, salt, &data );
+	snprintf( hash, max, "%s", res ? res : "" );
+#else
+	const char *res;
+
+	pthread_mutex_lock( &crypt_lock );
+	res = crypt( key, salt );
+	snprintf( hash, max, "%s", res ? res : "" );
+	pthread_mutex_unlock( &crypt_lock );
+#endif
+}
+
 
 /* call only once during the entire course of the program! or else... */
 int loadusers( char *filename )
@@ -149,7 +192,7 @@ void adduser( char *pass, char *name, char *newupass, char *newuname )
 {
 	char sndmsg[MAXDATASIZE];
 	char salt[MAXDATASIZE];
-	char *hash;
+	char hash[MAXDATASIZE];
 
 	/* validate user before we do what they want */
 	if( valid_login( name, pass ) ) {
@@ -185,7 +228,7 @@ void adduser( char *pass, char *name, char *newupass, char *newuname )
 
 	get_salt( salt );
 
-	hash = crypt( newupass, salt );
+	crypt_copy( newupass, salt, hash, sizeof( hash ) );
 
 	snprintf( trv->data, MAXDATASIZE, "%s %s 0", newuname, hash );
 
@@ -205,7 +248,7 @@ void chpass( char *passwd, char *name, char *newpass )
 	char sndmsg[MAXDATASIZE];
 	char tmpray[MAXDATASIZE];
 	char salt[MAXDATASIZE];
-	char *hash;
+	char hash[MAXDATASIZE];
 
 	/* validate user before we do what they want */
 	if( !valid_login( name, passwd ) ) {
@@ -226,7 +269,7 @@ void chpass( char *passwd, char *name, char *newpass )
 
 	get_salt( salt );
 
-	hash = crypt( newpass, salt );
+	crypt_copy( newpass, salt, hash, sizeof( hash ) );
 	snprintf( trv->data, MAXDATASIZE, "%s %s %s", name, hash, tmpray );
 
 	snprintf( sndmsg, MAXDATASIZE, "privmsg %s :password changed.", MSGTO );
@@ -281,35 +324,91 @@ int valid_user( char *nickname )
 }
 
 
+/* copy the hashed password of the user trv points at */
+
+static void stored_hash( char *hash )
+{
+	/* skip the name, the password follows in hashed form */
+	chop( trv->data, hash, chop( trv->data, hash, 0, ' ' ), ' ' );
+}
+
+
+/* returns true/false. safe to call from any thread, it only looks at its arguments */
+
+int check_password( const char *passwd, const char *hashed )
+{
+	char salt[3];
+	char hash[MAXDATASIZE];
+
+	salt[0] = hashed[0]; /* the salt is held in the first two characters */
+	salt[1] = salt[0] ? hashed[1] : '\0';
+	salt[2] = '\0'; /* since this is address space on the stack, i will null terminate it explicitly */
+
+	crypt_copy( passwd, salt, hash, sizeof( hash ) );
+
+	if( strcmp( hash, hashed ) ) return 0; /* passwd hashes don't match */
+	return 1;
+}
+
+
 /* returns true/false */
 
 int valid_password( char *passwd )
 {
-	int x;
 	char checklistpword[MAXDATASIZE];
-	char salt[MAXDATASIZE];
-	char *hash;
 
-	x = chop( trv->data, checklistpword, 0, ' ' );
-	x = chop( trv->data, checklistpword, x, ' ' ); /* this now holds the password in hashed form. */
+	stored_hash( checklistpword );
+	return check_password( passwd, checklistpword );
+}
 
-	salt[0] = checklistpword[0]; /* the salt is held in the first two characters */
-	salt[1] = checklistpword[1];
-	salt[2] = '\0'; /* since this is address space on the stack, i will null terminate it explicitly */
 
-	hash = crypt( passwd, salt );
+/* the hashed password of a user, so a worker thread can check a password
+ * against it with check_password(). returns 0 if there is no such user.
+ */
 
-	if( strcmp( hash, checklistpword ) ) return 0; /* passwd hashes don't match */
+int user_password_hash( char *name, char *hash, size_t max )
+{
+	char checklistpword[MAXDATASIZE];
+
+	if( !valid_user( name ) ) return 0;
+	stored_hash( checklistpword );
+	snprintf( hash, max, "%s", checklistpword );
 	return 1;
 }
 
 
+/* the commands call valid_login() themselves. when the password has already
+ * been checked on a worker, this tells valid_login() the answer for that name,
+ * password and hash, so crypt() isn't run again on the main thread. name NULL
+ * forgets it.
+ */
+
+void login_verified( const char *name, const char *passwd, const char *hash, int ok )
+{
+	verified.set = 0;
+	if( !name ) return;
+	snprintf( verified.name, sizeof( verified.name ), "%s", name );
+	snprintf( verified.passwd, sizeof( verified.passwd ), "%s", passwd );
+	snprintf( verified.hash, sizeof( verified.hash ), "%s", hash );
+	verified.ok = ok;
+	verified.set = 1;
+}
+
+
 /*this is basically a wrapper for the two functions that verify users. */
 int valid_login( char *name, char *passwd )
 {
 	int position = 0;
+	char checklistpword[MAXDATASIZE];
 
 	if( !valid_user( name ) ) return 0;
+
+	/* only trust the answer if the password hasn't changed since */
+	if( verified.set && !strcmp( verified.name, name ) && !strcmp( verified.passwd, passwd ) ) {
+		stored_hash( checklistpword );
+		if( !strcmp( verified.hash, checklistpword ) ) return verified.ok;
+	  }
+
 	position = valid_password( passwd );
 	return position;
 }
@@ -324,8 +423,7 @@ void oppeople( char *chan, char *passwd, char *name, char *nick )
 
 
 	if( valid_login( name, passwd ) ){
-		snprintf( sndmsg, MAXDATASIZE, "mode %s +o %s", chan, nick );
-		send_irc_message( sndmsg );
+		mode_queue( chan, "+o", nick );
 		return;
 	  }
 
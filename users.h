@@ -70,6 +70,9 @@ void op( char *nick, char *channel );
 void adduser(  char *pass, char *name, char *newupass, char *newuname );
 int valid_password( char *passwd );
 int valid_login( char *name, char *passwd );
+int check_password( const char *passwd, const char *hashed );
+int user_password_hash( char *name, char *hash, size_t max );
+void login_verified( const char *name, const char *passwd, const char *hash, int ok );
 void whois( char *name );
 void saveusers( char *filename );
 void rmuser( char *passwd, char *name, char *rmname );
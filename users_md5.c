@@ -50,9 +50,11 @@
  */
 
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "users.h"
 #include "bot.h"
+#include "mode.h"
 #include "md5crypt.h"
 
 static struct user *usr;
@@ -61,6 +63,20 @@ static struct user *lag;
 static FILE *fp;
 static long int total_users = 0;
 
+/* a login that was already checked on a worker thread, see login_verified() */
+static struct {
+	int set;
+	int ok;
+	char name[USERINFO];
+	char passwd[MAXDATASIZE];
+	char hash[MAXDATASIZE];
+} verified;
+
+/* crypt_md5() keeps its answer in static buffers, and passwords are also
+ * checked on the worker threads, so everyone takes turns with it.
+ */
+static pthread_mutex_t md5_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 /* call only once during the entire course of the program! or else... */
 int loadusers( char *filename )
@@ -183,9 +199,11 @@ void adduser( char *pass, char *name, char *newupass, char *newuname )
 	trv = lag->next;
 	trv->next = NULL;
 
+	pthread_mutex_lock( &md5_lock );
 	hash = crypt_md5( newupass , saltgen_md5(rand()+getpid()));
 
 	snprintf( trv->data, MAXDATASIZE, "%s %s 0", newuname, hash );
+	pthread_mutex_unlock( &md5_lock );
 
 	++total_users;
 	snprintf( sndmsg, MAXDATASIZE, "privmsg %s :user: %s added.", name, newuname );
@@ -221,9 +239,11 @@ void chpass( char *passwd, char *name, char *newpass )
 	x = chop( trv->data, tmpray, x, ' ' ); /* these two calls to chop() are to init x. the data is discarded */
 	strncpy( tmpray, &trv->data[x], MAXDATASIZE );
 
+	pthread_mutex_lock( &md5_lock );
 	hash = crypt_md5( newpass, saltgen_md5(rand()+getpid()));
 
 	snprintf( trv->data, MAXDATASIZE, "%s %s %s", name, hash, tmpray );
+	pthread_mutex_unlock( &md5_lock );
 
 	snprintf( sndmsg, MAXDATASIZE, "privmsg %s :password changed.", MSGTO );
 	send_irc_message( sndmsg );
@@ -277,27 +297,87 @@ int valid_user( char *nickname )
 }
 
 
+/* copy the hashed password of the user trv points at */
+
+static void stored_hash( char *hash )
+{
+	/* skip the name, the password follows in hashed form */
+	chop( trv->data, hash, chop( trv->data, hash, 0, ' ' ), ' ' );
+}
+
+
+/* returns true/false. safe to call from any thread, it only looks at its arguments */
+
+int check_password( const char *passwd, const char *hashed )
+{
+	int ok;
+
+	pthread_mutex_lock( &md5_lock );
+	ok = compare_md5( passwd, hashed );
+	pthread_mutex_unlock( &md5_lock );
+
+	return ok ? 1 : 0; /* 0 if the passwd hashes don't match */
+}
+
+
 /* returns true/false */
 
 int valid_password( char *passwd )
 {
-	int x;
 	char checklistpword[MAXDATASIZE];
 
-	x = chop( trv->data, checklistpword, 0, ' ' );
-	x = chop( trv->data, checklistpword, x, ' ' ); /* this now holds the password in hashed form. */
+	stored_hash( checklistpword );
+	return check_password( passwd, checklistpword );
+}
+
 
-	if( !compare_md5( passwd, checklistpword ) ) return 0; /* passwd hashes don't match */
+/* the hashed password of a user, so a worker thread can check a password
+ * against it with check_password(). returns 0 if there is no such user.
+ */
+
+int user_password_hash( char *name, char *hash, size_t max )
+{
+	char checklistpword[MAXDATASIZE];
+
+	if( !valid_user( name ) ) return 0;
+	stored_hash( checklistpword );
+	snprintf( hash, max, "%s", checklistpword );
 	return 1;
 }
 
 
+/* the commands call valid_login() themselves. when the password has already
+ * been checked on a worker, this tells valid_login() the answer for that name,
+ * password and hash, so the hash isn't worked out again on the main thread.
+ * name NULL forgets it.
+ */
+
+void login_verified( const char *name, const char *passwd, const char *hash, int ok )
+{
+	verified.set = 0;
+	if( !name ) return;
+	snprintf( verified.name, sizeof( verified.name ), "%s", name );
+	snprintf( verified.passwd, sizeof( verified.passwd ), "%s", passwd );
+	snprintf( verified.hash, sizeof( verified.hash ), "%s", hash );
+	verified.ok = ok;
+	verified.set = 1;
+}
+
+
 /*this is basically a wrapper for the two functions that verify users. */
 int valid_login( char *name, char *passwd )
 {
 	int position = 0;
+	char checklistpword[MAXDATASIZE];
 
 	if( !valid_user( name ) ) return 0;
+
+	/* only trust the answer if the password hasn't changed since */
+	if( verified.set && !strcmp( verified.name, name ) && !strcmp( verified.passwd, passwd ) ) {
+		stored_hash( checklistpword );
+		if( !strcmp( verified.hash, checklistpword ) ) return verified.ok;
+	  }
+
 	position = valid_password( passwd );
 	return position;
 }
@@ -312,8 +392,7 @@ void oppeople( char *chan, char *passwd, char *name, char *nick )
 
 
 	if( valid_login( name, passwd ) ){
-		snprintf( sndmsg, MAXDATASIZE, "mode %s +o %s", chan, nick );
-		send_irc_message( sndmsg );
+		mode_queue( chan, "+o", nick );
 		return;
 	  }
 
@@ -779,13 +779,14 @@ enum {MAXMEM = 1024};
  * in, the size of the buffer, and a source string.
  */
 void wcalc(char *t, size_t n, const char *s) {
-	static Node nb[MAXMEM];
+	/* one set per thread, the pool can run several of these at once */
+	static __thread Node nb[MAXMEM];
 	ALLOC(Node) na = { nb, 0, COUNTOF(nb) };
 
-	static double db[MAXMEM];
+	static __thread double db[MAXMEM];
 	ALLOC(double) da = { db, 0, COUNTOF(db) };
 
-	static ppNode pb[MAXMEM];
+	static __thread ppNode pb[MAXMEM];
 	ALLOC(ppNode) pa = { pb, 0, COUNTOF(pb) };
 
 	Node *root;
@@ -0,0 +1,344 @@
+/* work.c : a pool of threads for slow commands, replies kept in order */
+/*
+ * a job is run() on one of the pool's threads, then done() is called on the
+ * main thread with the reply that run() wrote. run() must only touch what
+ * it was given, the bot's globals belong to the main thread.
+ *
+ * finished jobs are pushed on a lock free stack, and the first one pushed
+ * on an empty stack writes a byte to a pipe. main_loop() selects on the
+ * pipe and calls work_collect(), which takes the whole stack in one go.
+ *
+ * every job belongs to a target, the nick or channel its reply goes to.
+ * done() is called in the order the jobs for a target were submitted, a
+ * quick job waits for slower ones ahead of it. lines sent to a target with
+ * jobs outstanding are held behind them by work_hold(), so a conversation
+ * comes out in the order it went in.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "bot.h"
+#include "strhash.h"
+#include "work.h"
+
+#define MAX_THREADS 16
+#define TARGET_BUCKETS 64
+#define TARGET_MAX 128 /* longer names are never held */
+
+struct target;
+
+struct job {
+	void (*run)(void *arg, char *reply, size_t max); /* NULL for a held line */
+	void (*done)(void *arg, const char *reply);
+	void *arg;
+	struct target *target;
+	struct job *next; /* in the target's queue */
+	struct job *link; /* in the todo queue, then on the finished stack */
+	int finished;
+	char reply[MAXDATASIZE];
+};
+
+struct target {
+	char name[TARGET_MAX];
+	struct job *head, **tail;
+	struct target *next; /* in the bucket */
+	struct target *next_dirty; /* in work_collect()'s list */
+	int dirty;
+};
+
+/* everything below is only used by the main thread, except where noted */
+static struct target *targets[TARGET_BUCKETS];
+static struct target *flushing; /* lines to this target are not held */
+static int nr_threads;
+static unsigned nr_pending, max_pending;
+static unsigned long nr_submitted, nr_inline, nr_done, nr_held;
+
+/* jobs waiting for a thread, shared under todo_lock */
+static pthread_mutex_t todo_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t todo_wake=PTHREAD_COND_INITIALIZER;
+static struct job *todo_head, **todo_tail=&todo_head;
+
+/* jobs run by the pool. only touched with atomics */
+static struct job *finished;
+static int wake_fd[2]={ -1, -1 };
+
+static struct target **bucket_of(const char *name)
+{
+	return &targets[name_bucket(name, TARGET_BUCKETS)];
+}
+
+static struct target *find_target(const char *name)
+{
+	struct target *t;
+
+	for(t=*bucket_of(name);t;t=t->next) {
+		if(!strcasecmp(t->name, name)) return t;
+	}
+	return 0;
+}
+
+static struct target *get_target(const char *name)
+{
+	struct target *t, **b;
+
+	t=find_target(name);
+	if(t) return t;
+	t=calloc(1, sizeof *t);
+	if(!t) {
+		perror("calloc()");
+		return 0;
+	}
+	snprintf(t->name, sizeof t->name, "%s", name);
+	t->tail=&t->head;
+	b=bucket_of(name);
+	t->next=*b;
+	*b=t;
+	return t;
+}
+
+static void free_target(struct target *t)
+{
+	struct target **prev;
+
+	for(prev=bucket_of(t->name);*prev!=t;prev=&(*prev)->next) ;
+	*prev=t->next;
+	free(t);
+}
+
+static void append(struct target *t, struct job *j)
+{
+	j->target=t;
+	j->next=0;
+	*t->tail=j;
+	t->tail=&j->next;
+	if(++nr_pending>max_pending) max_pending=nr_pending;
+}
+
+/** hand the replies at the front of t's queue over, up to the first job
+ * that is still running */
+static void flush(struct target *t)
+{
+	struct target *old=flushing;
+	struct job *j;
+
+	flushing=t;
+	while((j=t->head) && j->finished) {
+		t->head=j->next;
+		if(!t->head) t->tail=&t->head;
+		nr_pending--;
+		if(j->done) {
+			j->done(j->arg, j->reply);
+			nr_done++;
+		} else {
+			send_irc_message(j->reply);
+		}
+		free(j);
+	}
+	flushing=old;
+}
+
+/** runs on the pool's threads */
+static void *worker_main(void *unused)
+{
+	struct job *j, *top;
+
+	(void)unused;
+	for(;;) {
+		pthread_mutex_lock(&todo_lock);
+		while(!todo_head) {
+			pthread_cond_wait(&todo_wake, &todo_lock);
+		}
+		j=todo_head;
+		todo_head=j->link;
+		if(!todo_head) todo_tail=&todo_head;
+		pthread_mutex_unlock(&todo_lock);
+
+		j->reply[0]=0;
+		j->run(j->arg, j->reply, sizeof j->reply);
+
+		top=__atomic_load_n(&finished, __ATOMIC_RELAXED);
+		do {
+			j->link=top;
+		} while(!__atomic_compare_exchange_n(&finished, &top, j, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		/* only the push onto an empty stack needs to wake main_loop(),
+		 * work_collect() takes everything on it */
+		if(!top && write(wake_fd[1], "", 1)<0 && errno!=EAGAIN) {
+			perror("write()");
+		}
+	}
+	return 0;
+}
+
+/* start n threads. with 0, or if no thread could be started, jobs are run
+ * as soon as they are submitted.
+ * returns 0 on failure */
+int work_init(int n)
+{
+	pthread_t thread;
+	int i;
+
+	if(n>MAX_THREADS) n=MAX_THREADS;
+	if(n<=0) return 1; /* success */
+
+	if(pipe(wake_fd)) {
+		perror("pipe()");
+		return 0;
+	}
+	for(i=0;i<2;i++) {
+		fcntl(wake_fd[i], F_SETFL, fcntl(wake_fd[i], F_GETFL)|O_NONBLOCK);
+		fcntl(wake_fd[i], F_SETFD, FD_CLOEXEC);
+	}
+	for(nr_threads=0;nr_threads<n;nr_threads++) {
+		if(pthread_create(&thread, 0, worker_main, 0)) {
+			perror("pthread_create()");
+			break;
+		}
+		pthread_detach(thread);
+	}
+	return 1; /* success */
+}
+
+/* the descriptor main_loop() selects on, -1 if there is no pool */
+int work_fd(void)
+{
+	return nr_threads ? wake_fd[0] : -1;
+}
+
+/* queue run(arg, reply, max) for the pool, and done(arg, reply) to be called
+ * on the main thread after it, and after every earlier job for target.
+ * returns 0 if there was no memory, nothing is run or called then */
+int work_submit(const char *target, void (*run)(void *arg, char *reply, size_t max), void (*done)(void *arg, const char *reply), void *arg)
+{
+	struct target *t;
+	struct job *j;
+
+	assert(target!=NULL);
+	assert(run!=NULL);
+	assert(done!=NULL);
+
+	j=malloc(sizeof *j);
+	if(!j) {
+		perror("malloc()");
+		return 0;
+	}
+	j->run=run;
+	j->done=done;
+	j->arg=arg;
+	j->finished=0;
+	nr_submitted++;
+
+	if(!nr_threads) {
+		/* there is never anything to wait for */
+		nr_inline++;
+		j->reply[0]=0;
+		run(arg, j->reply, sizeof j->reply);
+		done(arg, j->reply);
+		nr_done++;
+		free(j);
+		return 1;
+	}
+	t=get_target(target);
+	if(!t) {
+		free(j);
+		return 0;
+	}
+	append(t, j);
+
+	j->link=0;
+	pthread_mutex_lock(&todo_lock);
+	*todo_tail=j;
+	todo_tail=&j->link;
+	pthread_cond_signal(&todo_wake);
+	pthread_mutex_unlock(&todo_lock);
+	return 1;
+}
+
+/* call done() for the jobs the pool has finished, where their turn has come.
+ * returns the number of jobs collected */
+unsigned work_collect(void)
+{
+	struct job *list, *j;
+	struct target *dirty=0, *t;
+	char buf[64];
+	unsigned n=0;
+
+	if(!nr_threads) return 0;
+	/* empty the pipe first, a job pushed after this writes to it again */
+	while(read(wake_fd[0], buf, sizeof buf)>0) ;
+	list=__atomic_exchange_n(&finished, (struct job*)0, __ATOMIC_ACQUIRE);
+
+	for(j=list;j;j=j->link) {
+		j->finished=1;
+		t=j->target;
+		if(!t->dirty) {
+			t->dirty=1;
+			t->next_dirty=dirty;
+			dirty=t;
+		}
+		n++;
+	}
+	/* the jobs may be freed from here on */
+	while((t=dirty)) {
+		dirty=t->next_dirty;
+		t->dirty=0;
+		flush(t);
+		if(!t->head) free_target(t);
+	}
+	return n;
+}
+
+/* called by send_irc_message() for every line. a PRIVMSG or NOTICE to a
+ * target that is waiting on the pool is queued behind its jobs.
+ * returns 1 if the line was held */
+int work_hold(const char *line)
+{
+	const char *start=line;
+	char name[TARGET_MAX];
+	struct target *t;
+	struct job *j;
+	size_t len;
+
+	line+=strspn(line, " ");
+	if(!strncasecmp(line, "PRIVMSG ", 8)) {
+		line+=8;
+	} else if(!strncasecmp(line, "NOTICE ", 7)) {
+		line+=7;
+	} else {
+		return 0;
+	}
+	line+=strspn(line, " ");
+	len=strcspn(line, " ");
+	if(!len || len>=sizeof name) return 0;
+	memcpy(name, line, len);
+	name[len]=0;
+
+	t=find_target(name);
+	if(!t || t==flushing) return 0;
+
+	j=malloc(sizeof *j);
+	if(!j) return 0; /* send it out of turn */
+	j->run=0;
+	j->done=0;
+	j->arg=0;
+	j->finished=1;
+	snprintf(j->reply, sizeof j->reply, "%s", start);
+	append(t, j);
+	nr_held++;
+	return 1;
+}
+
+void work_stats(char *dest, size_t max)
+{
+	snprintf(dest, max, "work: %d threads, %lu jobs, %lu run inline, %lu done, %lu lines held, %u pending (most %u)",
+		nr_threads, nr_submitted, nr_inline, nr_done, nr_held, nr_pending, max_pending);
+}
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4
@@ -0,0 +1,13 @@
+#ifndef WORK_H
+#define WORK_H
+#include <stddef.h>
+int work_init(int nr_threads);
+int work_fd(void);
+int work_submit(const char *target, void (*run)(void *arg, char *reply, size_t max), void (*done)(void *arg, const char *reply), void *arg);
+unsigned work_collect(void);
+int work_hold(const char *line);
+void work_stats(char *dest, size_t max);
+#endif
+
+/*****************************----end code----*****************************/
+// vi: noet sts=0 ts=4 sw=4